@@ -59,6 +59,14 @@ struct Response* createResponseForRequest(const struct Request* request, struct
                                        "<tr><td>Heap string reallocations</td><td>%" PRId64 "</td></tr>\n"
                                        "<tr><td>Heap string frees</td><td>%" PRId64 "</td></tr>\n"
                                        "<tr><td>Heap string total bytes allocated</td><td>%" PRId64 "</td></tr>\n"
+                                       "<tr><td>Connection arena blocks allocated</td><td>%" PRId64 "</td></tr>\n"
+                                       "<tr><td>Connections reused from the pool</td><td>%" PRId64 "</td></tr>\n"
+                                       "<tr><td>Connections allocated because the pool was empty</td><td>%" PRId64 "</td></tr>\n"
+                                       "<tr><td>Connections rejected because the server was busy</td><td>%" PRId64 "</td></tr>\n"
+                                       "<tr><td>Keep-alive connections closed after sitting idle</td><td>%" PRId64 "</td></tr>\n"
+                                       "<tr><td>Connections closed because the request headers took too long</td><td>%" PRId64 "</td></tr>\n"
+                                       "<tr><td>Connections closed because the request body stalled</td><td>%" PRId64 "</td></tr>\n"
+                                       "<tr><td>Connections closed because the client stopped reading the response</td><td>%" PRId64 "</td></tr>\n"
                                        "</table></html>",
                                        counters.activeConnections,
                                        counters.totalConnections,
@@ -67,7 +75,15 @@ struct Response* createResponseForRequest(const struct Request* request, struct
                                        counters.heapStringAllocations,
                                        counters.heapStringReallocations,
                                        counters.heapStringFrees,
-                                       counters.heapStringTotalBytesReallocated);
+                                       counters.heapStringTotalBytesReallocated,
+                                       counters.arenaBlockAllocations,
+                                       counters.connectionPoolHits,
+                                       counters.connectionPoolMisses,
+                                       counters.connectionsRejected,
+                                       counters.idleTimeouts,
+                                       counters.headerTimeouts,
+                                       counters.bodyTimeouts,
+                                       counters.sendTimeouts);
     }
     /* This is the home page of the demo, which links to various things */
     if (0 == strcmp(request->path, "/")) {
@@ -205,7 +221,7 @@ struct Response* createResponseForRequest(const struct Request* request, struct
     {
         /* advanced JSON support - we could have used responseAllocWithFormat but
          I wanted to show it's easy to use regular C strings */
-        char jsonStatus[512];
+        char jsonStatus[2048];
         sprintf(jsonStatus, "{\n"
                 "\t\"active_connections\" : %" PRId64 ",\n"
                 "\t\"total_connections\" : %" PRId64 ",\n"
@@ -214,7 +230,15 @@ struct Response* createResponseForRequest(const struct Request* request, struct
                 "\t\"heap_string_allocations\" : %" PRId64 ",\n"
                 "\t\"heap_string_reallocations\" : %" PRId64 ",\n"
                 "\t\"heap_string_frees\" : %" PRId64 ",\n"
-                "\t\"heap_string_total_bytes_allocated\" : %" PRId64 "\n"
+                "\t\"heap_string_total_bytes_allocated\" : %" PRId64 ",\n"
+                "\t\"arena_block_allocations\" : %" PRId64 ",\n"
+                "\t\"connection_pool_hits\" : %" PRId64 ",\n"
+                "\t\"connection_pool_misses\" : %" PRId64 ",\n"
+                "\t\"connections_rejected\" : %" PRId64 ",\n"
+                "\t\"idle_timeouts\" : %" PRId64 ",\n"
+                "\t\"header_timeouts\" : %" PRId64 ",\n"
+                "\t\"body_timeouts\" : %" PRId64 ",\n"
+                "\t\"send_timeouts\" : %" PRId64 "\n"
                 "}",
                 counters.activeConnections,
                 counters.totalConnections,
@@ -223,7 +247,15 @@ struct Response* createResponseForRequest(const struct Request* request, struct
                 counters.heapStringAllocations,
                 counters.heapStringReallocations,
                 counters.heapStringFrees,
-                counters.heapStringTotalBytesReallocated);
+                counters.heapStringTotalBytesReallocated,
+                counters.arenaBlockAllocations,
+                counters.connectionPoolHits,
+                counters.connectionPoolMisses,
+                counters.connectionsRejected,
+                counters.idleTimeouts,
+                counters.headerTimeouts,
+                counters.bodyTimeouts,
+                counters.sendTimeouts);
         struct Response* response = responseAllocWithFormat(200, "OK", "application/json", "%s" , jsonStatus);
         return response;
     }
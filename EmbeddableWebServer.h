@@ -22,6 +22,8 @@ EWS runs on Windows, Linux, and Mac OS X. It currently requires dynamic memory e
  It is *not suitable for Internet serving* because it has not been thoroughly designed+tested for security.
 It uses a thread per connection model, where each HTTP connection is handled by a newly spawned thread. This lets
  certain requests take a long time to handle while other requests can still quickly be handled.
+On Linux you can instead set server.model = ServerModelEventLoop to multiplex all connections on one epoll thread, or
+ ServerModelIOUring to do the same with io_uring.
 
 Tips:
 * Use the heapStringAppend*(&response->body) functions to dynamically build a body (see the HTML form POST demo)
@@ -72,22 +74,135 @@ int main() {
 
 /* Quick nifty options */
 static bool OptionPrintWholeRequest = false;
-/* /status page - makes quite a few things take a lock to update counters but it doesn't make much of a difference. This isn't something like Nginx or Haywire*/
+/* /status page - makes quite a few things bump atomic counters but it doesn't make much of a difference. This isn't something like Nginx or Haywire*/
 static bool OptionIncludeStatusPageAndCounters = true;
 /* If using responseAllocServeFileFromRequestPath and no index.html is found, serve up the directory */
 static bool OptionListDirectoryContents = true;
 /* Print the entire server response to every request */
 static bool OptionPrintResponse = false;
 
-/* These bound the memory used by a request. The headers used to be dynamically allocated but I've made them hard coded because: 1. Memory used by a request should be bounded 2. It was responsible for 2 * headersCount allocations every request */
+/* All of the sizes below can be overridden by defining them before you include this file, for a device that's short on
+ memory or a server that sees long URLs and lots of headers */
+
+/* These bound the memory used by a request. The headers used to be a malloc per header name and value, which was 2 * headersCount allocations every request. Now the headers array and the strings they point at come out of the connection's arena. They start at the INITIAL sizes and double as a request needs more, up to the MAX ones */
+#ifndef REQUEST_MAX_HEADERS
 #define REQUEST_MAX_HEADERS 64
+#endif
+#ifndef REQUEST_HEADERS_MAX_MEMORY
 #define REQUEST_HEADERS_MAX_MEMORY (8 * 1024)
+#endif
+#ifndef REQUEST_HEADERS_INITIAL_COUNT
+#define REQUEST_HEADERS_INITIAL_COUNT 16
+#endif
+#ifndef REQUEST_HEADERS_INITIAL_MEMORY
+#define REQUEST_HEADERS_INITIAL_MEMORY 1024
+#endif
+#ifndef REQUEST_MAX_BODY_LENGTH
 #define REQUEST_MAX_BODY_LENGTH (128 * 1024 * 1024) /* (rather arbitrary) */
+#endif
+/* request->method, request->version and request->path/pathDecoded, including the null character. Longer ones are truncated */
+#ifndef REQUEST_METHOD_MAX_LENGTH
+#define REQUEST_METHOD_MAX_LENGTH 64
+#endif
+#ifndef REQUEST_VERSION_MAX_LENGTH
+#define REQUEST_VERSION_MAX_LENGTH 16
+#endif
+#ifndef REQUEST_PATH_MAX_LENGTH
+#define REQUEST_PATH_MAX_LENGTH 1024
+#endif
+#if REQUEST_MAX_HEADERS > 65535
+#error "request->headerIndexByID is 16 bits so REQUEST_MAX_HEADERS can't be more than 65535"
+#endif
+
+/* Define EWS_HEADER_SLICES to 1 and header names/values point straight into the connection's receive buffer instead of
+ being copied into request->headersStringPool. That buffer is sendRecvBuffer unless a request's headers don't fit, in
+ which case it grows (up to REQUEST_HEADER_SLICES_MAX_MEMORY) for as long as that request needs it */
+#ifndef EWS_HEADER_SLICES
+#define EWS_HEADER_SLICES 0
+#endif
+#ifndef REQUEST_HEADER_SLICES_MAX_MEMORY
+#define REQUEST_HEADER_SLICES_MAX_MEMORY (256 * 1024)
+#endif
+/* The headers of one part of a multipart/form-data body have to fit in this */
+#ifndef MULTIPART_MAX_HEADERS_LENGTH
+#define MULTIPART_MAX_HEADERS_LENGTH (4 * 1024)
+#endif
+/* RFC 2046 says a boundary is at most 70 characters */
+#ifndef MULTIPART_MAX_BOUNDARY_LENGTH
+#define MULTIPART_MAX_BOUNDARY_LENGTH 70
+#endif
 
-/* the buffer in connection used for sending and receiving. Should be big enough to fread(buffer) -> send(buffer) */
+/* the buffer in connection used for sending and receiving, unless server->connectionBufferSize or server->profile say
+ otherwise. Should be big enough to fread(buffer) -> send(buffer) */
+#ifndef SEND_RECV_BUFFER_SIZE
 #define SEND_RECV_BUFFER_SIZE (16 * 1024)
+#endif
 /* contains the Response HTTP status and headers */
+#ifndef RESPONSE_HEADER_SIZE
 #define RESPONSE_HEADER_SIZE 1024
+#endif
+/* struct Connection keeps what's used for every request on its own cache lines */
+#ifndef EWS_CACHE_LINE_SIZE
+#define EWS_CACHE_LINE_SIZE 64
+#endif
+#if defined(_MSC_VER)
+#define EWS_CACHE_LINE_ALIGNED __declspec(align(EWS_CACHE_LINE_SIZE))
+#else
+#define EWS_CACHE_LINE_ALIGNED __attribute__((aligned(EWS_CACHE_LINE_SIZE)))
+#endif
+/* Each connection's arena (see struct Arena) mallocs blocks of at least this much. After a request that needed several,
+ the one block it keeps grows to fit, up to CONNECTION_ARENA_MAX_BLOCK_SIZE. A response body that grows past
+ CONNECTION_ARENA_MAX_STRING moves out to malloc, so big responses don't pin big blocks */
+#ifndef CONNECTION_ARENA_BLOCK_SIZE
+#define CONNECTION_ARENA_BLOCK_SIZE (8 * 1024)
+#endif
+#ifndef CONNECTION_ARENA_MAX_BLOCK_SIZE
+#define CONNECTION_ARENA_MAX_BLOCK_SIZE (64 * 1024)
+#endif
+#ifndef CONNECTION_ARENA_MAX_STRING
+#define CONNECTION_ARENA_MAX_STRING (64 * 1024)
+#endif
+
+/* Each accept loop keeps up to this many finished connections to hand out again when server->connectionPoolSize is 0.
+ With server->connectionPoolHugePages they're carved out of slabs this big */
+#ifndef CONNECTION_POOL_DEFAULT_SIZE
+#define CONNECTION_POOL_DEFAULT_SIZE 32
+#endif
+#ifndef CONNECTION_POOL_SLAB_SIZE
+#define CONNECTION_POOL_SLAB_SIZE (2 * 1024 * 1024)
+#endif
+
+/* ServerModelThreadPool defaults, used when server->threadPoolSize or server->threadPoolMaxQueuedConnections are 0 */
+#ifndef THREAD_POOL_DEFAULT_SIZE
+#define THREAD_POOL_DEFAULT_SIZE 16
+#endif
+#ifndef THREAD_POOL_DEFAULT_MAX_QUEUED_CONNECTIONS
+#define THREAD_POOL_DEFAULT_MAX_QUEUED_CONNECTIONS 256
+#endif
+
+/* HTTP keep-alive defaults, used when server->keepAliveTimeoutSeconds or server->keepAliveMaxRequests are 0 */
+#ifndef KEEP_ALIVE_DEFAULT_TIMEOUT_SECONDS
+#define KEEP_ALIVE_DEFAULT_TIMEOUT_SECONDS 5
+#endif
+#ifndef KEEP_ALIVE_DEFAULT_MAX_REQUESTS
+#define KEEP_ALIVE_DEFAULT_MAX_REQUESTS 100
+#endif
+
+/* Slow client defaults, used when server->headerTimeoutSeconds, bodyTimeoutSeconds or sendTimeoutSeconds are 0 */
+#ifndef HEADER_TIMEOUT_DEFAULT_SECONDS
+#define HEADER_TIMEOUT_DEFAULT_SECONDS 10
+#endif
+#ifndef BODY_TIMEOUT_DEFAULT_SECONDS
+#define BODY_TIMEOUT_DEFAULT_SECONDS 30
+#endif
+#ifndef SEND_TIMEOUT_DEFAULT_SECONDS
+#define SEND_TIMEOUT_DEFAULT_SECONDS 30
+#endif
+
+/* How long serverStop waits for requests in progress when server->stopDrainSeconds is 0 */
+#ifndef STOP_DRAIN_DEFAULT_SECONDS
+#define STOP_DRAIN_DEFAULT_SECONDS 10
+#endif
 
 #define EMBEDDABLE_WEB_SERVER_VERSION_STRING "1.1.3"
 #define EMBEDDABLE_WEB_SERVER_VERSION 0x00010103 // major = [31:16] minor = [15:8] build = [7:0]
@@ -109,8 +224,27 @@ static bool OptionPrintResponse = false;
 #include <time.h>
 #include <signal.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <inttypes.h>
 
+/* requestParse looks for delimiters 16 or 32 bytes at a time with SSE2/AVX2 when the compiler targets them (SSE2 is
+ always there on x86-64, AVX2 needs -mavx2 or /arch:AVX2). Define EWS_NO_SIMD to use the plain byte loop everywhere */
+#if !defined(EWS_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define EWS_SIMD_SSE2 1
+#else
+#define EWS_SIMD_SSE2 0
+#endif
+#if !defined(EWS_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define EWS_SIMD_AVX2 1
+#else
+#define EWS_SIMD_AVX2 0
+#endif
+#if defined(_MSC_VER) && (EWS_SIMD_SSE2 || EWS_SIMD_AVX2)
+#include <intrin.h> // _BitScanForward
+#endif
+
 #ifdef WIN32
 #include <WinSock2.h>
 #include <Ws2tcpip.h>
@@ -134,13 +268,44 @@ typedef SOCKET sockettype;
 #include <pthread.h>
 #include <ifaddrs.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <dirent.h>
 #include <strings.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sched.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define EWS_HAVE_IO_URING_HEADER 1
+#endif
+#endif
+#endif
 typedef int sockettype;
 #define STDCALL_ON_WIN32
 #define THREAD_RETURN_TYPE void*
 #endif
 
+/* ServerModelEventLoop is built on epoll */
+#if defined(__linux__) && !defined(EWS_FUZZ_TEST)
+#define EWS_EVENT_LOOP_SUPPORTED 1
+#else
+#define EWS_EVENT_LOOP_SUPPORTED 0
+#endif
+
+/* ServerModelIOUring needs a <linux/io_uring.h> new enough to have IORING_REGISTER_PROBE. Define EWS_NO_IO_URING to
+ leave it out altogether */
+#if EWS_EVENT_LOOP_SUPPORTED && defined(EWS_HAVE_IO_URING_HEADER) && defined(IO_URING_OP_SUPPORTED) && !defined(EWS_NO_IO_URING)
+#define EWS_IO_URING_SUPPORTED 1
+#else
+#define EWS_IO_URING_SUPPORTED 0
+#endif
+
 typedef enum  {
     RequestParseStateMethod,
     RequestParseStatePath,
@@ -151,18 +316,49 @@ typedef enum  {
     RequestParseStateCRLF,
     RequestParseStateCRLFCR,
     RequestParseStateBody,
+    /* Transfer-Encoding: chunked bodies go through these instead of RequestParseStateBody */
+    RequestParseStateChunkSizeStart,
+    RequestParseStateChunkSize,
+    RequestParseStateChunkExtension,
+    RequestParseStateChunkSizeLF,
+    RequestParseStateChunkData,
+    RequestParseStateChunkDataCR,
+    RequestParseStateChunkDataLF,
+    RequestParseStateChunkTrailer,
+    RequestParseStateChunkTrailerLine,
+    RequestParseStateChunkTrailerLF,
     RequestParseStateEatHeaders,
-    RequestParseStateDone
+    RequestParseStateDone,
+    /* The request can't be parsed any further (a broken chunked body). We answer with a 400 and close the connection */
+    RequestParseStateBadRequest
 } RequestParseState;
 
-/* just a calloc'd C string on the heap */
+struct Arena;
+
+/* just a C string that grows as you append to it, on the heap or in a connection's arena */
 struct HeapString {
     char* contents; // null-terminated, at least length+1
     size_t length; // this is updated by the heapString* functions
     size_t capacity;
+    struct Arena* arena; // NULL unless contents come from a connection's arena, like a response body does
+};
+
+/* A bump allocator. Each connection has one, and while a request is handled the responseAlloc functions, response
+ bodies and the parameter tables take their memory from it instead of malloc. It's all thrown away at once after the
+ response is sent, keeping a block around for the next request */
+struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t capacity;
+    size_t used;
+};
+
+struct Arena {
+    struct ArenaBlock* blocks; // the newest one first
+    char* lastAllocation; // this one can grow in place
+    size_t nextBlockSize;
 };
 
-/* a string pointing to the request->headerStringPool */
+/* a string pointing to the request->headerStringPool (or the connection's receive buffer with EWS_HEADER_SLICES) */
 struct PoolString {
     char* contents; // null-terminated
     size_t length;
@@ -173,30 +369,87 @@ struct Header {
     struct PoolString value;
 };
 
+/* Headers the server and most handlers look at. The parser notes where the first of each of these is as it goes, so
+ headerInRequestByID (and headerInRequest for these names) doesn't have to compare against every header */
+typedef enum {
+    HeaderIDUnknown,
+    HeaderIDHost,
+    HeaderIDContentLength,
+    HeaderIDContentType,
+    HeaderIDContentEncoding,
+    HeaderIDTransferEncoding,
+    HeaderIDConnection,
+    HeaderIDExpect,
+    HeaderIDCookie,
+    HeaderIDAuthorization,
+    HeaderIDAccept,
+    HeaderIDAcceptEncoding,
+    HeaderIDAcceptLanguage,
+    HeaderIDUserAgent,
+    HeaderIDReferer,
+    HeaderIDOrigin,
+    HeaderIDIfModifiedSince,
+    HeaderIDIfNoneMatch,
+    HeaderIDRange,
+    HeaderIDUpgrade,
+    HeaderIDCacheControl,
+    HeaderIDXForwardedFor,
+    HeaderIDCount
+} HeaderID;
+
+/* A decoded name=value pair from the query string or a form body. Both are null-terminated too, but values can have %00 in them */
+struct RequestParam {
+    const char* name;
+    size_t nameLength;
+    const char* value;
+    size_t valueLength;
+};
+
+/* Every parameter in a query string or form body in the order they came in. Built the first time you ask for a parameter
+ and freed with the request. This and the decoded strings are a single allocation */
+struct RequestParams {
+    struct RequestParam* params;
+    size_t count;
+    /* open-addressed hash of the names. Each slot is the index + 1 of the first param with that name, 0 is empty */
+    uint32_t* slots;
+    size_t slotsMask;
+};
+
 /* You'll look directly at this struct to handle HTTP requests. It's initialized
-   by setting everything to 0 */
+   by setting everything to 0. The parser works through the first few fields (the
+   parse state, lengths and offsets) for every byte, so those come first where they share a couple of cache lines. The
+   method, version and path come after. The headers, their string pool and pathDecoded are in the connection's arena,
+   only as big as this request needs, so a short GET doesn't carry around room for the biggest request we'd take */
 struct Request {
-    /* null-terminated HTTP method (GET, POST, PUT, ...) */
-    char method[64];
+    /* internal state for the request parser */
+    RequestParseState state;
     size_t methodLength;
-    /* null-terminated HTTP version string (HTTP/1.0) */
-    char version[16];
     size_t versionLength;
-    /* null-terminated HTTP path/URI ( /index.html?name=Forrest%20Heller ) */
-    char path[1024];
     size_t pathLength;
-    /* null-terminated HTTP path/URI that has been %-unescaped. Used for a file serving.
-     path=/index.html?%20var=s%20p pathDecoded=/index.html? var=s p */
-    char pathDecoded[1024];
     size_t pathDecodedLength;
-    /* null-terminated string containing the request body. Used for POST forms and JSON blobs */
-    struct HeapString body;
-    /* HTTP request headers - use headerInRequest to find the header you're looking for. These used to be a linked list and that worked well, but it seemed overkill */
-    struct Header headers[REQUEST_MAX_HEADERS];
     size_t headersCount;
-    /* the this->headers point at this string pool */
-    char headersStringPool[REQUEST_HEADERS_MAX_MEMORY];
     size_t headersStringPoolOffset;
+    /* HTTP request headers - use headerInRequest to find the header you're looking for. These used to be a linked list and that worked well, but it seemed overkill.
+     There's room for headersCapacity of them (up to REQUEST_MAX_HEADERS) */
+    struct Header* headers;
+    size_t headersCapacity;
+#if !EWS_HEADER_SLICES
+    /* the this->headers point at this string pool. It grows up to REQUEST_HEADERS_MAX_MEMORY */
+    char* headersStringPool;
+    size_t headersStringPoolCapacity;
+#endif
+#if EWS_HEADER_SLICES
+    /* the end of the last header byte this->headers point at in the connection's receive buffer */
+    const char* headerSlicesEnd;
+#endif
+    /* The Content-Length. body fills up to this (or REQUEST_MAX_BODY_LENGTH) as it comes in */
+    size_t bodyExpectedLength;
+    /* How much of the body the parser has gone through, whether or not we kept it */
+    size_t bodyReceivedLength;
+    /* Transfer-Encoding: chunked. body grows as the chunks come in, up to REQUEST_MAX_BODY_LENGTH. This is how much of
+     the current chunk is left */
+    bool bodyChunked;
+    size_t bodyChunkRemaining;
     /* Since this has many fixed fields, we report when we went over the limit */
     struct Warnings {
         /* Was some header information discarded because there was not enough room in the pool? */
@@ -209,32 +462,160 @@ struct Request {
         bool pathTruncated;
         bool bodyTruncated;
     } warnings;
-    /* internal state for the request parser */
-    RequestParseState state;
+    /* null-terminated HTTP method (GET, POST, PUT, ...) */
+    char method[REQUEST_METHOD_MAX_LENGTH];
+    /* null-terminated HTTP version string (HTTP/1.0) */
+    char version[REQUEST_VERSION_MAX_LENGTH];
+    /* null-terminated HTTP path/URI ( /index.html?name=Forrest%20Heller ) */
+    char path[REQUEST_PATH_MAX_LENGTH];
+    /* null-terminated HTTP path/URI that has been %-unescaped. Used for a file serving.
+     path=/index.html?%20var=s%20p pathDecoded=/index.html? var=s p
+     This used to be an array. It's "" until the path is in, except in a zeroed struct the parser hasn't seen yet where
+     it's NULL - responseAllocServeFileFromRequestPath and connectionDebugStringCreate take that as "" too */
+    char* pathDecoded;
+    /* null-terminated string containing the request body. Used for POST forms and JSON blobs */
+    struct HeapString body;
+    /* Bodies bigger than server->requestBodySpillThreshold are written to an unlinked temporary file and body stays
+     empty. bodyFileDescriptor is open for reading until the request is done, and -1 when there's no file. requestBody
+     gets you either one */
+    bool bodySpilled;
+    int bodyFileDescriptor;
+    size_t bodyFileLength;
+    /* read-only mmap of the file requestBody makes the first time it's asked */
+    const char* bodyFileMap;
+    /* copied from the server when the headers are in. 0 = never spill */
+    size_t bodySpillThreshold;
+    /* The connection's arena, where the parameter tables are allocated. NULL for a request that isn't part of a
+     connection */
+    struct Arena* arena;
+    /* the query string and body split into parameters. NULL until requestGETParams/requestPOSTParams is called */
+    struct RequestParams* GETParams;
+    struct RequestParams* POSTParams;
+    /* headers[headerIndexByID[id] - 1] is the first header with that HeaderID. 0 means the request doesn't have one */
+    uint16_t headerIndexByID[HeaderIDCount];
 };
 
 struct ConnectionStatus {
     int64_t bytesSent;
     int64_t bytesReceived;
+    /* with keep-alive a connection can carry many requests */
+    int64_t requestsHandled;
+};
+
+/* ServerModelEventLoop and ServerModelIOUring write the response out a piece at a time whenever the socket can take more */
+struct ConnectionOutput {
+    struct Response* response;
+    FILE* fp; // response->filenameToSend, streamed through sendRecvBuffer
+    size_t headerLength;
+    size_t headerSent;
+    size_t bodySent;
+    size_t chunkLength; // bytes of the file sitting in sendRecvBuffer
+    size_t chunkSent;
+    /* ServerModelIOUring reads the file at an offset instead of with fread */
+    long fileOffset;
+    bool fileDone;
+};
+
+/* What a connection is waiting on the client for, and so which of the server's timeouts applies */
+typedef enum {
+    ConnectionTimeoutNone,
+    /* a keep-alive connection waiting for its next request (server->keepAliveTimeoutSeconds) */
+    ConnectionTimeoutIdle,
+    /* the rest of the request line and headers (server->headerTimeoutSeconds) */
+    ConnectionTimeoutHeader,
+    /* more of the request body (server->bodyTimeoutSeconds) */
+    ConnectionTimeoutBody,
+    /* the client to take more of the response (server->sendTimeoutSeconds) */
+    ConnectionTimeoutSend,
+    ConnectionTimeoutCount
+} ConnectionTimeout;
+
+/* The event loops keep a list of connections for each kind of timeout, oldest first. Every connection in a list has the
+ same timeout, so the ones at the front are always the next to expire and there's nothing to sort */
+struct ConnectionTimers {
+    struct Connection* head[ConnectionTimeoutCount];
+    struct Connection* tail[ConnectionTimeoutCount];
 };
 
+#if EWS_IO_URING_SUPPORTED
+typedef enum {
+    IOUringOperationRecv,
+    IOUringOperationSend,
+    IOUringOperationRead
+} IOUringOperationType;
+
+/* Each connection has at most one operation in flight. The kernel reads the msghdr and iovecs after we submit, so they
+ live here instead of on the stack */
+struct IOUringOperation {
+    IOUringOperationType type;
+    struct iovec buffers[2];
+    struct msghdr message;
+    /* the ring's list of its connections (struct IOUring's connections) */
+    struct Connection* ringPrevious;
+    struct Connection* ringNext;
+};
+#endif
+
 /* This contains a full HTTP connection. For every connection, a thread is spawned
- and passed this struct */
+ and passed this struct. Like struct Request, what's used for every request comes first, starting on its own cache line,
+ and the storage comes last. The send/receive buffer is in the same allocation, right behind the struct */
 struct Connection {
-    /* Just allocate the buffers in the connection. These go at the beginning of
-     the connection in the hopes that they are 'more aligned' */
-    char sendRecvBuffer[SEND_RECV_BUFFER_SIZE];
-    char responseHeader[RESPONSE_HEADER_SIZE];
+    /* Requests are received into receiveBuffer, which is sendRecvBuffer unless EWS_HEADER_SLICES had to grow it to hold
+     a request's headers. Bytes we haven't parsed yet start at receiveOffset, which is always 0 without EWS_HEADER_SLICES */
+    EWS_CACHE_LINE_ALIGNED char* receiveBuffer;
+    size_t receiveCapacity;
+    size_t receiveOffset;
+    /* Pipelined bytes that arrived after the current request sit at receiveBuffer + receiveOffset, so anything that
+     borrows sendRecvBuffer while responding gets it from connectionFileChunkBuffer */
+    size_t pipelinedLength;
     sockettype socketfd;
+    struct ConnectionStatus status;
+    /* Should the connection stay open for another request once this response is sent? */
+    bool keepAlive;
+    /* The request counts towards server->inFlightRequestCount until its response is sent */
+    bool requestInFlight;
+    /* The server->bodyHandlers entry this request's body is going to instead of request->body, what its bodyStart
+     returned, and how many bytes of the body it has been given */
+    const struct RequestBodyHandler* bodyHandler;
+    void* bodyHandlerContext;
+    size_t bodyHandlerReceived;
+    /* The response server->requestBodyCheck returned instead of reading the body. Set until it's sent */
+    struct Response* bodyRejectedResponse;
+    bool bodyRejected;
+    /* points back to the server, usually used for the server's globalMutex */
+    struct Server* server;
+    /* server->activeConnections */
+    struct Connection* activePrevious;
+    struct Connection* activeNext;
+    /* Only used by ServerModelEventLoop and ServerModelIOUring */
+    struct ConnectionOutput output;
+    /* ServerModelEventLoop and ServerModelIOUring keep connections that are waiting on the client in the list for that
+     kind of timeout, ordered by when they started waiting */
+    struct Connection* timeoutPrevious;
+    struct Connection* timeoutNext;
+    int64_t timeoutSinceMilliseconds;
+    ConnectionTimeout timeout;
+#if EWS_IO_URING_SUPPORTED
+    /* Only used by ServerModelIOUring - the buffers of the operation the kernel is working on */
+    struct IOUringOperation ioUringOperation;
+#endif
+    /* Everything above here is just zeroed when the connection is recycled, and the request is reset */
+    EWS_CACHE_LINE_ALIGNED struct Request request;
+    /* Responses and request->GETParams/POSTParams. Reset with the request */
+    struct Arena arena;
+    /* The accept loop's pool this connection goes back to when it's done (NULL = it's just freed) */
+    struct ConnectionPool* pool;
+    struct Connection* poolNext;
+    bool fromPoolSlab;
+    /* sendRecvBufferSize bytes right after this struct (see server->connectionBufferSize) */
+    char* sendRecvBuffer;
+    size_t sendRecvBufferSize;
     /* Who connected? */
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLength;
     char remoteHost[128];
     char remotePort[16];
-    struct ConnectionStatus status;
-    struct Request request;
-    /* points back to the server, usually used for the server's globalMutex */
-    struct Server* server;
+    char responseHeader[RESPONSE_HEADER_SIZE];
 };
 
 /* You create one of these for the server to send. Use one of the responseAlloc functions.
@@ -248,8 +629,78 @@ struct Response {
     char* status;
     char* contentType;
     char* extraHeaders; // can be NULL
+    /* The arena of the connection this response was made for, or NULL if it was malloc'd. The struct and the strings
+     responseAlloc made come from it, so don't free those yourself - just point the field at your own malloc'd string
+     and that's freed like before */
+    struct Arena* arena;
+};
+
+/* Uploads normally end up in request->body, all of it (up to REQUEST_MAX_BODY_LENGTH) in memory before
+ createResponseForRequest is called. Requests for pathPrefix (matched like requestMatchesPathPrefix, ignoring the query
+ string) go here instead: the body is handed over in pieces straight out of the receive buffer as it comes off the socket,
+ so an upload only ever takes up the connection's buffer. createResponseForRequest isn't called for these requests */
+struct RequestBodyHandler {
+    const char* pathPrefix;
+    /* Called once all the headers are in, before any of the body. Whatever you return gets passed to the other two */
+    void* (*bodyStart)(const struct Request* request, struct Connection* connection);
+    /* Called for each piece of the body in order. data is only good during the call. Return false to stop reading the
+     body - bodyEnd is called right away and the connection is closed once that response is sent */
+    bool (*bodyChunk)(void* context, const struct Request* request, const char* data, size_t length);
+    /* Called after the last piece. bodyComplete is false if the body stopped early. Return the response just like
+     createResponseForRequest. If the connection went away before the body was done the response is just freed */
+    struct Response* (*bodyEnd)(void* context, const struct Request* request, struct Connection* connection, bool bodyComplete);
+};
+
+/* One part of a multipart/form-data body (an <input> in a form with enctype="multipart/form-data"). These come from the
+ part's Content-Disposition and Content-Type headers and are NULL when the part didn't have them. filename is set for
+ file uploads */
+struct MultipartPart {
+    const char* name;
+    const char* filename;
+    const char* contentType;
+};
+
+/* What a MultipartParser calls as it goes through the body. Any of them can be NULL. part is only good until partEnd.
+ partData is called as many times as it takes with the part's data in order, as it arrives. Return false from any of
+ them to stop parsing */
+struct MultipartCallbacks {
+    bool (*partStart)(void* tag, const struct MultipartPart* part);
+    bool (*partData)(void* tag, const struct MultipartPart* part, const char* data, size_t length);
+    bool (*partEnd)(void* tag, const struct MultipartPart* part);
 };
 
+struct MultipartParser;
+
+typedef enum {
+    /* Every accepted connection is handed to its own newly spawned thread. This is the default */
+    ServerModelThreadPerConnection,
+    /* Linux only: the thread calling acceptConnectionsUntilStopped multiplexes every connection with epoll. Requests are
+     parsed as bytes arrive and responses are written as the sockets drain, so thousands of idle or slow clients don't cost
+     a thread each. createResponseForRequest runs on the event loop thread, so a slow handler stalls all the other
+     connections. On other platforms this falls back to ServerModelThreadPerConnection */
+    ServerModelEventLoop,
+    /* A fixed number of worker threads are started up front and accepted connections wait in a bounded queue for the
+     next free worker. When the queue is full new connections get an immediate 503 instead of another thread */
+    ServerModelThreadPool,
+    /* Linux 5.6+ only: like ServerModelEventLoop, but accepts, receives, sends and file reads are queued up on an io_uring
+     and submitted in batches, so a busy loop makes one syscall per iteration instead of one per operation. If the kernel
+     doesn't have io_uring (or it's disabled) this falls back to ServerModelEventLoop */
+    ServerModelIOUring
+} ServerModel;
+
+/* Picks the defaults for the server settings you leave at 0 */
+typedef enum {
+    /* THREAD_POOL_DEFAULT_SIZE, KEEP_ALIVE_DEFAULT_TIMEOUT_SECONDS, SEND_RECV_BUFFER_SIZE and so on */
+    ServerProfileDefault,
+    /* A device serving a handful of clients, like a settings page or a debug server inside an app. A couple of threads,
+     short keep-alives, a 4KB buffer per connection and only a couple of connections kept around for reuse */
+    ServerProfileSmallEmbedded,
+    /* Behind a load balancer or reverse proxy that holds its connections open and sends lots of requests down each one.
+     Long keep-alives, a big thread pool and queue, 64KB buffers so big uploads take fewer reads, and a deep connection
+     pool */
+    ServerProfileProxyFacing
+} ServerProfile;
+
 struct Server {
     bool initialized;
     pthread_mutex_t globalMutex;
@@ -257,6 +708,67 @@ struct Server {
     sockettype listenerfd;
     /* User field for whatever - if your request handler you can do connection->server->tag */
     void* tag; 
+    /* How connections are handled. Set this after serverInit and before acceptConnectionsUntilStopped */
+    ServerModel model;
+    /* What the settings below mean when they're 0. Set this after serverInit too */
+    ServerProfile profile;
+    /* ServerModelThreadPool: the number of workers and how many accepted connections can wait for one. 0 = default */
+    int threadPoolSize;
+    int threadPoolMaxQueuedConnections;
+    /* HTTP/1.1 keep-alive: how long a connection may sit idle waiting for its next request and how many requests one
+     connection may make before we close it. 0 = default. Set keepAliveMaxRequests to 1 to turn keep-alive off */
+    int keepAliveTimeoutSeconds;
+    int keepAliveMaxRequests;
+    /* Slow clients (or slowloris attacks) can't hold on to a connection forever: the request line and headers have to be
+     in headerTimeoutSeconds after the connection opens (or after the first byte of the next request on a keep-alive
+     connection), the body can't go quiet for more than bodyTimeoutSeconds, and the client has to take some of the
+     response every sendTimeoutSeconds. 0 = default, -1 = never. The thread models do this with SO_RCVTIMEO and
+     SO_SNDTIMEO on the socket, so if createResponseForRequest takes the connection over it should set its own */
+    int headerTimeoutSeconds;
+    int bodyTimeoutSeconds;
+    int sendTimeoutSeconds;
+    /* Admission control: a connection that would go over maxActiveConnections, or that comes in while maxInFlightRequests
+     requests are being handled, gets a canned 503 with Retry-After straight from the accept loop and is closed - no
+     struct Connection, no thread, no parsing. counters.connectionsRejected counts them. 0 = default (no limit unless
+     server->profile has one), -1 = no limit */
+    int maxActiveConnections;
+    int maxInFlightRequests;
+    /* serverStop stops accepting, closes idle keep-alive connections right away and gives the requests in progress this
+     long to finish before it shuts down their sockets. 0 = default, -1 = wait however long it takes. A
+     createResponseForRequest that never returns still holds serverStop up, since its thread can't be cut off */
+    int stopDrainSeconds;
+    /* Open this many listeners on the same address with SO_REUSEPORT, each with its own accept loop (and thread pool or
+     event loop) on its own thread, so the kernel spreads new connections across them. 0 or 1 = one listener */
+    int listenerShards;
+    /* Pin listener shard N to CPU N (mod the number of CPUs). Linux only, and only when built with _GNU_SOURCE */
+    bool listenerShardsPinToCPUs;
+    /* Requests whose bodies are streamed to a RequestBodyHandler instead of collected in request->body. The first
+     matching pathPrefix wins. The array has to stay around while the server runs */
+    const struct RequestBodyHandler* bodyHandlers;
+    int bodyHandlerCount;
+    /* Called once the headers of a request with a body are in, before any of the body is read. Return NULL to go ahead,
+     or a response (like a 413 for a Content-Length you don't want or a 401) to send right away instead - the body is never
+     read and the connection is closed after the response. Clients that sent "Expect: 100-continue" are told to send the
+     body once this returns NULL (or if it's not set), and never send it when it doesn't */
+    struct Response* (*requestBodyCheck)(const struct Request* request, struct Connection* connection);
+    /* Request bodies bigger than this many bytes go to an unlinked file in $TMPDIR (or /tmp) instead of memory, so big
+     uploads don't add to the RSS. Use requestBody to read them. 0 = keep everything in memory, which is the default.
+     Not supported on Windows */
+    size_t requestBodySpillThreshold;
+    /* Each accept loop keeps up to this many finished connections and hands them out again instead of allocating (and
+     zeroing) a new struct Connection for every accept. 0 = default (CONNECTION_POOL_DEFAULT_SIZE), -1 = don't keep any.
+     counters.connectionPoolHits/Misses show how often that worked out */
+    int connectionPoolSize;
+    /* How big each connection's send/receive buffer is. Smaller means less memory per connection, bigger means fewer
+     recv calls for big bodies and fewer reads for files that can't go out with sendfile. 0 = default */
+    size_t connectionBufferSize;
+    /* Linux only: carve the pooled connections out of 2MB huge pages (explicit ones if some are reserved, transparent
+     huge pages otherwise) so a busy server takes fewer TLB misses and page faults on them. Connections from a huge page
+     always go back to the pool, whatever connectionPoolSize is, and the pages are unmapped when the accept loop is done */
+    bool connectionPoolHugePages;
+    /* All the listening sockets - listenerfd is the same as listenerfds[0] */
+    sockettype* listenerfds;
+    int listenerCount;
 
     /* The rest of the vars just have to do with shutting down the server cleanly.
      It's a lot of work, actually! Much simpler when I just let it run forever */
@@ -267,6 +779,16 @@ struct Server {
     int activeConnectionCount;
     pthread_cond_t connectionFinishedCond;
     pthread_mutex_t connectionFinishedLock;
+    /* Requests that have been read and haven't been answered yet. Only kept up (with counterAdd) when there's a
+     maxInFlightRequests */
+    int64_t inFlightRequestCount;
+    /* Every connection between connectionStarted and connectionFinished, so serverStop can shut their sockets down at
+     the drain deadline. Behind connectionFinishedLock */
+    struct Connection* activeConnections;
+    bool connectionsCutOff;
+    /* How the last serverStop went: connections that finished on their own while it drained vs. ones it cut off */
+    int stopDrainedConnections;
+    int stopCutOffConnections;
 };
 
 #ifndef __printflike
@@ -302,6 +824,9 @@ struct Response* responseAllocJSONWithFormat(const char* format, ...) __printfli
 struct Response* responseAllocWithFormat(int code, const char* status, const char* contentType, const char* format, ...) __printflike(3, 0);
 /* If you leave the MIMETypeOrNULL NULL, the MIME type will be auto-detected */
 struct Response* responseAllocWithFile(const char* filename, const char* MIMETypeOrNULL);
+/* Memory that's freed for you once the current response on this connection has been sent. For building strings or
+ extraHeaders in a handler without having to free them */
+void* connectionArenaAlloc(struct Connection* connection, size_t size);
 /* Error messages for when the request can't be handled properly */
 struct Response* responseAlloc400BadRequestHTML(const char* errorMessage);
 struct Response* responseAlloc404NotFoundHTML(const char* resourcePathOrNull);
@@ -311,18 +836,44 @@ struct Response* responseAlloc500InternalErrorHTML(const char* extraInformationO
  you'll want to use these functions. Otherwise you can just pass null to acceptConnections* */
 void serverInit(struct Server* server);
 void serverDeInit(struct Server* server);
+/* Stops accepting connections and waits for the ones in progress to finish, up to server->stopDrainSeconds. Returns
+ once acceptConnectionsUntilStopped is done. server->stopDrainedConnections and stopCutOffConnections say how it went */
 void serverStop(struct Server* server);
 
-/* Wrappers around strdupDecodeGetorPOSTParam */
+/* These return a strdup of the value like strdupDecodeGETorPOSTParam does, but they look it up in requestGETParams/requestPOSTParams */
 char* strdupDecodeGETParam(const char* paramNameIncludingEquals, const struct Request* request, const char* valueIfNotFound);
 char* strdupDecodePOSTParam(const char* paramNameIncludingEquals, const struct Request* request, const char* valueIfNotFound);
 /* You can pass this the request->path for GET or request->body.contents for POST. Accepts NULL for paramString for convenience */
 char* strdupDecodeGETorPOSTParam(const char* paramNameIncludingEquals, const char* paramString, const char* valueIfNotFound);
+/* Look up a parameter without allocating anything. The query string (or the body, parsed as
+ application/x-www-form-urlencoded) is split up and decoded the first time you ask, then every lookup is a hash lookup.
+ name doesn't have the '=' on the end. Returns NULL if it's not there. The value is good until the request is finished */
+const char* requestGETParam(const struct Request* request, const char* name, size_t* valueLengthOrNull);
+const char* requestPOSTParam(const struct Request* request, const char* name, size_t* valueLengthOrNull);
+/* The request body, whether it's in request->body or was spilled to a file (see server.requestBodySpillThreshold). A
+ spilled body is mmap'd read-only the first time you ask. Null-terminated either way. NULL (and a length of 0) if there's
+ no body or a spilled one couldn't be mapped */
+const char* requestBody(const struct Request* request, size_t* lengthOrNull);
+/* If you want to go through all of them */
+const struct RequestParams* requestGETParams(const struct Request* request);
+const struct RequestParams* requestPOSTParams(const struct Request* request);
+/* Incremental multipart/form-data parsing. multipartParserAlloc takes the boundary from the request's Content-Type and
+ returns NULL if it's not multipart. Then feed it the body in whatever pieces you have - from a RequestBodyHandler's
+ bodyChunk so file uploads can go straight to disk, or all of requestBody at once. Nothing is buffered except the part
+ headers and a few bytes that might be the start of a boundary. multipartParserFeed returns false if the body is
+ malformed or a callback said to stop. multipartParserFinished is true once the closing boundary went by. requestPOSTParam
+ and friends already understand multipart bodies: the parts that aren't files become the parameters */
+struct MultipartParser* multipartParserAlloc(const struct Request* request, const struct MultipartCallbacks* callbacks, void* tag);
+bool multipartParserFeed(struct MultipartParser* parser, const char* data, size_t length);
+bool multipartParserFinished(const struct MultipartParser* parser);
+void multipartParserFree(struct MultipartParser* parser);
 /* If you want to echo back HTML into the value="" attribute or display some user output this will help you (like &gt; &lt;) */
 char* strdupEscapeForHTML(const char* stringToEscape);
 /* If you have a file you reading/writing across connections you can use this provided pthread mutex so you don't have to make your own */
 /* Need to inspect a header in a request? */
 const struct Header* headerInRequest(const char* headerName, const struct Request* request);
+/* Same thing for the common headers in HeaderID, without looking at the other headers. Returns the first one or NULL */
+const struct Header* headerInRequestByID(HeaderID headerID, const struct Request* request);
 /* Get a debug string representing this connection that's easy to print out. wrap it in HTML <pre> tags */
 struct HeapString connectionDebugStringCreate(const struct Connection* connection);
 /* Some really basic dynamic string handling. AppendChar and AppendFormat allocate enough memory and
@@ -350,10 +901,9 @@ void EWSUnitTestsRun(void);
 
 /* Internal implementation stuff */
 
-/* these counters exist solely for the purpose of the /status demo */
+/* these counters exist solely for the purpose of the /status demo. Every connection's thread bumps them so they're
+ updated with counterAdd instead of behind a lock */
 static struct Counters {
-    bool lockInitialized;
-    pthread_mutex_t lock;
     int64_t bytesReceived;
     int64_t bytesSent;
     int64_t totalConnections;
@@ -362,12 +912,63 @@ static struct Counters {
     int64_t heapStringReallocations;
     int64_t heapStringFrees;
     int64_t heapStringTotalBytesReallocated;
+    int64_t connectionsRejected;
+    int64_t arenaBlockAllocations;
+    int64_t connectionPoolHits;
+    int64_t connectionPoolMisses;
+    int64_t idleTimeouts;
+    int64_t headerTimeouts;
+    int64_t bodyTimeouts;
+    int64_t sendTimeouts;
 } counters;
 
 #ifndef MIN
 #define MIN(a, b) ((a < b) ? a : b)
 #endif
 
+#ifndef MAX
+#define MAX(a, b) ((a > b) ? a : b)
+#endif
+
+/* sendResponseFile hands files to the kernel with sendfile(2) instead of copying them through sendRecvBuffer */
+#if defined(__linux__) && !defined(EWS_FUZZ_TEST)
+#define EWS_SENDFILE_SUPPORTED 1
+#else
+#define EWS_SENDFILE_SUPPORTED 0
+#endif
+
+/* Big request bodies can be spilled to an unlinked temporary file and mmap'd back */
+#ifndef WIN32
+#define EWS_BODY_SPILL_SUPPORTED 1
+#else
+#define EWS_BODY_SPILL_SUPPORTED 0
+#endif
+
+/* currentArena is per thread */
+#if defined(_MSC_VER)
+#define EWS_THREAD_LOCAL __declspec(thread)
+#elif defined(__cplusplus) && __cplusplus >= 201103L
+#define EWS_THREAD_LOCAL thread_local
+#else
+#define EWS_THREAD_LOCAL __thread
+#endif
+
+/* server->connectionPoolHugePages */
+#if defined(__linux__) && defined(MAP_HUGETLB)
+#define EWS_HUGE_PAGES_SUPPORTED 1
+#else
+#define EWS_HUGE_PAGES_SUPPORTED 0
+#endif
+
+/* A relaxed atomic add. The counters are only ever read for display so nothing needs ordering against them */
+#if defined(_MSC_VER)
+#define counterAdd(counter, amount) InterlockedExchangeAdd64((volatile LONG64*) &(counter), (LONG64) (amount))
+#define counterRead(counter) InterlockedCompareExchange64((volatile LONG64*) &(counter), 0, 0)
+#else
+#define counterAdd(counter, amount) __atomic_fetch_add(&(counter), (int64_t) (amount), __ATOMIC_RELAXED)
+#define counterRead(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#endif
+
 struct PathInformation {
     bool exists;
     bool isDirectory;
@@ -377,19 +978,97 @@ static void responseFree(struct Response* response);
 static void printIPv4Addresses(uint16_t portInHostOrder);
 static struct Connection* connectionAlloc(struct Server* server);
 static void connectionFree(struct Connection* connection);
-static void requestParse(struct Request* request, const char* requestFragment, size_t requestFragmentLength);
+static size_t requestParse(struct Request* request, const char* requestFragment, size_t requestFragmentLength);
+static size_t requestParseUntil(struct Request* request, const char* requestFragment, size_t requestFragmentLength, RequestParseState stopState);
+static bool requestParseStateIsBody(RequestParseState state);
+static bool requestParseFinished(const struct Request* request);
+static void heapStringReallocIfNeeded(struct HeapString* string, size_t minimumCapacity);
+static void connectionParseReceived(struct Connection* connection, size_t length);
+static bool connectionRequestBodyCheck(struct Connection* connection);
+static void connectionBodyHandlerStart(struct Connection* connection);
+static size_t connectionBodyHandlerReceive(struct Connection* connection, const char* data, size_t length);
+static struct Response* connectionBodyHandlerEnd(struct Connection* connection);
+static char* connectionReceiveSpace(struct Connection* connection, size_t* space);
+static char* connectionFileChunkBuffer(struct Connection* connection, size_t* capacity);
+#if EWS_HEADER_SLICES
+static void connectionReceiveGrow(struct Connection* connection);
+static void requestTerminateHeaderSlices(struct Request* request);
+#endif
+static void requestReset(struct Request* request);
+static void requestParamsFree(struct Request* request);
+static struct RequestParams* requestParamsCreateFromMultipart(const struct Request* request, const char* body, size_t bodyLength);
+static bool multipartBoundaryFromRequest(const struct Request* request, char* boundary, size_t boundaryCapacity);
+static void requestBodyFree(struct Request* request);
+static bool headerValueContainsToken(const char* headerValue, size_t headerValueLength, const char* token);
+static bool requestWantsKeepAlive(const struct Request* request);
+static bool connectionShouldKeepAlive(struct Connection* connection);
+static bool connectionHandleRequest(struct Connection* connection);
+static void socketSetTimeout(sockettype socketfd, int option, int milliseconds);
+static bool socketErrorIsTimeout(void);
+static int64_t monotonicMilliseconds(void);
+static void conditionWaitMilliseconds(pthread_cond_t* cond, pthread_mutex_t* mutex, int milliseconds);
+static int serverCutOffConnections(struct Server* server);
+static void connectionTimedOut(const struct Connection* connection, ConnectionTimeout timeout);
+static void connectionSendFailed(const struct Connection* connection);
 static int acceptConnectionsUntilStoppedInternal(struct Server* server, const struct sockaddr* address, socklen_t addressLength);
 static size_t heapStringNextAllocationSize(size_t required);
+#if !EWS_HEADER_SLICES
 static void poolStringStartNewString(struct PoolString* poolString, struct Request* request);
-static void poolStringAppendChar(struct Request* request, struct PoolString* string, char c);
+#endif
+static void poolStringAppend(struct Request* request, struct PoolString* string, const char* characters, size_t length);
+static size_t requestScanFor(const char* data, size_t length, char a, char b);
+static size_t scanForAnyOf(const char* data, size_t length, const char* set, size_t setLength);
+static size_t scanForURLUnsafe(const char* data, size_t length);
+static int hexDigitValue(char c);
 static bool strEndsWith(const char* big, const char* endsWith);
 static void ignoreSIGPIPE(void);
 static void callWSAStartupIfNecessary(void);
 static FILE* fopen_utf8_path(const char* utf8Path, const char* mode);
 static int pathInformationGet(const char* path, struct PathInformation* info);
 static int sendResponseBody(struct Connection* connection, const struct Response* response, ssize_t* bytesSent);
+static ssize_t sendTwoBuffers(sockettype socketfd, const char* first, size_t firstLength, const char* second, size_t secondLength, int flags);
 static int sendResponseFile(struct Connection* connection, const struct Response* response, ssize_t* bytesSent);
-static int snprintfResponseHeader(char* destination, size_t destinationCapacity, int code, const char* status, const char* contentType, const char* extraHeaders, size_t contentLength);
+static struct Response* responseFileOpen(struct Connection* connection, const struct Response* response, FILE** fpOut, const char** contentTypeOut, long* fileLengthOut);
+#if EWS_SENDFILE_SUPPORTED
+static int sendFileWithSendfile(struct Connection* connection, const struct Response* response, int filefd, long fileLength, off_t* offset, ssize_t* bytesSent);
+#endif
+static void connectionStarted(struct Connection* connection);
+static void connectionFinished(struct Connection* connection);
+static bool connectionAccept(struct Server* server, sockettype listenerfd, sockettype* socketfd, struct sockaddr_storage* remoteAddr, socklen_t* remoteAddrLength);
+static void connectionRejectBusy(sockettype socketfd);
+static bool connectionAdmit(struct Server* server, sockettype socketfd);
+static void connectionUnadmit(struct Server* server, sockettype socketfd);
+static struct Connection* connectionAllocAdmitted(struct Server* server, sockettype socketfd, const struct sockaddr_storage* remoteAddr, socklen_t remoteAddrLength);
+static void connectionRequestStarted(struct Connection* connection);
+static void connectionRequestFinished(struct Connection* connection);
+static struct ConnectionPool* connectionPoolCreate(const struct Server* server);
+static void connectionPoolRelease(struct ConnectionPool* pool);
+static sockettype listenerCreate(const struct sockaddr* address, socklen_t addressLength, bool reusePort, const char* addressHost, const char* addressPort);
+static void serverCloseListeners(struct Server* server);
+#if EWS_EVENT_LOOP_SUPPORTED
+static void serverShutdownListeners(struct Server* server);
+#endif
+static void acceptConnectionsOnListener(struct Server* server, sockettype listenerfd);
+static void acceptConnectionsWithModel(struct Server* server, sockettype listenerfd);
+/* With server->listenerShards each listener gets one of these and its own thread */
+struct ListenerShard {
+    struct Server* server;
+    sockettype listenerfd;
+    int index;
+    pthread_t thread;
+    bool started;
+};
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 listenerShardThread(void* shardPointer);
+static void threadPinToCPU(int cpuIndex);
+static void acceptConnectionsThreadPerConnection(struct Server* server, sockettype listenerfd);
+static void acceptConnectionsThreadPool(struct Server* server, sockettype listenerfd);
+#if EWS_EVENT_LOOP_SUPPORTED
+static void eventLoopRun(struct Server* server, sockettype listenerfd);
+#endif
+#if EWS_IO_URING_SUPPORTED
+static bool ioUringRun(struct Server* server, sockettype listenerfd);
+#endif
+static int snprintfResponseHeader(char* destination, size_t destinationCapacity, int code, const char* status, const char* contentType, const char* extraHeaders, size_t contentLength, bool keepAlive);
 
 #ifdef WIN32 /* Windows implementations of functions available on Linux/Mac OS X */
     /* opendir/readdir/closedir API implementation with FindNextFile */
@@ -409,9 +1088,11 @@ static int snprintfResponseHeader(char* destination, size_t destinationCapacity,
     /* pthread implementation with critical sections and conditions */
     static int pthread_detach(pthread_t threadHandle);
     static int pthread_create(HANDLE* threadHandle, const void* attributes, LPTHREAD_START_ROUTINE thread, void* param);
+    static int pthread_join(pthread_t threadHandle, void** result);
     static int pthread_cond_init(pthread_cond_t* cond, const void* attributes);
     static int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex);
     static int pthread_cond_signal(pthread_cond_t* cond);
+    static int pthread_cond_broadcast(pthread_cond_t* cond);
     static int pthread_cond_destroy(pthread_cond_t* cond);
     static int pthread_mutex_init(pthread_mutex_t* mutex, const void* attributes);
     static int pthread_mutex_lock(pthread_mutex_t* mutex);
@@ -432,9 +1113,14 @@ static int snprintfResponseHeader(char* destination, size_t destinationCapacity,
     #ifndef strcasecmp
       #define strcasecmp _stricmp
     #endif // defined strcasecmp
+    #ifndef strncasecmp
+      #define strncasecmp _strnicmp
+    #endif // defined strncasecmp
     #define strdup(string) _strdup(string)
     #define unlink(file) _unlink(file)
     #define close(x) closesocket(x)
+    #define SHUT_RDWR SD_BOTH
+    #define SHUT_WR SD_SEND
     #define gai_strerror_ansi(x) gai_strerrorA(x)
 #else // WIN32
     #define gai_strerror_ansi(x) gai_strerror(x)
@@ -455,12 +1141,93 @@ typedef enum {
     URLDecodeTypeParameter
 } URLDecodeType;
 
-static bool URLDecode(const char* encoded, char* decoded, size_t decodedCapacity, size_t* decodedLength, URLDecodeType type);
+static bool URLDecode(const char* encoded, size_t encodedLength, char* decoded, size_t decodedCapacity, size_t* decodedLength, URLDecodeType type);
+
+/* The names for HeaderID in the order of the enum */
+static const char* headerIDNames[HeaderIDCount] = {
+    "",
+    "Host",
+    "Content-Length",
+    "Content-Type",
+    "Content-Encoding",
+    "Transfer-Encoding",
+    "Connection",
+    "Expect",
+    "Cookie",
+    "Authorization",
+    "Accept",
+    "Accept-Encoding",
+    "Accept-Language",
+    "User-Agent",
+    "Referer",
+    "Origin",
+    "If-Modified-Since",
+    "If-None-Match",
+    "Range",
+    "Upgrade",
+    "Cache-Control",
+    "X-Forwarded-For"
+};
+
+/* The names above all land in different slots of (length + first letter + last letter * 24) % 64, case-insensitive. So
+ one lookup and one compare tells us whether a name is one of them. If you add a name make sure it still doesn't collide */
+static const HeaderID headerIDSlots[64] = {
+    HeaderIDUnknown, HeaderIDUnknown, HeaderIDUnknown, HeaderIDUnknown,
+    HeaderIDUnknown, HeaderIDOrigin, HeaderIDUnknown, HeaderIDAccept,
+    HeaderIDUnknown, HeaderIDUnknown, HeaderIDUnknown, HeaderIDExpect,
+    HeaderIDHost, HeaderIDUnknown, HeaderIDUnknown, HeaderIDUnknown,
+    HeaderIDCacheControl, HeaderIDUnknown, HeaderIDUnknown, HeaderIDUnknown,
+    HeaderIDUnknown, HeaderIDUnknown, HeaderIDUnknown, HeaderIDUnknown,
+    HeaderIDAcceptEncoding, HeaderIDUnknown, HeaderIDUnknown, HeaderIDContentEncoding,
+    HeaderIDUnknown, HeaderIDUnknown, HeaderIDUnknown, HeaderIDUserAgent,
+    HeaderIDUnknown, HeaderIDCookie, HeaderIDUnknown, HeaderIDUnknown,
+    HeaderIDUnknown, HeaderIDUnknown, HeaderIDUnknown, HeaderIDContentType,
+    HeaderIDAcceptLanguage, HeaderIDReferer, HeaderIDUnknown, HeaderIDUnknown,
+    HeaderIDUnknown, HeaderIDTransferEncoding, HeaderIDUnknown, HeaderIDRange,
+    HeaderIDUnknown, HeaderIDContentLength, HeaderIDIfModifiedSince, HeaderIDUnknown,
+    HeaderIDUpgrade, HeaderIDUnknown, HeaderIDIfNoneMatch, HeaderIDXForwardedFor,
+    HeaderIDUnknown, HeaderIDUnknown, HeaderIDUnknown, HeaderIDUnknown,
+    HeaderIDUnknown, HeaderIDConnection, HeaderIDAuthorization, HeaderIDUnknown,
+};
+
+static HeaderID headerIDFromName(const char* name, size_t nameLength) {
+    if (0 == nameLength) {
+        return HeaderIDUnknown;
+    }
+    size_t slot = (nameLength + ((unsigned char) name[0] | 0x20) + ((unsigned char) name[nameLength - 1] | 0x20) * 24) & 63;
+    HeaderID candidate = headerIDSlots[slot];
+    if (HeaderIDUnknown != candidate && strlen(headerIDNames[candidate]) == nameLength && 0 == strncasecmp(name, headerIDNames[candidate], nameLength)) {
+        return candidate;
+    }
+    return HeaderIDUnknown;
+}
+
+/* The parser calls this as it finishes each header */
+static void requestIndexHeader(struct Request* request, size_t headerIndex) {
+    const struct PoolString* name = &request->headers[headerIndex].name;
+    HeaderID headerID = headerIDFromName(name->contents, name->length);
+    if (HeaderIDUnknown != headerID && 0 == request->headerIndexByID[headerID]) {
+        request->headerIndexByID[headerID] = (uint16_t) (headerIndex + 1);
+    }
+}
+
+const struct Header* headerInRequestByID(HeaderID headerID, const struct Request* request) {
+    if (headerID <= HeaderIDUnknown || headerID >= HeaderIDCount || 0 == request->headerIndexByID[headerID]) {
+        return NULL;
+    }
+    return &request->headers[request->headerIndexByID[headerID] - 1];
+}
 
 const struct Header* headerInRequest(const char* headerName, const struct Request* request) {
+    size_t headerNameLength = strlen(headerName);
+    HeaderID headerID = headerIDFromName(headerName, headerNameLength);
+    if (HeaderIDUnknown != headerID) {
+        return headerInRequestByID(headerID, request);
+    }
     for (size_t i = 0; i < request->headersCount; i++) {
         assert(NULL != request->headers[i].name.contents);
-        if (0 == strcasecmp(request->headers[i].name.contents, headerName)) {
+        /* compare lengths first - with EWS_HEADER_SLICES the name isn't null-terminated until all the headers are in */
+        if (request->headers[i].name.length == headerNameLength && 0 == strncasecmp(request->headers[i].name.contents, headerName, headerNameLength)) {
             return &request->headers[i];
         }
     }
@@ -474,11 +1241,151 @@ static char* strdupIfNotNull(const char* strToDup) {
     return strdup(strToDup);
 }
 
-typedef enum {
-    URLDecodeStateNormal,
-    URLDecodeStatePercentFirstDigit,
-    URLDecodeStatePercentSecondDigit
-} URLDecodeState;
+/* The arena responses come from while createResponseForRequest (or a body handler's bodyEnd, or requestBodyCheck) runs
+ on this thread. Set by connectionArenaEnter. Responses made anywhere else come from malloc like they always have */
+static EWS_THREAD_LOCAL struct Arena* currentArena;
+
+/* request->pathDecoded until the request line is in */
+static char requestNoPathDecoded[1];
+
+/* The block header is padded so every allocation stays 16 byte aligned */
+#define ARENA_BLOCK_HEADER_SIZE ((sizeof(struct ArenaBlock) + 15) & ~(size_t) 15)
+#define ARENA_ALIGN(size) (((size) + 15) & ~(size_t) 15)
+
+static char* arenaBlockData(struct ArenaBlock* block) {
+    return (char*) block + ARENA_BLOCK_HEADER_SIZE;
+}
+
+/* Returns NULL if it needed a new block and malloc couldn't give it one */
+static void* arenaAlloc(struct Arena* arena, size_t size) {
+    size = ARENA_ALIGN(MAX(size, (size_t) 1));
+    struct ArenaBlock* block = arena->blocks;
+    if (NULL == block || block->capacity - block->used < size) {
+        size_t capacity = MAX(MAX(arena->nextBlockSize, (size_t) CONNECTION_ARENA_BLOCK_SIZE), size);
+        block = (struct ArenaBlock*) malloc(ARENA_BLOCK_HEADER_SIZE + capacity);
+        if (NULL == block) {
+            return NULL;
+        }
+        block->capacity = capacity;
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        if (OptionIncludeStatusPageAndCounters) {
+            counterAdd(counters.arenaBlockAllocations, 1);
+        }
+    }
+    char* allocation = arenaBlockData(block) + block->used;
+    block->used += size;
+    arena->lastAllocation = allocation;
+    return allocation;
+}
+
+/* Grows the last allocation in place when there's room behind it, which is the usual case for a response body being
+ appended to. Otherwise it's copied to a new allocation and the old one is just left for arenaReset. Like realloc, the
+ old allocation is untouched if this returns NULL */
+static void* arenaRealloc(struct Arena* arena, void* allocation, size_t oldSize, size_t newSize) {
+    struct ArenaBlock* block = arena->blocks;
+    if (NULL != allocation && allocation == arena->lastAllocation) {
+        size_t offset = (char*) allocation - arenaBlockData(block);
+        if (offset + ARENA_ALIGN(newSize) <= block->capacity) {
+            block->used = offset + ARENA_ALIGN(newSize);
+            return allocation;
+        }
+    }
+    void* newAllocation = arenaAlloc(arena, newSize);
+    if (NULL != allocation && NULL != newAllocation) {
+        memcpy(newAllocation, allocation, MIN(oldSize, newSize));
+    }
+    return newAllocation;
+}
+
+static bool arenaOwns(const struct Arena* arena, const void* pointer) {
+    uintptr_t address = (uintptr_t) pointer;
+    for (struct ArenaBlock* block = arena->blocks; NULL != block; block = block->next) {
+        uintptr_t data = (uintptr_t) arenaBlockData(block);
+        if (address >= data && address < data + block->capacity) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static char* arenaStrdup(struct Arena* arena, const char* string) {
+    size_t length = strlen(string);
+    char* copy = (char*) arenaAlloc(arena, length + 1);
+    if (NULL != copy) {
+        memcpy(copy, string, length + 1);
+    }
+    return copy;
+}
+
+/* Everything allocated since the last reset is gone. One block is kept for the next request. If this request needed
+ more than one (or one huge one), they're replaced with one block big enough for all of it (up to
+ CONNECTION_ARENA_MAX_BLOCK_SIZE) so the next request like it doesn't have to malloc */
+static void arenaReset(struct Arena* arena) {
+    struct ArenaBlock* block = arena->blocks;
+    arena->lastAllocation = NULL;
+    if (NULL == block) {
+        return;
+    }
+    if (NULL == block->next && block->capacity <= CONNECTION_ARENA_MAX_BLOCK_SIZE) {
+        block->used = 0;
+        return;
+    }
+    size_t totalUsed = 0;
+    while (NULL != block) {
+        struct ArenaBlock* next = block->next;
+        totalUsed += block->used;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->nextBlockSize = MIN(MAX(totalUsed, (size_t) CONNECTION_ARENA_BLOCK_SIZE), (size_t) CONNECTION_ARENA_MAX_BLOCK_SIZE);
+}
+
+static void arenaFree(struct Arena* arena) {
+    arenaReset(arena);
+    free(arena->blocks);
+    arena->blocks = NULL;
+}
+
+/* A string from a HeapString that came out of an arena. If someone pointed contents at their own malloc'd memory
+ it's theirs again */
+static bool heapStringInArena(const struct HeapString* string) {
+    return NULL != string->arena && (NULL == string->contents || arenaOwns(string->arena, string->contents));
+}
+
+/* For the pointers in a response: free them unless they came out of the response's arena */
+static void responseFreeField(const struct Response* response, void* field) {
+    if (NULL != field && (NULL == response->arena || !arenaOwns(response->arena, field))) {
+        free(field);
+    }
+}
+
+static char* responseStrdup(const struct Response* response, const char* string) {
+    if (NULL == string) {
+        return NULL;
+    }
+    if (NULL != response->arena) {
+        return arenaStrdup(response->arena, string);
+    }
+    return strdup(string);
+}
+
+void* connectionArenaAlloc(struct Connection* connection, size_t size) {
+    return arenaAlloc(&connection->arena, size);
+}
+
+/* Makes responses on this thread come from the connection's arena until connectionArenaLeave */
+static struct Arena* connectionArenaEnter(struct Connection* connection) {
+    struct Arena* previousArena = currentArena;
+    currentArena = &connection->arena;
+    return previousArena;
+}
+
+static void connectionArenaLeave(struct Arena* previousArena) {
+    currentArena = previousArena;
+}
 
 char* strdupDecodeGETorPOSTParam(const char* paramNameIncludingEquals, const char* paramString, const char* valueIfNotFound) {
     assert(strstr(paramNameIncludingEquals, "=") != NULL && "You have to pass an equals sign after the param name, like 'name='");
@@ -486,8 +1393,11 @@ char* strdupDecodeGETorPOSTParam(const char* paramNameIncludingEquals, const cha
     if (NULL == paramString) {
         return strdupIfNotNull(valueIfNotFound);
     }
-    /* Find the paramString ("name=") */
+    /* Find the paramString ("name="). It has to be the start of a parameter so "name=" doesn't find "username=" */
     const char* paramStart = strstr(paramString, paramNameIncludingEquals);
+    while (NULL != paramStart && paramStart != paramString && paramStart[-1] != '&' && paramStart[-1] != '?') {
+        paramStart = strstr(paramStart + 1, paramNameIncludingEquals);
+    }
     if (NULL == paramStart) {
         return strdupIfNotNull(valueIfNotFound);
     }
@@ -507,108 +1417,695 @@ char* strdupDecodeGETorPOSTParam(const char* paramNameIncludingEquals, const cha
     }
     size_t maximumPossibleLength = strlen(paramStart);
     char* decoded = (char*) malloc(maximumPossibleLength + 1);
-    bool decodeSuccess = URLDecode(paramStart, decoded, maximumPossibleLength + 1, NULL, URLDecodeTypeParameter);
+    bool decodeSuccess = URLDecode(paramStart, maximumPossibleLength, decoded, maximumPossibleLength + 1, NULL, URLDecodeTypeParameter);
     if (!decodeSuccess) {
         ews_printf("Failed to decode URL parameter %s due to lack of space. This is strange because we asked for %zu capacity for the decoded string", paramNameIncludingEquals, maximumPossibleLength);
     }
     return decoded;
 }
 
-char* strdupDecodeGETParam(const char* paramNameIncludingEquals, const struct Request* request, const char* valueIfNotFound) {
-    return strdupDecodeGETorPOSTParam(paramNameIncludingEquals, request->path, valueIfNotFound);
+/* FNV-1a */
+static uint32_t requestParamHash(const char* name, size_t nameLength) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < nameLength; i++) {
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+    }
+    return hash;
 }
 
-char* strdupDecodePOSTParam(const char* paramNameIncludingEquals, const struct Request* request, const char* valueIfNotFound) {
-    return strdupDecodeGETorPOSTParam(paramNameIncludingEquals, request->body.contents, valueIfNotFound);
+/* One allocation (from arenaOrNULL if there is one) with room for maxCount params, their hash and stringsLength bytes of
+ names and values, which *strings points at */
+static struct RequestParams* requestParamsAlloc(struct Arena* arenaOrNULL, size_t maxCount, size_t stringsLength, char** strings) {
+    size_t slotCount = 8;
+    while (slotCount < maxCount * 2) {
+        slotCount *= 2;
+    }
+    size_t allocationSize = sizeof(struct RequestParams) + maxCount * sizeof(struct RequestParam) + slotCount * sizeof(uint32_t) + stringsLength;
+    char* allocation = (char*) (NULL != arenaOrNULL ? arenaAlloc(arenaOrNULL, allocationSize) : malloc(allocationSize));
+    struct RequestParams* params = (struct RequestParams*) allocation;
+    params->params = (struct RequestParam*) (allocation + sizeof(struct RequestParams));
+    params->slots = (uint32_t*) (allocation + sizeof(struct RequestParams) + maxCount * sizeof(struct RequestParam));
+    params->slotsMask = slotCount - 1;
+    params->count = 0;
+    memset(params->slots, 0, slotCount * sizeof(uint32_t));
+    *strings = (char*) (params->slots + slotCount);
+    return params;
 }
 
-typedef enum {
-    PathStateNormal,
-    PathStateSep,
-    PathStateDot,
-} PathState;
+/* Call after filling in params->params[params->count] */
+static void requestParamsAdd(struct RequestParams* params) {
+    const struct RequestParam* param = &params->params[params->count];
+    params->count++;
+    /* the first one with a name wins, like strstr would find */
+    size_t slot = requestParamHash(param->name, param->nameLength) & params->slotsMask;
+    while (0 != params->slots[slot]) {
+        const struct RequestParam* existing = &params->params[params->slots[slot] - 1];
+        if (existing->nameLength == param->nameLength && 0 == memcmp(existing->name, param->name, param->nameLength)) {
+            break;
+        }
+        slot = (slot + 1) & params->slotsMask;
+    }
+    if (0 == params->slots[slot]) {
+        params->slots[slot] = (uint32_t) params->count;
+    }
+}
 
-/* Aggressively escape strings for URLs. This adds the %12%0f stuff */
-static char* strdupEscapeForURL(const char* stringToEscape) {
-    struct HeapString escapedString;
-    heapStringInit(&escapedString);
-    const char* p = stringToEscape;
-    while ('\0' != *p) {
-        bool isULetter = *p >= 'A' && *p <= 'Z';
-        bool isLLetter = *p >= 'a' && *p <= 'z';
-        bool isNumber = *p >= '0' && *p <= '9';
-        bool isAcceptablePunctuation = ('.' == *p || '/' == *p || '-' == *p);
-        if (isULetter || isLLetter || isNumber || isAcceptablePunctuation) {
-            heapStringAppendChar(&escapedString, *p);
+/* Copies encoded into the end of the allocation and decodes each name and value in place, which works because decoding
+ never makes anything longer */
+static struct RequestParams* requestParamsCreate(struct Arena* arenaOrNULL, const char* encoded, size_t encodedLength) {
+    size_t maxCount = 1;
+    for (const char* ampersand = (const char*) memchr(encoded, '&', encodedLength); NULL != ampersand;
+         ampersand = (const char*) memchr(ampersand + 1, '&', encodedLength - (ampersand + 1 - encoded))) {
+        maxCount++;
+    }
+    char* decoded;
+    struct RequestParams* params = requestParamsAlloc(arenaOrNULL, maxCount, encodedLength + 1, &decoded);
+    memcpy(decoded, encoded, encodedLength);
+    decoded[encodedLength] = '\0';
+    char* current = decoded;
+    char* end = decoded + encodedLength;
+    while (current < end) {
+        char* ampersand = (char*) memchr(current, '&', end - current);
+        char* next = NULL != ampersand ? ampersand + 1 : end;
+        char* segmentEnd = NULL != ampersand ? ampersand : end;
+        if (segmentEnd == current) {
+            current = next;
+            continue;
+        }
+        struct RequestParam* param = &params->params[params->count];
+        char* equals = (char*) memchr(current, '=', segmentEnd - current);
+        char* value = segmentEnd;
+        if (NULL != equals) {
+            /* URLDecode stops at '&' or '\0', so this makes it stop at the end of the name */
+            *equals = '\0';
+            value = equals + 1;
+        }
+        URLDecode(current, segmentEnd - current, current, segmentEnd - current + 1, &param->nameLength, URLDecodeTypeParameter);
+        param->name = current;
+        if (NULL != equals) {
+            URLDecode(value, segmentEnd - value, value, segmentEnd - value + 1, &param->valueLength, URLDecodeTypeParameter);
         } else {
-            // huh I guess %02x doesn't work in Windows?? holy cow
-            uint8_t pu8 = (uint8_t)*p;
-            uint8_t firstDigit = (pu8 & 0xf0) >> 4;
-            uint8_t secondDigit = pu8 & 0xf;
-            heapStringAppendFormat(&escapedString, "%%%x%x", firstDigit, secondDigit);
+            /* a bare "flag" has an empty value. Point it at the null that ends the name */
+            value = current + param->nameLength;
+            param->valueLength = 0;
         }
-        p++;
+        param->value = value;
+        requestParamsAdd(params);
+        current = next;
     }
-    return escapedString.contents;
+    return params;
 }
 
-char* strdupEscapeForHTML(const char* stringToEscape) {
-    struct HeapString escapedString;
-    heapStringInit(&escapedString);
-    size_t stringToEscapeLength = strlen(stringToEscape);
-    if (0 == stringToEscapeLength) {
-        char* empty = (char*) malloc(1);
-        *empty = '\0';
-        return empty;
+static const struct RequestParam* requestParamsFind(const struct RequestParams* params, const char* name, size_t nameLength) {
+    size_t slot = requestParamHash(name, nameLength) & params->slotsMask;
+    while (0 != params->slots[slot]) {
+        const struct RequestParam* param = &params->params[params->slots[slot] - 1];
+        if (param->nameLength == nameLength && 0 == memcmp(param->name, name, nameLength)) {
+            return param;
+        }
+        slot = (slot + 1) & params->slotsMask;
     }
-    for (size_t i = 0; i < stringToEscapeLength; i++) {
-        // this is an excerpt of some things translated by the PHP htmlentities function
-        char c = stringToEscape[i];
-        switch (c) {
-            case '"':
-                heapStringAppendFormat(&escapedString, "&quot;");
-                break;
-            case '&':
-                heapStringAppendFormat(&escapedString, "&amp;");
-                break;
-            case '\'':
-                heapStringAppendFormat(&escapedString, "&#039;");
-                break;
-            case '<':
-                heapStringAppendFormat(&escapedString, "&lt;");
-                break;
-            case '>':
-                heapStringAppendFormat(&escapedString, "&gt;");
-                break;
-            case ' ':
-                heapStringAppendFormat(&escapedString, "&nbsp;");
-                break;
-            default:
-                heapStringAppendChar(&escapedString, c);
-                break;
+    return NULL;
+}
+
+/* The tables are a cache, so we build them even though the handler only has a const request */
+const struct RequestParams* requestGETParams(const struct Request* request) {
+    if (NULL == request->GETParams) {
+        const char* query = strchr(request->path, '?');
+        query = NULL != query ? query + 1 : request->path + strlen(request->path);
+        ((struct Request*) request)->GETParams = requestParamsCreate(request->arena, query, strlen(query));
+    }
+    return request->GETParams;
+}
+
+const struct RequestParams* requestPOSTParams(const struct Request* request) {
+    if (NULL == request->POSTParams) {
+        size_t bodyLength = 0;
+        const char* body = requestBody(request, &bodyLength);
+        char boundary[MULTIPART_MAX_BOUNDARY_LENGTH + 1];
+        if (NULL != body && multipartBoundaryFromRequest(request, boundary, sizeof(boundary))) {
+            ((struct Request*) request)->POSTParams = requestParamsCreateFromMultipart(request, body, bodyLength);
+        } else {
+            ((struct Request*) request)->POSTParams = requestParamsCreate(request->arena, NULL != body ? body : "", NULL != body ? bodyLength : 0);
         }
     }
-    return escapedString.contents;
+    return request->POSTParams;
 }
 
-/* Is someone using ../ to try to read a directory outside of the documentRoot? */
-static bool pathEscapesDocumentRoot(const char* path) {
-    int subdirDepth = 0;
-    PathState state = PathStateNormal;
-    bool isFirstChar = true;
-    while ('\0' != *path) {
-        switch (state) {
-            case PathStateNormal:
-                if ('/' == *path || '\\' == *path) {
-                    state = PathStateSep;
-                } else if (isFirstChar && '.' == *path) {
-                    state = PathStateDot;
-                } else if (isFirstChar) {
-                    subdirDepth++;
-                }
-                isFirstChar = false;
-                break;
-            case PathStateSep:
+static const char* requestParamsValue(const struct RequestParams* params, const char* name, size_t nameLength, size_t* valueLengthOrNull) {
+    const struct RequestParam* param = requestParamsFind(params, name, nameLength);
+    if (NULL == param) {
+        return NULL;
+    }
+    if (NULL != valueLengthOrNull) {
+        *valueLengthOrNull = param->valueLength;
+    }
+    return param->value;
+}
+
+const char* requestGETParam(const struct Request* request, const char* name, size_t* valueLengthOrNull) {
+    return requestParamsValue(requestGETParams(request), name, strlen(name), valueLengthOrNull);
+}
+
+const char* requestPOSTParam(const struct Request* request, const char* name, size_t* valueLengthOrNull) {
+    return requestParamsValue(requestPOSTParams(request), name, strlen(name), valueLengthOrNull);
+}
+
+static void requestParamsFree(struct Request* request) {
+    /* the arena ones go when the arena is reset */
+    if (NULL == request->arena) {
+        free(request->GETParams);
+        free(request->POSTParams);
+    }
+    request->GETParams = NULL;
+    request->POSTParams = NULL;
+}
+
+static char* strdupParamValue(const struct RequestParams* params, const char* paramNameIncludingEquals, const char* valueIfNotFound) {
+    assert(strstr(paramNameIncludingEquals, "=") != NULL && "You have to pass an equals sign after the param name, like 'name='");
+    const char* value = requestParamsValue(params, paramNameIncludingEquals, strcspn(paramNameIncludingEquals, "="), NULL);
+    if (NULL == value) {
+        return strdupIfNotNull(valueIfNotFound);
+    }
+    return strdup(value);
+}
+
+char* strdupDecodeGETParam(const char* paramNameIncludingEquals, const struct Request* request, const char* valueIfNotFound) {
+    return strdupParamValue(requestGETParams(request), paramNameIncludingEquals, valueIfNotFound);
+}
+
+char* strdupDecodePOSTParam(const char* paramNameIncludingEquals, const struct Request* request, const char* valueIfNotFound) {
+    return strdupParamValue(requestPOSTParams(request), paramNameIncludingEquals, valueIfNotFound);
+}
+
+typedef enum {
+    /* before the first boundary. Anything here is ignored */
+    MultipartStatePreamble,
+    /* just after a boundary: "--" means that was the last one, otherwise whitespace and a CRLF and a part starts */
+    MultipartStateAfterBoundary,
+    MultipartStateAfterBoundaryDash,
+    MultipartStateAfterBoundaryCR,
+    MultipartStateHeaders,
+    MultipartStatePartData,
+    /* after the closing boundary. Anything here is ignored too */
+    MultipartStateDone,
+    MultipartStateError
+} MultipartState;
+
+struct MultipartParser {
+    struct MultipartCallbacks callbacks;
+    void* tag;
+    MultipartState state;
+    /* "\r\n--" and the boundary. It's the only thing we look for in the part data */
+    char delimiter[4 + MULTIPART_MAX_BOUNDARY_LENGTH];
+    size_t delimiterLength;
+    /* Boyer-Moore-Horspool: how far the search window can move when its last byte is this */
+    size_t skip[256];
+    /* The last piece ended with this many bytes of the delimiter. We don't pass them to partData until we know it's not
+     the delimiter, and we don't have to keep them around because they're delimiter[0..delimiterMatched) */
+    size_t delimiterMatched;
+    char headers[MULTIPART_MAX_HEADERS_LENGTH + 1];
+    size_t headersLength;
+    struct MultipartPart part;
+};
+
+/* Goes through the ;name=value parameters of a header value like 'form-data; name="a"; filename="b.txt"' and points
+ values[i] at the value of names[i] (or leaves it alone if it's not there). Unquotes and null-terminates the values in
+ place, so this only works once on a string */
+static void headerParametersParse(char* headerValue, const char* const* names, const char** values, size_t count) {
+    char* current = strchr(headerValue, ';');
+    while (NULL != current) {
+        current++;
+        while (' ' == *current || '\t' == *current) {
+            current++;
+        }
+        const char* name = current;
+        while ('\0' != *current && '=' != *current && ';' != *current) {
+            current++;
+        }
+        if ('=' != *current) {
+            current = strchr(current, ';');
+            continue;
+        }
+        size_t nameLength = current - name;
+        while (nameLength > 0 && (' ' == name[nameLength - 1] || '\t' == name[nameLength - 1])) {
+            nameLength--;
+        }
+        current++;
+        char* value = current;
+        char* valueEnd = current;
+        if ('"' == *current) {
+            current++;
+            while ('\0' != *current && '"' != *current) {
+                if ('\\' == *current && '\0' != current[1]) {
+                    current++;
+                }
+                *valueEnd++ = *current++;
+            }
+            if ('"' == *current) {
+                current++;
+            }
+        } else {
+            while ('\0' != *current && ';' != *current && ' ' != *current && '\t' != *current) {
+                current++;
+            }
+            valueEnd = current;
+        }
+        /* find the next one before the null goes in, since for an unquoted value the null lands on its ';' */
+        char* next = strchr(current, ';');
+        *valueEnd = '\0';
+        for (size_t i = 0; i < count; i++) {
+            if (strlen(names[i]) == nameLength && 0 == strncasecmp(name, names[i], nameLength)) {
+                values[i] = value;
+            }
+        }
+        current = next;
+    }
+}
+
+static bool multipartBoundaryFromRequest(const struct Request* request, char* boundary, size_t boundaryCapacity) {
+    const struct Header* contentType = headerInRequestByID(HeaderIDContentType, request);
+    if (NULL == contentType || contentType->value.length < strlen("multipart/") || 0 != strncasecmp(contentType->value.contents, "multipart/", strlen("multipart/"))) {
+        return false;
+    }
+    char value[1024];
+    if (contentType->value.length >= sizeof(value)) {
+        return false;
+    }
+    memcpy(value, contentType->value.contents, contentType->value.length);
+    value[contentType->value.length] = '\0';
+    const char* const names[] = { "boundary" };
+    const char* values[] = { NULL };
+    headerParametersParse(value, names, values, 1);
+    if (NULL == values[0] || '\0' == values[0][0] || strlen(values[0]) >= boundaryCapacity) {
+        return false;
+    }
+    strcpy(boundary, values[0]);
+    return true;
+}
+
+struct MultipartParser* multipartParserAlloc(const struct Request* request, const struct MultipartCallbacks* callbacks, void* tag) {
+    char boundary[MULTIPART_MAX_BOUNDARY_LENGTH + 1];
+    if (!multipartBoundaryFromRequest(request, boundary, sizeof(boundary))) {
+        return NULL;
+    }
+    struct MultipartParser* parser = (struct MultipartParser*) calloc(1, sizeof(*parser));
+    if (NULL != callbacks) {
+        parser->callbacks = *callbacks;
+    }
+    parser->tag = tag;
+    parser->state = MultipartStatePreamble;
+    parser->delimiterLength = 4 + strlen(boundary);
+    memcpy(parser->delimiter, "\r\n--", 4);
+    memcpy(parser->delimiter + 4, boundary, strlen(boundary));
+    for (size_t i = 0; i < 256; i++) {
+        parser->skip[i] = parser->delimiterLength;
+    }
+    for (size_t i = 0; i < parser->delimiterLength - 1; i++) {
+        parser->skip[(uint8_t) parser->delimiter[i]] = parser->delimiterLength - 1 - i;
+    }
+    /* The first boundary usually starts the body, so there's no CRLF before it. Pretend there was */
+    parser->delimiterMatched = 2;
+    return parser;
+}
+
+void multipartParserFree(struct MultipartParser* parser) {
+    free(parser);
+}
+
+bool multipartParserFinished(const struct MultipartParser* parser) {
+    return MultipartStateDone == parser->state;
+}
+
+/* Boyer-Moore-Horspool. The delimiter is long (a browser's boundary is 40ish characters) and rarely almost-matches, so
+ most of the time this only looks at one byte in every delimiterLength */
+static const char* multipartFindDelimiter(const struct MultipartParser* parser, const char* data, size_t length) {
+    const size_t delimiterLength = parser->delimiterLength;
+    const char lastByte = parser->delimiter[delimiterLength - 1];
+    size_t position = 0;
+    while (position + delimiterLength <= length) {
+        char windowLast = data[position + delimiterLength - 1];
+        if (windowLast == lastByte && 0 == memcmp(data + position, parser->delimiter, delimiterLength - 1)) {
+            return data + position;
+        }
+        position += parser->skip[(uint8_t) windowLast];
+    }
+    return NULL;
+}
+
+static bool multipartParserEmit(struct MultipartParser* parser, const char* data, size_t length) {
+    if (0 == length || MultipartStatePartData != parser->state || NULL == parser->callbacks.partData) {
+        return true;
+    }
+    return parser->callbacks.partData(parser->tag, &parser->part, data, length);
+}
+
+static bool multipartParserDelimiterFound(struct MultipartParser* parser) {
+    bool keepGoing = true;
+    if (MultipartStatePartData == parser->state && NULL != parser->callbacks.partEnd) {
+        keepGoing = parser->callbacks.partEnd(parser->tag, &parser->part);
+    }
+    parser->state = keepGoing ? MultipartStateAfterBoundary : MultipartStateError;
+    return keepGoing;
+}
+
+/* Goes through part data (or the preamble) until the delimiter. Returns how much of data it used */
+static size_t multipartParserScan(struct MultipartParser* parser, const char* data, size_t length) {
+    size_t position = 0;
+    if (parser->delimiterMatched > 0) {
+        /* the last piece ended with what looked like the start of the delimiter. See if this one finishes it */
+        while (position < length && parser->delimiterMatched + position < parser->delimiterLength &&
+               data[position] == parser->delimiter[parser->delimiterMatched + position]) {
+            position++;
+        }
+        if (parser->delimiterMatched + position == parser->delimiterLength) {
+            parser->delimiterMatched = 0;
+            multipartParserDelimiterFound(parser);
+            return position;
+        }
+        if (position == length) {
+            parser->delimiterMatched += position;
+            return length;
+        }
+        /* It wasn't the delimiter, so what we held back was data. The delimiter has no '\r' after its first byte, so
+         another one can't start anywhere in there - the earliest is data[position] */
+        if (!multipartParserEmit(parser, parser->delimiter, parser->delimiterMatched) || !multipartParserEmit(parser, data, position)) {
+            parser->state = MultipartStateError;
+            return length;
+        }
+        parser->delimiterMatched = 0;
+    }
+    const char* found = multipartFindDelimiter(parser, data + position, length - position);
+    if (NULL != found) {
+        if (!multipartParserEmit(parser, data + position, found - (data + position))) {
+            parser->state = MultipartStateError;
+            return length;
+        }
+        multipartParserDelimiterFound(parser);
+        return found - data + parser->delimiterLength;
+    }
+    /* Hold back the end if it could be the start of the delimiter. Only the last '\r' could start one, for the same reason */
+    size_t heldBack = 0;
+    size_t searchFrom = length - position >= parser->delimiterLength ? length - parser->delimiterLength + 1 : position;
+    for (size_t i = length; i > searchFrom; i--) {
+        if ('\r' == data[i - 1]) {
+            if (0 == memcmp(data + i - 1, parser->delimiter, length - (i - 1))) {
+                heldBack = length - (i - 1);
+            }
+            break;
+        }
+    }
+    if (!multipartParserEmit(parser, data + position, length - position - heldBack)) {
+        parser->state = MultipartStateError;
+        return length;
+    }
+    parser->delimiterMatched = heldBack;
+    return length;
+}
+
+/* The part headers are in parser->headers ending with an empty line. Pick out what goes in parser->part */
+static void multipartParserParseHeaders(struct MultipartParser* parser) {
+    memset(&parser->part, 0, sizeof(parser->part));
+    char* line = parser->headers;
+    while ('\0' != *line) {
+        char* lineEnd = strstr(line, "\r\n");
+        if (NULL == lineEnd) {
+            break;
+        }
+        *lineEnd = '\0';
+        char* colon = strchr(line, ':');
+        if (NULL != colon) {
+            char* value = colon + 1;
+            while (' ' == *value || '\t' == *value) {
+                value++;
+            }
+            size_t nameLength = colon - line;
+            if (nameLength == strlen("Content-Disposition") && 0 == strncasecmp(line, "Content-Disposition", nameLength)) {
+                const char* const names[] = { "name", "filename" };
+                const char* values[] = { NULL, NULL };
+                headerParametersParse(value, names, values, 2);
+                parser->part.name = values[0];
+                parser->part.filename = values[1];
+            } else if (nameLength == strlen("Content-Type") && 0 == strncasecmp(line, "Content-Type", nameLength)) {
+                parser->part.contentType = value;
+            }
+        }
+        line = lineEnd + 2;
+    }
+}
+
+bool multipartParserFeed(struct MultipartParser* parser, const char* data, size_t length) {
+    size_t position = 0;
+    while (position < length && MultipartStateDone != parser->state && MultipartStateError != parser->state) {
+        char c = data[position];
+        switch (parser->state) {
+            case MultipartStatePreamble:
+            case MultipartStatePartData:
+                position += multipartParserScan(parser, data + position, length - position);
+                break;
+            case MultipartStateAfterBoundary:
+                if ('-' == c) {
+                    parser->state = MultipartStateAfterBoundaryDash;
+                } else if ('\r' == c) {
+                    parser->state = MultipartStateAfterBoundaryCR;
+                } else if (' ' != c && '\t' != c) {
+                    parser->state = MultipartStateError;
+                }
+                position++;
+                break;
+            case MultipartStateAfterBoundaryDash:
+                parser->state = '-' == c ? MultipartStateDone : MultipartStateError;
+                position++;
+                break;
+            case MultipartStateAfterBoundaryCR:
+                parser->state = '\n' == c ? MultipartStateHeaders : MultipartStateError;
+                parser->headersLength = 0;
+                position++;
+                break;
+            case MultipartStateHeaders: {
+                if (parser->headersLength == MULTIPART_MAX_HEADERS_LENGTH) {
+                    ews_printf_debug("The headers of a multipart part are over %d bytes\n", MULTIPART_MAX_HEADERS_LENGTH);
+                    parser->state = MultipartStateError;
+                    break;
+                }
+                parser->headers[parser->headersLength++] = c;
+                position++;
+                /* the headers end with an empty line, which is the first line if there aren't any */
+                const char* end = parser->headers + parser->headersLength;
+                if ('\n' == c && ((2 == parser->headersLength && '\r' == parser->headers[0]) ||
+                                  (parser->headersLength >= 4 && 0 == memcmp(end - 4, "\r\n\r\n", 4)))) {
+                    parser->headers[parser->headersLength] = '\0';
+                    multipartParserParseHeaders(parser);
+                    parser->state = MultipartStatePartData;
+                    parser->delimiterMatched = 0;
+                    if (NULL != parser->callbacks.partStart && !parser->callbacks.partStart(parser->tag, &parser->part)) {
+                        parser->state = MultipartStateError;
+                    }
+                }
+                break;
+            }
+            case MultipartStateDone:
+            case MultipartStateError:
+                break;
+        }
+    }
+    return MultipartStateError != parser->state;
+}
+
+/* requestPOSTParams for multipart bodies. The first pass counts the form fields and their sizes, the second copies them
+ into the allocation */
+struct MultipartParamsBuilder {
+    struct RequestParams* params;
+    char* strings;
+    size_t stringsLength;
+    size_t count;
+};
+
+static bool multipartPartIsField(const struct MultipartPart* part) {
+    return NULL != part->name && NULL == part->filename;
+}
+
+static bool multipartParamsPartStart(void* tag, const struct MultipartPart* part) {
+    struct MultipartParamsBuilder* builder = (struct MultipartParamsBuilder*) tag;
+    if (!multipartPartIsField(part)) {
+        return true;
+    }
+    size_t nameLength = strlen(part->name);
+    if (NULL != builder->params) {
+        struct RequestParam* param = &builder->params->params[builder->params->count];
+        memcpy(builder->strings + builder->stringsLength, part->name, nameLength + 1);
+        param->name = builder->strings + builder->stringsLength;
+        param->nameLength = nameLength;
+        param->value = builder->strings + builder->stringsLength + nameLength + 1;
+        param->valueLength = 0;
+    }
+    builder->stringsLength += nameLength + 1;
+    return true;
+}
+
+static bool multipartParamsPartData(void* tag, const struct MultipartPart* part, const char* data, size_t length) {
+    struct MultipartParamsBuilder* builder = (struct MultipartParamsBuilder*) tag;
+    if (!multipartPartIsField(part)) {
+        return true;
+    }
+    if (NULL != builder->params) {
+        memcpy(builder->strings + builder->stringsLength, data, length);
+        builder->params->params[builder->params->count].valueLength += length;
+    }
+    builder->stringsLength += length;
+    return true;
+}
+
+static bool multipartParamsPartEnd(void* tag, const struct MultipartPart* part) {
+    struct MultipartParamsBuilder* builder = (struct MultipartParamsBuilder*) tag;
+    if (!multipartPartIsField(part)) {
+        return true;
+    }
+    if (NULL != builder->params) {
+        builder->strings[builder->stringsLength] = '\0';
+        requestParamsAdd(builder->params);
+    }
+    builder->stringsLength++;
+    builder->count++;
+    return true;
+}
+
+static struct RequestParams* requestParamsCreateFromMultipart(const struct Request* request, const char* body, size_t bodyLength) {
+    struct MultipartCallbacks callbacks = { &multipartParamsPartStart, &multipartParamsPartData, &multipartParamsPartEnd };
+    struct MultipartParamsBuilder builder;
+    memset(&builder, 0, sizeof(builder));
+    struct MultipartParser* parser = multipartParserAlloc(request, &callbacks, &builder);
+    multipartParserFeed(parser, body, bodyLength);
+    multipartParserFree(parser);
+    /* A part cut off by a malformed body isn't added but its name and data are still copied in, so leave room for it */
+    size_t count = builder.count + 1;
+    size_t stringsLength = builder.stringsLength + 1;
+    memset(&builder, 0, sizeof(builder));
+    builder.params = requestParamsAlloc(request->arena, count, stringsLength, &builder.strings);
+    parser = multipartParserAlloc(request, &callbacks, &builder);
+    multipartParserFeed(parser, body, bodyLength);
+    multipartParserFree(parser);
+    return builder.params;
+}
+
+typedef enum {
+    PathStateNormal,
+    PathStateSep,
+    PathStateDot,
+} PathState;
+
+/* What strdupEscapeForURL leaves alone */
+static bool URLCharacterIsSafe(char c) {
+    bool isULetter = c >= 'A' && c <= 'Z';
+    bool isLLetter = c >= 'a' && c <= 'z';
+    bool isNumber = c >= '0' && c <= '9';
+    bool isAcceptablePunctuation = ('.' == c || '/' == c || '-' == c);
+    return isULetter || isLLetter || isNumber || isAcceptablePunctuation;
+}
+
+/* Aggressively escape strings for URLs. This adds the %12%0f stuff. The first pass counts what needs escaping so the
+ result is one allocation, and both passes skip over the safe runs with scanForURLUnsafe and copy them with memcpy */
+static char* strdupEscapeForURL(const char* stringToEscape) {
+    size_t length = strlen(stringToEscape);
+    if (0 == length) {
+        /* this has always returned NULL for "" (it was an empty HeapString) */
+        return NULL;
+    }
+    size_t escapedLength = length;
+    for (size_t i = scanForURLUnsafe(stringToEscape, length); i < length; i += 1 + scanForURLUnsafe(stringToEscape + i + 1, length - i - 1)) {
+        escapedLength += 2;
+    }
+    char* escaped = (char*) malloc(escapedLength + 1);
+    static const char hexDigits[] = "0123456789abcdef";
+    size_t escapedi = 0;
+    size_t i = 0;
+    while (i < length) {
+        size_t run = scanForURLUnsafe(stringToEscape + i, length - i);
+        memcpy(escaped + escapedi, stringToEscape + i, run);
+        escapedi += run;
+        i += run;
+        if (i < length) {
+            uint8_t pu8 = (uint8_t) stringToEscape[i];
+            escaped[escapedi++] = '%';
+            escaped[escapedi++] = hexDigits[(pu8 & 0xf0) >> 4];
+            escaped[escapedi++] = hexDigits[pu8 & 0xf];
+            i++;
+        }
+    }
+    escaped[escapedi] = '\0';
+    return escaped;
+}
+
+/* The characters strdupEscapeForHTML replaces */
+static const char HTMLEscapedCharacters[] = "\"&'<> ";
+
+static const char* HTMLEntityFor(char c) {
+    // this is an excerpt of some things translated by the PHP htmlentities function
+    switch (c) {
+        case '"':
+            return "&quot;";
+        case '&':
+            return "&amp;";
+        case '\'':
+            return "&#039;";
+        case '<':
+            return "&lt;";
+        case '>':
+            return "&gt;";
+        case ' ':
+            return "&nbsp;";
+        default:
+            return NULL;
+    }
+}
+
+/* Sized up front and filled a run at a time, same as strdupEscapeForURL */
+char* strdupEscapeForHTML(const char* stringToEscape) {
+    const size_t escapedCharactersCount = sizeof(HTMLEscapedCharacters) - 1;
+    size_t length = strlen(stringToEscape);
+    size_t escapedLength = length;
+    for (size_t i = scanForAnyOf(stringToEscape, length, HTMLEscapedCharacters, escapedCharactersCount); i < length;
+         i += 1 + scanForAnyOf(stringToEscape + i + 1, length - i - 1, HTMLEscapedCharacters, escapedCharactersCount)) {
+        escapedLength += strlen(HTMLEntityFor(stringToEscape[i])) - 1;
+    }
+    char* escaped = (char*) malloc(escapedLength + 1);
+    size_t escapedi = 0;
+    size_t i = 0;
+    while (i < length) {
+        size_t run = scanForAnyOf(stringToEscape + i, length - i, HTMLEscapedCharacters, escapedCharactersCount);
+        memcpy(escaped + escapedi, stringToEscape + i, run);
+        escapedi += run;
+        i += run;
+        if (i < length) {
+            const char* entity = HTMLEntityFor(stringToEscape[i]);
+            size_t entityLength = strlen(entity);
+            memcpy(escaped + escapedi, entity, entityLength);
+            escapedi += entityLength;
+            i++;
+        }
+    }
+    escaped[escapedi] = '\0';
+    return escaped;
+}
+
+/* Is someone using ../ to try to read a directory outside of the documentRoot? */
+static bool pathEscapesDocumentRoot(const char* path) {
+    int subdirDepth = 0;
+    PathState state = PathStateNormal;
+    bool isFirstChar = true;
+    while ('\0' != *path) {
+        switch (state) {
+            case PathStateNormal:
+                if ('/' == *path || '\\' == *path) {
+                    state = PathStateSep;
+                } else if (isFirstChar && '.' == *path) {
+                    state = PathStateDot;
+                } else if (isFirstChar) {
+                    subdirDepth++;
+                }
+                isFirstChar = false;
+                break;
+            case PathStateSep:
                 if ('.' == *path) {
                     state = PathStateDot;
                 } else if ('/' != *path && '\\' != *path) {
@@ -635,75 +2132,85 @@ static bool pathEscapesDocumentRoot(const char* path) {
     return false;
 }
 
-static bool URLDecode(const char* encoded, char* decoded, size_t decodedCapacity, size_t* decodedLength, URLDecodeType type) {
+/* Decodes up to encodedLength bytes of encoded, stopping early at a '\0' (or '&' for URLDecodeTypeParameter). The runs
+ between '%' and '+' are found with scanForAnyOf and copied in bulk. decoded can be encoded, since decoding never makes
+ anything longer */
+static bool URLDecode(const char* encoded, size_t encodedLength, char* decoded, size_t decodedCapacity, size_t* decodedLength, URLDecodeType type) {
     /* A URL encoded string of length N should always be able to fit into a decoded string <= N */
     /* We found a value. Unescape the URL. This is probably filled with bugs */
+    const char stopCharacters[] = { '\0', '%', '+', '&' };
+    /* only stop at & if we are decoding a parameter */
+    const size_t stopCharactersCount = URLDecodeTypeParameter == type ? 4 : 3;
     size_t deci = 0;
-    /* these three vars unescape % escaped things */
-    URLDecodeState state = URLDecodeStateNormal;
-    char firstDigit = '\0';
-    char secondDigit;
+    size_t enci = 0;
     bool capacityExhausted = false;
-    size_t encodedLength = 0;
-    while (1) {
-        /* break out the exit conditions */
-        /* nothing left in the encoding string to process */
-        if (*encoded == '\0') {
+    while (enci < encodedLength) {
+        size_t run = scanForAnyOf(encoded + enci, encodedLength - enci, stopCharacters, stopCharactersCount);
+        /* need to store a null char in decoded[decodedCapacity - 1] */
+        size_t room = decodedCapacity - 1 - deci;
+        if (run > room) {
+            memmove(decoded + deci, encoded + enci, room);
+            deci += room;
+            enci += room;
+            capacityExhausted = true;
             break;
         }
-        /* If we are decoding only a parameter then stop at & */
-        if (*encoded == '&' && URLDecodeTypeParameter == type) {
+        memmove(decoded + deci, encoded + enci, run);
+        deci += run;
+        enci += run;
+        /* nothing left in the encoding string to process */
+        if (enci == encodedLength || '\0' == encoded[enci] || '&' == encoded[enci]) {
             break;
         }
-        /* need to store a null char in decoded[decodedCapacity - 1] */
+        /* Note that the capacity is only exhausted if we have more to process.
+         Thus it is the last check before '\0' and '&'. */
         if (deci >= decodedCapacity - 1) {
-            /* Note that the capacity is only exhausted if we have more to process.
-             Thus it is the last check before '\0' and '&'. */
             capacityExhausted = true;
             break;
         }
-        switch (state) {
-            case URLDecodeStateNormal:
-                if ('%' == *encoded) {
-                    state = URLDecodeStatePercentFirstDigit;
-                } else if ('+' == *encoded) {
-                    decoded[deci] = ' ';
-                    deci++;
-                } else {
-                    decoded[deci] = *encoded;
-                    deci++;
-                }
-                break;
-            case URLDecodeStatePercentFirstDigit:
-                // copy the first digit, get the second digit
-                firstDigit = *encoded;
-                state = URLDecodeStatePercentSecondDigit;
-                break;
-            case URLDecodeStatePercentSecondDigit:
-            {
-                secondDigit = *encoded;
-                int decodedEscape;
-                char hexString[] = {firstDigit, secondDigit, '\0'};
-                int items = sscanf(hexString, "%02x", &decodedEscape);
-                if (1 == items) {
-                    decoded[deci] = (char) decodedEscape;
-                    deci++;
-                } else {
-                    ews_printf("Warning: Unable to decode hex string 0x%s from %s", hexString, encoded);
-                }
-                state = URLDecodeStateNormal;
+        if ('+' == encoded[enci]) {
+            decoded[deci] = ' ';
+            deci++;
+            enci++;
+            continue;
+        }
+        /* a '%' takes whatever the next two characters are as the hex digits, unless the string ends first */
+        enci++;
+        if (enci == encodedLength || '\0' == encoded[enci] || ('&' == encoded[enci] && URLDecodeTypeParameter == type)) {
+            break;
+        }
+        char firstDigit = encoded[enci];
+        enci++;
+        if (enci == encodedLength || '\0' == encoded[enci] || ('&' == encoded[enci] && URLDecodeTypeParameter == type)) {
+            break;
+        }
+        char secondDigit = encoded[enci];
+        int firstValue = hexDigitValue(firstDigit);
+        int secondValue = hexDigitValue(secondDigit);
+        if (firstValue >= 0 && secondValue >= 0) {
+            decoded[deci] = (char) (firstValue * 16 + secondValue);
+            deci++;
+        } else {
+            /* sscanf is what this always used and it takes things like "%+1" and "% a" too, so keep asking it about
+             anything that isn't two hex digits */
+            int decodedEscape;
+            char hexString[] = {firstDigit, secondDigit, '\0'};
+            int items = sscanf(hexString, "%02x", &decodedEscape);
+            if (1 == items) {
+                decoded[deci] = (char) decodedEscape;
+                deci++;
+            } else {
+                ews_printf("Warning: Unable to decode hex string 0x%s from %s", hexString, encoded + enci);
             }
-                break;
         }
-        encoded++;
-        encodedLength++;
+        enci++;
     }
     decoded[deci] = '\0';
     if (NULL != decodedLength) {
         *decodedLength = deci;
     }
     if (capacityExhausted) {
-        ews_printf_debug("URLDecode: A string of length %zu could not be decoded into a string of capacity %zu\n", encodedLength, decodedCapacity);
+        ews_printf_debug("URLDecode: A string of length %zu could not be decoded into a string of capacity %zu\n", enci, decodedCapacity);
         return false;
     }
     return true;
@@ -713,23 +2220,42 @@ static void heapStringReallocIfNeeded(struct HeapString* string, size_t minimumC
     if (minimumCapacity <= string->capacity) {
         return;
     }
+    if (heapStringInArena(string)) {
+        size_t oldCapacity = string->capacity;
+        size_t newCapacity = heapStringNextAllocationSize(minimumCapacity);
+        if (newCapacity <= CONNECTION_ARENA_MAX_STRING) {
+            string->contents = (char*) arenaRealloc(string->arena, string->contents, oldCapacity, newCapacity);
+            string->capacity = newCapacity;
+            string->contents[string->length] = '\0';
+            return;
+        }
+        /* too big for the arena. Move it out and carry on below like it was always malloc'd */
+        char* contents = string->contents;
+        string->contents = NULL;
+        string->capacity = 0;
+        string->arena = NULL;
+        heapStringReallocIfNeeded(string, minimumCapacity);
+        if (NULL != contents) {
+            memcpy(string->contents, contents, string->length);
+        }
+        return;
+    }
     /* to avoid many reallocations every time we call AppendChar, round up to the next power of two */
     string->capacity = heapStringNextAllocationSize(minimumCapacity);
     assert(string->capacity > 0 && "We are about to allocate a string with 0 capacity. We should have checked this condition above");
     bool previouslyAllocated = string->contents != NULL;
     /* Sometimes string->contents is NULL. realloc handles that case so no need for an extra if (NULL) malloc else realloc */
     string->contents = (char*) realloc(string->contents, string->capacity);
-	/* zero out the newly allocated memory */
-    memset(&string->contents[string->length], 0, string->capacity - string->length);
+    /* only the terminator needs writing. Zeroing the whole new tail used to cost as much as the copy for big bodies and
+     every caller writes the bytes it appends anyway */
+    string->contents[string->length] = '\0';
     if (OptionIncludeStatusPageAndCounters) {
-        pthread_mutex_lock(&counters.lock);
         if (previouslyAllocated) {
-            counters.heapStringReallocations++;
+            counterAdd(counters.heapStringReallocations, 1);
         } else {
-            counters.heapStringAllocations++;
+            counterAdd(counters.heapStringAllocations, 1);
         }
-        counters.heapStringTotalBytesReallocated += string->capacity;
-        pthread_mutex_unlock(&counters.lock);
+        counterAdd(counters.heapStringTotalBytesReallocated, string->capacity);
     }
 }
 
@@ -835,19 +2361,23 @@ void heapStringInit(struct HeapString* string) {
     string->capacity = 0;
     string->contents = NULL;
     string->length = 0;
+    string->arena = NULL;
 }
 
 void heapStringFreeContents(struct HeapString* string) {
-    if (NULL != string->contents) {
+    if (NULL != string->contents && heapStringInArena(string)) {
+        /* the arena gets it back when it's reset */
+        string->contents = NULL;
+        string->capacity = 0;
+        string->length = 0;
+    } else if (NULL != string->contents) {
         assert(string->capacity > 0 && "A heap string had a capacity > 0 with non-NULL contents which implies a malloc(0)");
         free(string->contents);
         string->contents = NULL;
         string->capacity = 0;
         string->length = 0;
         if (OptionIncludeStatusPageAndCounters) {
-            pthread_mutex_lock(&counters.lock);
-            counters.heapStringFrees++;
-            pthread_mutex_unlock(&counters.lock);
+            counterAdd(counters.heapStringFrees, 1);
         }
     } else {
         assert(string->capacity == 0 && "Why did a string with a NULL contents have a capacity > 0? This is not correct and may indicate corruption");
@@ -858,9 +2388,10 @@ struct HeapString connectionDebugStringCreate(const struct Connection* connectio
     struct HeapString debugString;
     heapStringInit(&debugString);
     heapStringAppendFormat(&debugString, "%s %s from %s:%s\n", connection->request.method, connection->request.path, connection->remoteHost, connection->remotePort);
-    heapStringAppendFormat(&debugString, "Request URL Path decoded to '%s'\n", connection->request.pathDecoded);
+    heapStringAppendFormat(&debugString, "Request URL Path decoded to '%s'\n", NULL != connection->request.pathDecoded ? connection->request.pathDecoded : "");
     heapStringAppendFormat(&debugString, "Bytes sent:%" PRId64 "\n", connection->status.bytesSent);
     heapStringAppendFormat(&debugString, "Bytes received:%" PRId64 "\n", connection->status.bytesReceived);
+    heapStringAppendFormat(&debugString, "Requests on this connection:%" PRId64 "\n", connection->status.requestsHandled);
     heapStringAppendFormat(&debugString, "Final request parse state:%d\n", connection->request.state);
     heapStringAppendFormat(&debugString, "Header pool used:%" PRIu64 "\n", (uint64_t) connection->request.headersStringPoolOffset);
     heapStringAppendFormat(&debugString, "Header count:%" PRIu64 "\n", (uint64_t) connection->request.headersCount);
@@ -908,13 +2439,79 @@ struct HeapString connectionDebugStringCreate(const struct Connection* connectio
     return debugString;
 }
 
+/* The headers, their pool and pathDecoded come from the connection's arena, or malloc for a request that isn't part of
+ a connection */
+static void* requestRealloc(struct Request* request, void* allocation, size_t oldSize, size_t newSize) {
+    if (NULL != request->arena) {
+        return arenaRealloc(request->arena, allocation, oldSize, newSize);
+    }
+    return realloc(allocation, newSize);
+}
+
+/* Makes room for the header at headersCount. The array is copied to a bigger allocation when it's full. Returns false
+ (and marks the request headersStringPoolExhausted) if we're out of memory */
+static bool requestHeadersReserve(struct Request* request) {
+    if (request->headersCount < request->headersCapacity) {
+        return true;
+    }
+    size_t capacity = MIN(MAX(request->headersCapacity * 2, (size_t) REQUEST_HEADERS_INITIAL_COUNT), (size_t) REQUEST_MAX_HEADERS);
+    struct Header* headers = (struct Header*) requestRealloc(request, request->headers, request->headersCapacity * sizeof(request->headers[0]), capacity * sizeof(request->headers[0]));
+    if (NULL == headers) {
+        request->warnings.headersStringPoolExhausted = true;
+        return false;
+    }
+    request->headers = headers;
+    memset(&request->headers[request->headersCapacity], 0, (capacity - request->headersCapacity) * sizeof(request->headers[0]));
+    request->headersCapacity = capacity;
+    return true;
+}
+
+#if !EWS_HEADER_SLICES
+/* Grows the pool so it holds at least poolLength characters (never more than REQUEST_HEADERS_MAX_MEMORY). If it moves,
+ the headers are pointed at the new copy. Returns false (and marks the pool exhausted) if we're out of memory */
+static bool poolReserve(struct Request* request, size_t poolLength) {
+    if (poolLength <= request->headersStringPoolCapacity) {
+        return true;
+    }
+    size_t capacity = MAX(request->headersStringPoolCapacity, (size_t) REQUEST_HEADERS_INITIAL_MEMORY);
+    while (capacity < poolLength) {
+        capacity *= 2;
+    }
+    capacity = MIN(capacity, (size_t) REQUEST_HEADERS_MAX_MEMORY);
+    char* oldPool = request->headersStringPool;
+    char* newPool = (char*) requestRealloc(request, oldPool, request->headersStringPoolCapacity, capacity);
+    if (NULL == newPool) {
+        request->warnings.headersStringPoolExhausted = true;
+        return false;
+    }
+    if (NULL != oldPool && newPool != oldPool) {
+        for (size_t i = 0; i <= request->headersCount && i < request->headersCapacity; i++) {
+            struct Header* header = &request->headers[i];
+            if (NULL != header->name.contents) {
+                header->name.contents = newPool + (header->name.contents - oldPool);
+            }
+            if (NULL != header->value.contents) {
+                header->value.contents = newPool + (header->value.contents - oldPool);
+            }
+        }
+    }
+    request->headersStringPool = newPool;
+    request->headersStringPoolCapacity = capacity;
+    return true;
+}
+
 static void poolStringStartNewString(struct PoolString* poolString, struct Request* request) {
     /* always re-initialize the length...just in case */
     poolString->length = 0;
     
     /* this is the first string in the pool */
     if (0 == request->headersStringPoolOffset) {
+        if (!poolReserve(request, 1)) {
+            poolString->contents = NULL;
+            return;
+        }
         poolString->contents = request->headersStringPool;
+        poolString->contents[0] = '\0';
         return;
     }
     /* the pool string is full - don't initialize anything writable and ensure any writing to this pool string crashes */
@@ -924,39 +2521,84 @@ static void poolStringStartNewString(struct PoolString* poolString, struct Reque
         request->warnings.headersStringPoolExhausted = true;
         return;
     }
-    /* there's already another string in the pool - we need to skip the null character (the string pool is initialized to 0s by calloc) */
+    /* there's already another string in the pool - we need to skip its null character */
     request->headersStringPoolOffset++;
+    if (!poolReserve(request, request->headersStringPoolOffset + 1)) {
+        poolString->contents = NULL;
+        return;
+    }
     poolString->contents = &request->headersStringPool[request->headersStringPoolOffset];
+    poolString->contents[0] = '\0';
     poolString->length = 0;
 }
+#endif
 
-static void poolStringAppendChar(struct Request* request, struct PoolString* string, char c) {
-    if (request->headersStringPoolOffset >= REQUEST_HEADERS_MAX_MEMORY - 1 - sizeof('\0')) { // we need to store one character (-1) and a null character at the end of the last string sizeof('\0')
+/* Appends length characters to string, starting it in the pool if these are its first characters */
+static void poolStringAppend(struct Request* request, struct PoolString* string, const char* characters, size_t length) {
+#if EWS_HEADER_SLICES
+    /* the characters stay where they are in the receive buffer, which hands us each request as one contiguous run */
+    if (NULL == string->contents) {
+        string->contents = (char*) characters;
+    }
+    assert(string->contents + string->length == characters && "Header slices have to be contiguous");
+    string->length += length;
+    request->headersStringPoolOffset += length;
+    request->headerSlicesEnd = characters + length;
+#else
+    if (NULL == string->contents) {
+        poolStringStartNewString(string, request);
+    }
+    const size_t poolEnd = REQUEST_HEADERS_MAX_MEMORY - 1 - sizeof('\0'); // we need to store one character (-1) and a null character at the end of the last string sizeof('\0')
+    size_t copyLength = 0;
+    if (NULL != string->contents && request->headersStringPoolOffset < poolEnd) {
+        copyLength = MIN(length, poolEnd - request->headersStringPoolOffset);
+        /* the pool isn't zeroed, so make room for a null character after these too. This can move string->contents */
+        if (poolReserve(request, request->headersStringPoolOffset + copyLength + sizeof('\0'))) {
+            memcpy(string->contents + string->length, characters, copyLength);
+            string->length += copyLength;
+            string->contents[string->length] = '\0';
+        } else {
+            copyLength = 0;
+        }
+    }
+    request->headersStringPoolOffset += copyLength;
+    if (copyLength < length) {
         request->warnings.headersStringPoolExhausted = true;
-        return;
     }
-    string->contents[string->length] = c;
-    string->length++;
-    request->headersStringPoolOffset++;
+#endif
 }
 
 // allocates a response with content = malloc(contentLength + 1) so you can write null-terminated strings to it
 struct Response* responseAlloc(int code, const char* status, const char* contentType, size_t bodyCapacity) {
-    struct Response* response = (struct Response*) calloc(1, sizeof(*response));
+    struct Response* response;
+    if (NULL != currentArena) {
+        response = (struct Response*) arenaAlloc(currentArena, sizeof(*response));
+        memset(response, 0, sizeof(*response));
+        response->arena = currentArena;
+    } else {
+        response = (struct Response*) calloc(1, sizeof(*response));
+    }
     response->code = code;
+    /* the body goes last so it can grow in place */
+    response->contentType = responseStrdup(response, contentType);
+    response->status = responseStrdup(response, status);
     heapStringInit(&response->body);
     response->body.capacity = bodyCapacity;
     response->body.length = 0;
-    if (response->body.capacity > 0) {
+    if (NULL != response->arena && bodyCapacity > 0 && bodyCapacity <= CONNECTION_ARENA_MAX_STRING) {
+        response->body.arena = response->arena;
+        response->body.contents = (char*) arenaAlloc(response->arena, bodyCapacity);
+        memset(response->body.contents, 0, bodyCapacity);
+    } else if (response->body.capacity > 0) {
         response->body.contents = (char*) calloc(1, response->body.capacity);
         if (OptionIncludeStatusPageAndCounters) {
-            pthread_mutex_lock(&counters.lock);
-            counters.heapStringAllocations++;
-            pthread_mutex_unlock(&counters.lock);
+            counterAdd(counters.heapStringAllocations, 1);
         }
     }
-    response->contentType = strdupIfNotNull(contentType);
-    response->status = strdupIfNotNull(status);
+    if (NULL != response->arena) {
+        /* if it started out empty it can still grow in the arena */
+        response->body.arena = response->arena;
+    }
     return response;
 }
 
@@ -1115,7 +2757,10 @@ struct Response* responseAllocServeFileFromRequestPath(const char* pathPrefix, c
         pathPrefix = "/";
     }
     assert(NULL != requestPath && "The requestPath should not be NULL. It can be empty, but not NULL. Pass request->path");
-    assert(NULL != requestPathDecoded && "The requestPathDecoded should not be NULL. It can be empty, but not NULL. Pass request->requestPathDecoded");
+    /* request->pathDecoded of a zeroed request that was never parsed. That's no path at all, which matches nothing */
+    if (NULL == requestPathDecoded) {
+        requestPathDecoded = "";
+    }
     // Step 1 (see above)
     size_t matchLength = 0;
     /* Do we even match this path? Also figure out the suffix (note the use of the _decoded_ path -- otherwise we would have %12s and stuff everywhere */
@@ -1265,31 +2910,27 @@ struct Response* responseAlloc500InternalErrorHTML(const char* extraInformationO
 
 struct Response* responseAllocWithFile(const char* filename, const char* MIMETypeOrNULL) {
     struct Response* response = responseAlloc(200, "OK", MIMETypeOrNULL, 0);
-    response->filenameToSend = strdup(filename);
+    response->filenameToSend = responseStrdup(response, filename);
     return response;
 }
 
 static void responseFree(struct Response* response) {
-    if (NULL != response->status) {
-        free(response->status);
-    }
-    if (NULL != response->filenameToSend) {
-        free(response->filenameToSend);
-    }
-    if (NULL != response->contentType) {
-        free(response->contentType);
-    }
-    if (NULL != response->extraHeaders) {
-        free(response->extraHeaders);
-    }
+    responseFreeField(response, response->status);
+    responseFreeField(response, response->filenameToSend);
+    responseFreeField(response, response->contentType);
+    responseFreeField(response, response->extraHeaders);
     heapStringFreeContents(&response->body);
-    free(response);
+    responseFreeField(response, response);
 }
 
 /* Only grab another header if we have space for it. This was revealed to be open for attack by afl-fuzz! */
 static RequestParseState stateHeaderNameIfSpaceLeft(struct Request* request) {
     if (request->headersCount < REQUEST_MAX_HEADERS) {
-        if (!request->warnings.headersStringPoolExhausted) {
+        if (!request->warnings.headersStringPoolExhausted && requestHeadersReserve(request)) {
+#if EWS_HEADER_SLICES
+            /* a slice can't pick up where a header we didn't keep (no name or no value) left off, so start clean */
+            memset(&request->headers[request->headersCount], 0, sizeof(request->headers[0]));
+#endif
             return RequestParseStateHeaderName;
         }
     } else {
@@ -1298,79 +2939,403 @@ static RequestParseState stateHeaderNameIfSpaceLeft(struct Request* request) {
     return RequestParseStateEatHeaders;
 }
 
-/* parses a typical HTTP request looking for the first line: GET /path HTTP/1.0\r\n */
-static void requestParse(struct Request* request, const char* requestFragment, size_t requestFragmentLength) {
-    for (size_t i = 0; i < requestFragmentLength; i++) {
+/* The index of the lowest set bit in a SIMD compare mask. value can't be 0 */
+#if EWS_SIMD_SSE2 || EWS_SIMD_AVX2
+static unsigned countTrailingZeros(unsigned value) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (unsigned) index;
+#else
+    return (unsigned) __builtin_ctz(value);
+#endif
+}
+#endif
+
+/* Returns the index of the first a or b in data, or length if neither is there. This is where requestParse spends its
+ time on big headers (cookies...) so we compare 32 or 16 bytes at once when the compiler lets us */
+static size_t requestScanFor(const char* data, size_t length, char a, char b) {
+    size_t i = 0;
+#if EWS_SIMD_AVX2
+    const __m256i a32 = _mm256_set1_epi8(a);
+    const __m256i b32 = _mm256_set1_epi8(b);
+    for (; i + 32 <= length; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*) (data + i));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, a32), _mm256_cmpeq_epi8(chunk, b32)));
+        if (0 != mask) {
+            return i + countTrailingZeros(mask);
+        }
+    }
+#endif
+#if EWS_SIMD_SSE2
+    const __m128i a16 = _mm_set1_epi8(a);
+    const __m128i b16 = _mm_set1_epi8(b);
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (data + i));
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, a16), _mm_cmpeq_epi8(chunk, b16)));
+        if (0 != mask) {
+            return i + countTrailingZeros(mask);
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        if (data[i] == a || data[i] == b) {
+            return i;
+        }
+    }
+    return length;
+}
+
+/* Like requestScanFor but for any of the setLength bytes in set. For URLDecode and strdupEscapeForHTML */
+static size_t scanForAnyOf(const char* data, size_t length, const char* set, size_t setLength) {
+    size_t i = 0;
+#if EWS_SIMD_AVX2
+    for (; i + 32 <= length; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*) (data + i));
+        __m256i matches = _mm256_setzero_si256();
+        for (size_t s = 0; s < setLength; s++) {
+            matches = _mm256_or_si256(matches, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(set[s])));
+        }
+        unsigned mask = (unsigned) _mm256_movemask_epi8(matches);
+        if (0 != mask) {
+            return i + countTrailingZeros(mask);
+        }
+    }
+#endif
+#if EWS_SIMD_SSE2
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (data + i));
+        __m128i matches = _mm_setzero_si128();
+        for (size_t s = 0; s < setLength; s++) {
+            matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(set[s])));
+        }
+        unsigned mask = (unsigned) _mm_movemask_epi8(matches);
+        if (0 != mask) {
+            return i + countTrailingZeros(mask);
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        if (NULL != memchr(set, data[i], setLength)) {
+            return i;
+        }
+    }
+    return length;
+}
+
+/* Returns the index of the first byte strdupEscapeForURL has to escape, or length. The safe bytes are two ranges:
+ "-./0123456789" and the letters, which are one range once the 0x20 (lowercase) bit is set. Bytes over 0x7f are negative
+ to the signed compares so they're never in a range */
+static size_t scanForURLUnsafe(const char* data, size_t length) {
+    size_t i = 0;
+#if EWS_SIMD_AVX2
+    const __m256i punctuationLow32 = _mm256_set1_epi8('-' - 1);
+    const __m256i digitHigh32 = _mm256_set1_epi8('9' + 1);
+    const __m256i letterLow32 = _mm256_set1_epi8('a' - 1);
+    const __m256i letterHigh32 = _mm256_set1_epi8('z' + 1);
+    const __m256i lowercase32 = _mm256_set1_epi8(0x20);
+    for (; i + 32 <= length; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*) (data + i));
+        __m256i lower = _mm256_or_si256(chunk, lowercase32);
+        __m256i safe = _mm256_or_si256(_mm256_and_si256(_mm256_cmpgt_epi8(chunk, punctuationLow32), _mm256_cmpgt_epi8(digitHigh32, chunk)),
+                                       _mm256_and_si256(_mm256_cmpgt_epi8(lower, letterLow32), _mm256_cmpgt_epi8(letterHigh32, lower)));
+        unsigned mask = ~(unsigned) _mm256_movemask_epi8(safe);
+        if (0 != mask) {
+            return i + countTrailingZeros(mask);
+        }
+    }
+#endif
+#if EWS_SIMD_SSE2
+    const __m128i punctuationLow16 = _mm_set1_epi8('-' - 1);
+    const __m128i digitHigh16 = _mm_set1_epi8('9' + 1);
+    const __m128i letterLow16 = _mm_set1_epi8('a' - 1);
+    const __m128i letterHigh16 = _mm_set1_epi8('z' + 1);
+    const __m128i lowercase16 = _mm_set1_epi8(0x20);
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (data + i));
+        __m128i lower = _mm_or_si128(chunk, lowercase16);
+        __m128i safe = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(chunk, punctuationLow16), _mm_cmpgt_epi8(digitHigh16, chunk)),
+                                    _mm_and_si128(_mm_cmpgt_epi8(lower, letterLow16), _mm_cmpgt_epi8(letterHigh16, lower)));
+        unsigned mask = ~(unsigned) _mm_movemask_epi8(safe) & 0xffff;
+        if (0 != mask) {
+            return i + countTrailingZeros(mask);
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        if (!URLCharacterIsSafe(data[i])) {
+            return i;
+        }
+    }
+    return length;
+}
+
+/* Appends span to a fixed-size field like request->method, keeping room for the null character */
+static void requestAppendSpan(char* field, size_t* fieldLength, size_t fieldCapacity, const char* span, size_t spanLength, bool* truncated) {
+    size_t copyLength = MIN(spanLength, fieldCapacity - 1 - *fieldLength);
+    memcpy(field + *fieldLength, span, copyLength);
+    *fieldLength += copyLength;
+    if (copyLength < spanLength) {
+        *truncated = true;
+    }
+}
+
+/* parses a typical HTTP request looking for the first line: GET /path HTTP/1.0\r\n
+ Returns how many bytes of requestFragment it used. Once the request is done it stops, so anything after that is the
+ start of the next (pipelined) request */
+static size_t requestParse(struct Request* request, const char* requestFragment, size_t requestFragmentLength) {
+    return requestParseUntil(request, requestFragment, requestFragmentLength, RequestParseStateDone);
+}
+
+/* RequestParseStateBody and the chunked body states */
+static bool requestParseStateIsBody(RequestParseState state) {
+    return state >= RequestParseStateBody && state <= RequestParseStateChunkTrailerLF;
+}
+
+/* Is there nothing more to parse in this request? */
+static bool requestParseFinished(const struct Request* request) {
+    return RequestParseStateDone == request->state || RequestParseStateBadRequest == request->state;
+}
+
+static int hexDigitValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+        return (c | 0x20) - 'a' + 10;
+    }
+    return -1;
+}
+
+/* How much of the body we've kept, in memory or in the spill file */
+static size_t requestBodyLength(const struct Request* request) {
+    return request->bodySpilled ? request->bodyFileLength : request->body.length;
+}
+
+#if EWS_BODY_SPILL_SUPPORTED
+static int requestBodySpillFileOpen(void) {
+    const char* directory = getenv("TMPDIR");
+    if (NULL == directory || '\0' == directory[0]) {
+        directory = "/tmp";
+    }
+    int fd;
+#ifdef O_TMPFILE
+    /* Linux can make a file that never had a name */
+    fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/ews-request-body-XXXXXX", directory);
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+    }
+    return fd;
+}
+
+static void requestBodyFileWrite(struct Request* request, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(request->bodyFileDescriptor, data, length);
+        if (written < 0 && EINTR == errno) {
+            continue;
+        }
+        if (written <= 0) {
+            ews_printf("Warning: Could not write the request body to its temporary file. %s = %d. The rest of it is dropped\n", strerror(errno), errno);
+            request->warnings.bodyTruncated = true;
+            return;
+        }
+        data += written;
+        length -= (size_t) written;
+        request->bodyFileLength += (size_t) written;
+    }
+}
+
+/* Moves whatever is in request->body to a new spill file. If we can't make one the body just stays in memory */
+static void requestBodySpill(struct Request* request) {
+    request->bodySpillThreshold = 0;
+    int fd = requestBodySpillFileOpen();
+    if (fd < 0) {
+        ews_printf("Warning: Could not create a temporary file for a big request body. %s = %d. Keeping it in memory\n", strerror(errno), errno);
+        return;
+    }
+    request->bodySpilled = true;
+    request->bodyFileDescriptor = fd;
+    request->bodyFileLength = 0;
+    requestBodyFileWrite(request, request->body.contents, request->body.length);
+    heapStringFreeContents(&request->body);
+}
+
+static void requestBodyMap(struct Request* request) {
+    /* one more byte on the end so the view is null-terminated like body.contents */
+    char terminator = '\0';
+    if (1 != pwrite(request->bodyFileDescriptor, &terminator, 1, (off_t) request->bodyFileLength)) {
+        ews_printf("Warning: Could not null-terminate the request body file. %s = %d\n", strerror(errno), errno);
+        return;
+    }
+    void* map = mmap(NULL, request->bodyFileLength + 1, PROT_READ, MAP_PRIVATE, request->bodyFileDescriptor, 0);
+    if (MAP_FAILED == map) {
+        ews_printf("Warning: Could not mmap the request body file. %s = %d\n", strerror(errno), errno);
+        return;
+    }
+    request->bodyFileMap = (const char*) map;
+}
+#endif
+
+/* Adds body bytes to request->body, or the spill file once the body is over request->bodySpillThreshold. Anything past
+ REQUEST_MAX_BODY_LENGTH is dropped */
+static void requestBodyAppend(struct Request* request, const char* data, size_t length) {
+    size_t keptLength = requestBodyLength(request);
+    size_t copyLength = MIN(length, (size_t) REQUEST_MAX_BODY_LENGTH - keptLength);
+    if (copyLength < length) {
+        request->warnings.bodyTruncated = true;
+    }
+    if (0 == copyLength) {
+        return;
+    }
+#if EWS_BODY_SPILL_SUPPORTED
+    if (!request->bodySpilled && request->bodySpillThreshold > 0 && keptLength + copyLength > request->bodySpillThreshold) {
+        requestBodySpill(request);
+    }
+    if (request->bodySpilled) {
+        requestBodyFileWrite(request, data, copyLength);
+        return;
+    }
+#endif
+    if (NULL == request->body.contents) {
+        /* small bodies (chunked ones are grown as they come) start out in the connection's arena like responses do */
+        request->body.arena = request->arena;
+    }
+    heapStringReallocIfNeeded(&request->body, request->body.length + copyLength + 1);
+    memcpy(request->body.contents + request->body.length, data, copyLength);
+    request->body.length += copyLength;
+    request->body.contents[request->body.length] = '\0';
+}
+
+const char* requestBody(const struct Request* request, size_t* lengthOrNull) {
+#if EWS_BODY_SPILL_SUPPORTED
+    if (request->bodySpilled) {
+        if (NULL == request->bodyFileMap) {
+            /* the map is a cache, so we make it even though the handler only has a const request */
+            requestBodyMap((struct Request*) request);
+        }
+        if (NULL != lengthOrNull) {
+            *lengthOrNull = NULL != request->bodyFileMap ? request->bodyFileLength : 0;
+        }
+        return request->bodyFileMap;
+    }
+#endif
+    if (NULL != lengthOrNull) {
+        *lengthOrNull = request->body.length;
+    }
+    return request->body.contents;
+}
+
+static void requestBodyFree(struct Request* request) {
+    heapStringFreeContents(&request->body);
+#if EWS_BODY_SPILL_SUPPORTED
+    if (request->bodySpilled) {
+        if (NULL != request->bodyFileMap) {
+            munmap((void*) request->bodyFileMap, request->bodyFileLength + 1);
+        }
+        close(request->bodyFileDescriptor);
+    }
+#endif
+    request->bodySpilled = false;
+    request->bodyFileDescriptor = -1;
+    request->bodyFileLength = 0;
+    request->bodyFileMap = NULL;
+}
+
+/* Parses until the request is done or reaches stopState, and returns how much of the fragment it used */
+static size_t requestParseUntil(struct Request* request, const char* requestFragment, size_t requestFragmentLength, RequestParseState stopState) {
+    size_t i = 0;
+    /* a zeroed request that hasn't been through requestReset */
+    if (NULL == request->pathDecoded) {
+        request->pathDecoded = requestNoPathDecoded;
+    }
+    while (i < requestFragmentLength) {
+        if (requestParseFinished(request) || stopState == request->state) {
+            return i;
+        }
+        const char* remaining = requestFragment + i;
+        size_t remainingLength = requestFragmentLength - i;
         char c = requestFragment[i];
+        size_t span;
         switch (request->state) {
             case RequestParseStateMethod:
-                if (c == ' ') {
+                span = requestScanFor(remaining, remainingLength, ' ', ' ');
+                requestAppendSpan(request->method, &request->methodLength, sizeof(request->method), remaining, span, &request->warnings.methodTruncated);
+                i += span;
+                if (span < remainingLength) {
                     request->state = RequestParseStatePath;
-                } else if (request->methodLength < sizeof(request->method) - 1) {
-                    request->method[request->methodLength] = c;
-                    request->methodLength++;
-                } else {
-                    request->warnings.methodTruncated = true;
+                    i++;
                 }
                 break;
             case RequestParseStatePath:
-                if (c == ' ') {
+                span = requestScanFor(remaining, remainingLength, ' ', ' ');
+                requestAppendSpan(request->path, &request->pathLength, sizeof(request->path), remaining, span, &request->warnings.pathTruncated);
+                i += span;
+                if (span < remainingLength) {
                     /* we are done parsing the path, decode it */
-                    bool success = URLDecode(request->path, request->pathDecoded, sizeof(request->pathDecoded), &request->pathDecodedLength, URLDecodeTypeWholeURL);
-                    assert(success && "Somehow unable to decode the path--this should always work with ->pathDecoded has the same capacity as ->path");
+                    char* pathDecoded = (char*) requestRealloc(request, NULL, 0, request->pathLength + 1);
+                    if (NULL == pathDecoded) {
+                        ews_printf("Could not allocate %d bytes for the decoded path. Answering 400\n", (int) (request->pathLength + 1));
+                        request->state = RequestParseStateBadRequest;
+                        break;
+                    }
+                    bool success = URLDecode(request->path, request->pathLength, pathDecoded, request->pathLength + 1, &request->pathDecodedLength, URLDecodeTypeWholeURL);
+                    assert(success && "Somehow unable to decode the path--this should always work with ->pathDecoded as long as ->path");
+                    request->pathDecoded = pathDecoded;
                     request->state = RequestParseStateVersion;
-                } else if (request->pathLength < sizeof(request->path) - 1) {
-                    request->path[request->pathLength] = c;
-                    request->pathLength++;
-                } else {
-                    request->warnings.pathTruncated = true;
+                    i++;
                 }
                 break;
             case RequestParseStateVersion:
-                if (c == '\r') {
+                span = requestScanFor(remaining, remainingLength, '\r', '\r');
+                requestAppendSpan(request->version, &request->versionLength, sizeof(request->version), remaining, span, &request->warnings.versionTruncated);
+                i += span;
+                if (span < remainingLength) {
                     request->state = RequestParseStateCR;
-                } else if (request->versionLength < sizeof(request->version) - 1) {
-                    request->version[request->versionLength] = c;
-                    request->versionLength++;
-                } else {
-                    request->warnings.versionTruncated = true;
+                    i++;
                 }
                 break;
             case RequestParseStateHeaderName:
                 assert(request->headersCount < REQUEST_MAX_HEADERS && "Parsing the request header name assumes we have space for more headers");
-                if (c == ':') {
-                    request->state = RequestParseStateHeaderValue;
-                } else if (c == '\r') {
-                    request->state = RequestParseStateCR;
-                } else  {
-                    /* if this is the first character in this header name, then initialize the string pool */
-                    if (NULL == request->headers[request->headersCount].name.contents) {
-                        poolStringStartNewString(&request->headers[request->headersCount].name, request);
-                    }
+                span = requestScanFor(remaining, remainingLength, ':', '\r');
+                if (span > 0) {
                     /* store the header name in the string pool */
-                    poolStringAppendChar(request, &request->headers[request->headersCount].name, c);
+                    poolStringAppend(request, &request->headers[request->headersCount].name, remaining, span);
+                }
+                i += span;
+                if (span < remainingLength) {
+                    request->state = (':' == remaining[span]) ? RequestParseStateHeaderValue : RequestParseStateCR;
+                    i++;
                 }
                 break;
             case RequestParseStateHeaderValue:
                 assert(request->headersCount < REQUEST_MAX_HEADERS && "Parsing the request header value assumes we have space for more headers");
-                /* skip the first space if we are saving this to header */
+                /* skip the spaces before the value */
                 if (c == ' ' && request->headers[request->headersCount].value.length == 0) {
-                    /* intentionally skipped */
-                } else if (c == '\r') {
+                    i++;
+                    break;
+                }
+                span = requestScanFor(remaining, remainingLength, '\r', '\r');
+                if (span > 0) {
+                    /* store the header value in the string pool */
+                    poolStringAppend(request, &request->headers[request->headersCount].value, remaining, span);
+                }
+                i += span;
+                if (span < remainingLength) {
                     /* only go to the next header if we were able to fill this one out - it is important to check both,
                     especially in the case of a header like ": safdasdf" */
                     if (request->headers[request->headersCount].value.length > 0 && request->headers[request->headersCount].name.length > 0) {
+                        requestIndexHeader(request, request->headersCount);
                         request->headersCount++;
                     }
                     request->state = RequestParseStateCR;
-                } else {
-                    assert(request->headersCount < REQUEST_MAX_HEADERS && "Parsing the request header value assumes we have space for more headers");
-                    /* if this is the first character in this header name, then initialize the string pool */
-                    if (NULL == request->headers[request->headersCount].value.contents) {
-                        poolStringStartNewString(&request->headers[request->headersCount].value, request);
-                    }
-                    /* store the header name in the string pool */
-                    poolStringAppendChar(request, &request->headers[request->headersCount].value, c);
+                    i++;
                 }
                 break;
             case RequestParseStateCR:
@@ -1379,15 +3344,17 @@ static void requestParse(struct Request* request, const char* requestFragment, s
                 } else {
                     request->state = stateHeaderNameIfSpaceLeft(request);
                 }
+                i++;
                 break;
             case RequestParseStateCRLF:
                 if (c == '\r') {
                     request->state = RequestParseStateCRLFCR;
+                    i++;
                 } else {
+                    /* this is the first character of the header - leave i alone so the HeaderName case gets it */
                     request->state = stateHeaderNameIfSpaceLeft(request);
-                    if (RequestParseStateHeaderName == request->state) {
-                        /* this is the first character of the header - replay the HeaderName case so this character gets appended */
-                        i--;
+                    if (RequestParseStateHeaderName != request->state) {
+                        i++;
                     }
                 }
                 break;
@@ -1395,61 +3362,269 @@ static void requestParse(struct Request* request, const char* requestFragment, s
                 if (c == '\n') {
                     /* assume the request state is done unless we have some Content-Length, which would come from something like a JSON blob */
                     request->state = RequestParseStateDone;
-                    const struct Header* contentLengthHeader = headerInRequest("Content-Length", request);
-                    if (NULL != contentLengthHeader) {
+                    const struct Header* contentLengthHeader = headerInRequestByID(HeaderIDContentLength, request);
+                    const struct Header* transferEncodingHeader = headerInRequestByID(HeaderIDTransferEncoding, request);
+                    if (NULL != transferEncodingHeader && headerValueContainsToken(transferEncodingHeader->value.contents, transferEncodingHeader->value.length, "chunked")) {
+                        /* chunked wins over Content-Length if a client sends both */
+                        request->bodyChunked = true;
+                        request->state = RequestParseStateBody;
+                    } else if (NULL != contentLengthHeader) {
                         ews_printf_debug("Incoming request has a body of length %s\n", contentLengthHeader->value.contents);
                         /* Note that this limits content length to < 2GB on Windows */
                         long contentLength = 0;
                         if (1 == sscanf(contentLengthHeader->value.contents, "%ld", &contentLength)) {
-                            if (contentLength > REQUEST_MAX_BODY_LENGTH) {
-                                contentLength = REQUEST_MAX_BODY_LENGTH;
-                            }
                             if (contentLength < 0) {
                                 ews_printf_debug("Warning: Incoming request has negative content length: %ld\n", contentLength);
                                 contentLength = 0;
                             }
+                            /* request->body is allocated when the first byte of it is parsed, in case it's going to a RequestBodyHandler */
                             if (contentLength > 0) {
-                                request->body.contents = (char*)calloc(1, contentLength + 1);
+                                request->bodyExpectedLength = (size_t) contentLength;
+                                request->state = RequestParseStateBody;
                             }
-                            request->body.capacity = contentLength;
-                            request->body.length = 0;
-                            request->state = RequestParseStateBody;
                         }
-                        
-                    } else {
                     }
                 } else {
                     request->state = stateHeaderNameIfSpaceLeft(request);
                 }
+                i++;
                 break;
             case RequestParseStateEatHeaders:
                 /* we have no more room for headers right now */
-                if (c == '\r') {
+                span = requestScanFor(remaining, remainingLength, '\r', '\r');
+                i += span;
+                if (span < remainingLength) {
                     request->state = RequestParseStateCR;
+                    i++;
                 }
                 break;
             case RequestParseStateBody:
-                /* Copy the request body into request->body - the .length is from Content-Length so don't trust that (found with afl-fuzz!) */
-                if (request->body.length < request->body.capacity) {
-                    request->body.contents[request->body.length] = c;
-                    request->body.length++;
+                if (request->bodyChunked) {
+                    /* leave i alone - that's the first character of the first chunk size */
+                    request->state = RequestParseStateChunkSizeStart;
+                    request->bodyChunkRemaining = 0;
+                    break;
                 }
-                if (request->body.length == request->body.capacity) {
-                    request->state = RequestParseStateDone;
+                {
+                    size_t bodyLimit = MIN(request->bodyExpectedLength, (size_t) REQUEST_MAX_BODY_LENGTH);
+                    if (0 == request->bodyReceivedLength) {
+                        if (request->bodyExpectedLength > REQUEST_MAX_BODY_LENGTH) {
+                            /* the rest of the body is still coming so this connection can't be reused */
+                            request->warnings.bodyTruncated = true;
+                        }
+#if EWS_BODY_SPILL_SUPPORTED
+                        if (request->bodySpillThreshold > 0 && bodyLimit > request->bodySpillThreshold) {
+                            requestBodySpill(request);
+                        }
+#endif
+                        if (!request->bodySpilled) {
+                            /* we know how big it is so get all the memory now instead of growing into it. There's no need to
+                             zero it since requestBodyAppend terminates as it goes */
+                            request->body.capacity = bodyLimit + 1;
+                            if (NULL != request->arena && request->body.capacity <= CONNECTION_ARENA_MAX_STRING) {
+                                request->body.arena = request->arena;
+                                request->body.contents = (char*) arenaAlloc(request->arena, request->body.capacity);
+                            } else {
+                                request->body.arena = NULL;
+                                request->body.contents = (char*) malloc(request->body.capacity);
+                            }
+                            request->body.contents[0] = '\0';
+                            request->body.length = 0;
+                        }
+                    }
+                    /* Copy the request body into request->body - the .length is from Content-Length so don't trust that (found with afl-fuzz!) */
+                    span = MIN(remainingLength, bodyLimit - request->bodyReceivedLength);
+                    requestBodyAppend(request, remaining, span);
+                    request->bodyReceivedLength += span;
+                    i += span;
+                    if (request->bodyReceivedLength == bodyLimit) {
+                        request->state = RequestParseStateDone;
+                    }
                 }
                 break;
-            case RequestParseStateDone:
-                if (NULL != request->body.contents) {
+            case RequestParseStateChunkSizeStart:
+            case RequestParseStateChunkSize:
+                if (hexDigitValue(c) >= 0) {
+                    if (request->bodyChunkRemaining > (SIZE_MAX >> 4)) {
+                        ews_printf_debug("Warning: Incoming request has a chunk size that doesn't fit in a size_t\n");
+                        request->state = RequestParseStateBadRequest;
+                        break;
+                    }
+                    request->bodyChunkRemaining = (request->bodyChunkRemaining << 4) | (size_t) hexDigitValue(c);
+                    request->state = RequestParseStateChunkSize;
+                } else if (RequestParseStateChunkSizeStart == request->state) {
+                    request->state = RequestParseStateBadRequest;
+                    break;
+                } else if (c == '\r') {
+                    request->state = RequestParseStateChunkSizeLF;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    request->state = RequestParseStateChunkExtension;
+                } else {
+                    request->state = RequestParseStateBadRequest;
+                    break;
+                }
+                i++;
+                break;
+            case RequestParseStateChunkExtension:
+                /* we don't use chunk extensions */
+                span = requestScanFor(remaining, remainingLength, '\r', '\r');
+                i += span;
+                if (span < remainingLength) {
+                    request->state = RequestParseStateChunkSizeLF;
+                    i++;
+                }
+                break;
+            case RequestParseStateChunkSizeLF:
+                if (c != '\n') {
+                    request->state = RequestParseStateBadRequest;
+                    break;
+                }
+                /* the last chunk has size 0 and may be followed by trailer headers */
+                request->state = request->bodyChunkRemaining > 0 ? RequestParseStateChunkData : RequestParseStateChunkTrailer;
+                i++;
+                break;
+            case RequestParseStateChunkData:
+                if (request->bodyReceivedLength >= REQUEST_MAX_BODY_LENGTH) {
+                    /* Stop at the limit like a Content-Length body does. The rest of the body is still coming, so the
+                     connection is closed after the response instead of reading chunks for as long as the client sends them */
                     request->warnings.bodyTruncated = true;
+                    request->state = RequestParseStateDone;
+                    break;
                 }
+                span = MIN(MIN(remainingLength, request->bodyChunkRemaining), (size_t) REQUEST_MAX_BODY_LENGTH - request->bodyReceivedLength);
+                requestBodyAppend(request, remaining, span);
+                request->bodyReceivedLength += span;
+                request->bodyChunkRemaining -= span;
+                i += span;
+                if (0 == request->bodyChunkRemaining) {
+                    request->state = RequestParseStateChunkDataCR;
+                }
+                break;
+            case RequestParseStateChunkDataCR:
+                request->state = c == '\r' ? RequestParseStateChunkDataLF : RequestParseStateBadRequest;
+                i++;
+                break;
+            case RequestParseStateChunkDataLF:
+                request->state = c == '\n' ? RequestParseStateChunkSizeStart : RequestParseStateBadRequest;
+                i++;
+                break;
+            case RequestParseStateChunkTrailer:
+                /* the start of a trailer line. We skip trailers, and an empty line ends the body */
+                request->state = c == '\r' ? RequestParseStateChunkTrailerLF : RequestParseStateChunkTrailerLine;
+                i++;
+                break;
+            case RequestParseStateChunkTrailerLine:
+                span = requestScanFor(remaining, remainingLength, '\n', '\n');
+                i += span;
+                if (span < remainingLength) {
+                    request->state = RequestParseStateChunkTrailer;
+                    i++;
+                }
+                break;
+            case RequestParseStateChunkTrailerLF:
+                request->state = c == '\n' ? RequestParseStateDone : RequestParseStateBadRequest;
+                i++;
+                break;
+            case RequestParseStateDone:
+            case RequestParseStateBadRequest:
+                /* handled before the switch */
                 break;
         }
     }
+    return requestFragmentLength;
+}
+
+/* Gets a request that has already been parsed ready to parse the next one on a keep-alive connection. The parser counts on
+ method, version and path being zeroed so we clear just the parts of them that were used */
+static void requestReset(struct Request* request) {
+    requestBodyFree(request);
+    requestParamsFree(request);
+    /* the response has been sent and freed by now, so nothing is using the arena */
+    if (NULL != request->arena) {
+        arenaReset(request->arena);
+    } else {
+        if (requestNoPathDecoded != request->pathDecoded) {
+            free(request->pathDecoded);
+        }
+        free(request->headers);
+#if !EWS_HEADER_SLICES
+        free(request->headersStringPool);
+#endif
+    }
+    memset(request->method, 0, MIN(request->methodLength + 1, sizeof(request->method)));
+    request->methodLength = 0;
+    memset(request->version, 0, MIN(request->versionLength + 1, sizeof(request->version)));
+    request->versionLength = 0;
+    memset(request->path, 0, MIN(request->pathLength + 1, sizeof(request->path)));
+    request->pathLength = 0;
+    request->pathDecoded = requestNoPathDecoded;
+    request->pathDecodedLength = 0;
+    request->headers = NULL;
+    request->headersCapacity = 0;
+    request->headersCount = 0;
+    request->bodyExpectedLength = 0;
+    request->bodyReceivedLength = 0;
+    request->bodySpillThreshold = 0;
+    request->bodyChunked = false;
+    request->bodyChunkRemaining = 0;
+    memset(request->headerIndexByID, 0, sizeof(request->headerIndexByID));
+#if EWS_HEADER_SLICES
+    request->headerSlicesEnd = NULL;
+#else
+    request->headersStringPool = NULL;
+    request->headersStringPoolCapacity = 0;
+#endif
+    request->headersStringPoolOffset = 0;
+    memset(&request->warnings, 0, sizeof(request->warnings));
+    request->state = RequestParseStateMethod;
+}
+
+/* Is token one of the comma separated values in headerValue? Case insensitive, so "Keep-Alive, Upgrade" contains "keep-alive" */
+static bool headerValueContainsToken(const char* headerValue, size_t headerValueLength, const char* token) {
+    size_t tokenLength = strlen(token);
+    const char* current = headerValue;
+    const char* valueEnd = headerValue + headerValueLength;
+    while (current < valueEnd) {
+        while (current < valueEnd && (*current == ' ' || *current == '\t' || *current == ',')) {
+            current++;
+        }
+        const char* end = current;
+        while (end < valueEnd && *end != ',') {
+            end++;
+        }
+        size_t length = end - current;
+        while (length > 0 && (current[length - 1] == ' ' || current[length - 1] == '\t')) {
+            length--;
+        }
+        if (length == tokenLength && 0 == strncasecmp(current, token, tokenLength)) {
+            return true;
+        }
+        current = end;
+    }
+    return false;
+}
+
+/* HTTP/1.1 connections are persistent unless the client says "Connection: close". HTTP/1.0 clients have to ask for it */
+static bool requestWantsKeepAlive(const struct Request* request) {
+    const struct Header* connectionHeader = headerInRequestByID(HeaderIDConnection, request);
+    if (NULL != connectionHeader && NULL != connectionHeader->value.contents) {
+        if (headerValueContainsToken(connectionHeader->value.contents, connectionHeader->value.length, "close")) {
+            return false;
+        }
+        if (headerValueContainsToken(connectionHeader->value.contents, connectionHeader->value.length, "keep-alive")) {
+            return true;
+        }
+    }
+    return 0 == strcmp(request->version, "HTTP/1.1");
 }
 
 static void requestPrintWarnings(const struct Request* request, const char* remoteHost, const char* remotePort) {
     if (request->warnings.headersStringPoolExhausted) {
+#if EWS_HEADER_SLICES
+        ews_printf("Warning: Request from %s:%s had more headers than fit in the receive buffer so some information will be lost. You can try increasing REQUEST_HEADER_SLICES_MAX_MEMORY which is currently %ld bytes\n", remoteHost, remotePort, (long) REQUEST_HEADER_SLICES_MAX_MEMORY);
+#else
         ews_printf("Warning: Request from %s:%s exhausted the header string pool so some information will be lost. You can try increasing REQUEST_HEADERS_MAX_MEMORY which is currently %ld bytes\n", remoteHost, remotePort, (long) REQUEST_HEADERS_MAX_MEMORY);
+#endif
     }
     if (request->warnings.tooManyHeaders) {
         ews_printf("Warning: Request from %s:%s had too many headers and we dropped some. You can try increasing REQUEST_MAX_HEADERS which is currently %ld\n", remoteHost, remotePort, (long) REQUEST_MAX_HEADERS);
@@ -1464,106 +3639,516 @@ static void requestPrintWarnings(const struct Request* request, const char* remo
         ews_printf("Warning: Request from %s:%s version was truncated to %s\n", remoteHost, remotePort, request->version);
     }
     if (request->warnings.bodyTruncated) {
-        ews_printf("Warning: Request from %s:%s body was truncated to %" PRIu64 " bytes\n", remoteHost, remotePort, (uint64_t)request->body.length);
+        ews_printf("Warning: Request from %s:%s body was truncated to %" PRIu64 " bytes\n", remoteHost, remotePort, (uint64_t) requestBodyLength(request));
     }
 }
 
-static struct Connection* connectionAlloc(struct Server* server) {
-    struct Connection* connection = (struct Connection*) calloc(1, sizeof(*connection)); // calloc 0's everything which requestParse depends on
-    connection->server = server;
-    return connection;
-}
+/* What each ServerProfile uses for the settings left at 0 */
+struct ServerProfileDefaults {
+    int threadPoolSize;
+    int threadPoolMaxQueuedConnections;
+    int keepAliveTimeoutSeconds;
+    int keepAliveMaxRequests;
+    int headerTimeoutSeconds;
+    int bodyTimeoutSeconds;
+    int sendTimeoutSeconds;
+    int maxActiveConnections;
+    int maxInFlightRequests;
+    int stopDrainSeconds;
+    int connectionPoolSize;
+    size_t connectionBufferSize;
+};
 
-static void connectionFree(struct Connection* connection) {
-    heapStringFreeContents(&connection->request.body);
-    free(connection);
+static const struct ServerProfileDefaults* serverProfileDefaults(const struct Server* server) {
+    static const struct ServerProfileDefaults profiles[] = {
+        /* ServerProfileDefault */
+        { THREAD_POOL_DEFAULT_SIZE, THREAD_POOL_DEFAULT_MAX_QUEUED_CONNECTIONS, KEEP_ALIVE_DEFAULT_TIMEOUT_SECONDS,
+            KEEP_ALIVE_DEFAULT_MAX_REQUESTS, HEADER_TIMEOUT_DEFAULT_SECONDS, BODY_TIMEOUT_DEFAULT_SECONDS,
+            SEND_TIMEOUT_DEFAULT_SECONDS, 0, 0, STOP_DRAIN_DEFAULT_SECONDS, CONNECTION_POOL_DEFAULT_SIZE, SEND_RECV_BUFFER_SIZE },
+        /* ServerProfileSmallEmbedded - with two threads a couple of slow clients are all it takes, so cut them off early,
+         and don't let a burst of connections run the device out of memory */
+        { 2, 16, 2, 20, 5, 10, 10, 32, 0, 5, 2, 4 * 1024 },
+        /* ServerProfileProxyFacing - the load balancer in front deals with slow clients and overload, and takes a while
+         to stop sending us requests when we're being redeployed */
+        { 64, 4096, 60, 10000, 30, 60, 60, 0, 0, 30, 256, 64 * 1024 }
+    };
+    size_t profile = NULL != server ? (size_t) server->profile : 0;
+    return &profiles[profile < sizeof(profiles) / sizeof(profiles[0]) ? profile : 0];
 }
 
-static void SIGPIPEHandler(int signal) {
-    (void) signal;
-    /* SIGPIPE happens any time we try to send() and the connection is closed. So we just ignore it and check the return code of send...*/
-    ews_printf_debug("Ignoring SIGPIPE\n");
+/* server->setting, or what server->profile has for it when it's 0 */
+#define serverSetting(server, setting) ((server)->setting > 0 ? (server)->setting : serverProfileDefaults(server)->setting)
+/* Same thing for the timeouts and limits that can be turned off with -1, which comes out as 0 */
+#define serverSettingUnlessOff(server, setting) ((server)->setting < 0 ? 0 : serverSetting(server, setting))
+
+/* How long a connection may wait on the client for timeout, in milliseconds. 0 = forever */
+static int64_t connectionTimeoutMilliseconds(const struct Server* server, ConnectionTimeout timeout) {
+    int seconds = 0;
+    switch (timeout) {
+        case ConnectionTimeoutIdle:
+            seconds = serverSetting(server, keepAliveTimeoutSeconds);
+            break;
+        case ConnectionTimeoutHeader:
+            seconds = serverSettingUnlessOff(server, headerTimeoutSeconds);
+            break;
+        case ConnectionTimeoutBody:
+            seconds = serverSettingUnlessOff(server, bodyTimeoutSeconds);
+            break;
+        case ConnectionTimeoutSend:
+            seconds = serverSettingUnlessOff(server, sendTimeoutSeconds);
+            break;
+        default:
+            break;
+    }
+    return (int64_t) seconds * 1000;
 }
 
-void serverInit(struct Server* server) {
-    if (server->initialized) {
-        ews_printf("Warning: The server %p was already initialized. Not re-initializing...\n", server);
-        return;
+/* Which timeout applies to a connection that's waiting for (more of) a request */
+static ConnectionTimeout connectionReceiveTimeout(const struct Connection* connection) {
+    const struct Request* request = &connection->request;
+    if (connection->status.requestsHandled > 0 && 0 == request->methodLength) {
+        return ConnectionTimeoutIdle;
     }
-    pthread_mutex_init(&server->globalMutex, NULL);
-    pthread_mutex_init(&server->stoppedMutex, NULL);
-    pthread_cond_init(&server->stoppedCond, NULL);
-    pthread_cond_init(&server->connectionFinishedCond, NULL);
-    pthread_mutex_init(&server->connectionFinishedLock, NULL);
-    server->activeConnectionCount = 0;
-    server->shouldRun = true;
-    server->initialized = true;
-    ignoreSIGPIPE();
-    /* kind of hacky and not thread-safe but I'm ok with that for just these counters */
-    if (!counters.lockInitialized) {
-        pthread_mutex_init(&counters.lock, NULL);
-        counters.lockInitialized = true;
+    if (request->state < RequestParseStateBody || RequestParseStateEatHeaders == request->state) {
+        return ConnectionTimeoutHeader;
     }
+    return ConnectionTimeoutBody;
 }
 
-void serverStop(struct Server* server) {
-    if (!server->initialized) {
-        ews_printf("Warning: Server %p was never initialized and you tried to stop it. Ignoring...\n", server);
-        return;
-    }
-    serverMutexLock(server);
-    server->shouldRun = false;
-    if (server->listenerfd >= 0) {
-        close(server->listenerfd);
-    }
-    serverMutexUnlock(server);
-    pthread_mutex_lock(&server->stoppedMutex);
-    while (!server->stopped) {
-        pthread_cond_wait(&server->stoppedCond, &server->stoppedMutex);
+/* Counts the timeout and says why we're closing the connection. ConnectionTimeoutNone is an idle keep-alive connection
+ closed because the server is stopping, which doesn't count */
+static void connectionTimedOut(const struct Connection* connection, ConnectionTimeout timeout) {
+    const struct Server* server = connection->server;
+    switch (timeout) {
+        case ConnectionTimeoutNone:
+            ews_printf_debug("Closing idle keep-alive connection from %s:%s because the server is stopping\n", connection->remoteHost, connection->remotePort);
+            break;
+        case ConnectionTimeoutIdle:
+            ews_printf_debug("Closing idle keep-alive connection from %s:%s after %" PRId64 " requests\n", connection->remoteHost, connection->remotePort, connection->status.requestsHandled);
+            counterAdd(counters.idleTimeouts, 1);
+            break;
+        case ConnectionTimeoutHeader:
+            ews_printf("Closing the connection from %s:%s because its request headers took more than %d seconds\n", connection->remoteHost, connection->remotePort, serverSettingUnlessOff(server, headerTimeoutSeconds));
+            counterAdd(counters.headerTimeouts, 1);
+            break;
+        case ConnectionTimeoutBody:
+            ews_printf("Closing the connection from %s:%s because its request body stopped for more than %d seconds\n", connection->remoteHost, connection->remotePort, serverSettingUnlessOff(server, bodyTimeoutSeconds));
+            counterAdd(counters.bodyTimeouts, 1);
+            break;
+        case ConnectionTimeoutSend:
+            ews_printf("Closing the connection from %s:%s because it hasn't taken any of the response for %d seconds\n", connection->remoteHost, connection->remotePort, serverSettingUnlessOff(server, sendTimeoutSeconds));
+            counterAdd(counters.sendTimeouts, 1);
+            break;
+        default:
+            break;
     }
-    pthread_mutex_unlock(&server->stoppedMutex);
 }
 
-void serverDeInit(struct Server* server) {
-    pthread_mutex_destroy(&server->globalMutex);
-    pthread_mutex_destroy(&server->stoppedMutex);
-    pthread_cond_destroy(&server->stoppedCond);
+/* The thread models give every socket an SO_SNDTIMEO of server->sendTimeoutSeconds, so a blocking send that fails with
+ EAGAIN means the client stopped reading */
+static void connectionSendFailed(const struct Connection* connection) {
+    if (socketErrorIsTimeout()) {
+        connectionTimedOut(connection, ConnectionTimeoutSend);
+    }
 }
 
-int acceptConnectionsUntilStoppedFromEverywhereIPv4(struct Server* serverOrNULL, uint16_t portInHostOrder) {
-    /* In order to keep the code really short I've just assumed
-     we want to bind to 0.0.0.0, which is all available interfaces.
-     What you actually want to do is call getaddrinfo on command line arguments
-     to let users specify the interface and port */
-    struct sockaddr_in anyInterfaceIPv4 = {0};
-    anyInterfaceIPv4.sin_addr.s_addr = htonl(INADDR_ANY); // also popular inet_addr("127.0.0.1") which is INADDR_LOOPBACK
-    anyInterfaceIPv4.sin_family = AF_INET;
-    anyInterfaceIPv4.sin_port = htons(portInHostOrder);
-    return acceptConnectionsUntilStopped(serverOrNULL, (struct sockaddr*) &anyInterfaceIPv4, sizeof(anyInterfaceIPv4));
+static size_t connectionBufferSizeForServer(const struct Server* server) {
+    if (NULL == server) {
+        return SEND_RECV_BUFFER_SIZE;
+    }
+    return serverSetting(server, connectionBufferSize);
 }
 
-int acceptConnectionsUntilStopped(struct Server* serverOrNULL, const struct sockaddr* address, socklen_t addressLength) {
-    bool usingOurOwnServer = false;
-    struct Server* server;
-    if (NULL == serverOrNULL) {
-        usingOurOwnServer = true;
-        server = (struct Server*) calloc(1, sizeof(*server));
-        serverInit(server);
-    } else {
-        server = serverOrNULL;
+/* The struct is cache line aligned, which malloc doesn't promise. Only the struct is zeroed (which requestParse depends
+ on), not the buffer behind it, so pages of the buffer a short request never reaches are never touched */
+static struct Connection* connectionMemoryAlloc(size_t bufferSize) {
+    size_t size = sizeof(struct Connection) + bufferSize;
+#ifdef WIN32
+    void* memory = _aligned_malloc(size, EWS_CACHE_LINE_SIZE);
+#else
+    void* memory = NULL;
+    if (0 != posix_memalign(&memory, EWS_CACHE_LINE_SIZE, size)) {
+        memory = NULL;
     }
-    int result = acceptConnectionsUntilStoppedInternal(server, address, addressLength);
-    if (usingOurOwnServer) {
-        serverDeInit(server);
-        free(server);
+#endif
+    if (NULL == memory) {
+        return NULL;
     }
-    return result;
+    memset(memory, 0, sizeof(struct Connection));
+    return (struct Connection*) memory;
 }
 
-static int acceptConnectionsUntilStoppedInternal(struct Server* server, const struct sockaddr* address, socklen_t addressLength) {
-    assert(NULL != server && "Why was there no valid server when we got to acceptConnectionsUntilStoppedInternal? We should have something");
-    assert(server->initialized && "The server was not initialized. Can you please call serverInit(&server) or pass NULL?");
-    callWSAStartupIfNecessary();
+static void connectionMemoryFree(struct Connection* connection) {
+#ifdef WIN32
+    _aligned_free(connection);
+#else
+    free(connection);
+#endif
+}
+
+/* Each accept loop keeps the connections it's done with in one of these and hands them out again instead of allocating
+ and zeroing another struct Connection. In the threaded models connections finish on a different thread from the one that
+ accepted them, so each one remembers its pool and gives itself back under the lock. The pool goes away once the accept
+ loop has stopped and the last of its connections has come back */
+struct ConnectionPool {
+    pthread_mutex_t lock;
+    struct Connection* freeList;
+    int freeCount;
+    int maxFree;
+    /* every connection in the pool has a buffer this big */
+    size_t bufferSize;
+    /* connections handed out and not back yet */
+    int outstanding;
+    bool released;
+    bool hugePages;
+    /* huge page slabs, newest first, and how much of the newest one has been handed out */
+    struct ConnectionPoolSlab* slabs;
+    size_t slabUsed;
+};
+
+struct ConnectionPoolSlab {
+    struct ConnectionPoolSlab* next;
+};
+
+#define CONNECTION_POOL_SLAB_HEADER_SIZE EWS_CACHE_LINE_SIZE
+
+/* connectionAlloc takes from the pool of the accept loop running on this thread */
+static EWS_THREAD_LOCAL struct ConnectionPool* currentConnectionPool;
+
+static struct ConnectionPool* connectionPoolCreate(const struct Server* server) {
+    if (server->connectionPoolSize < 0) {
+        return NULL;
+    }
+    struct ConnectionPool* pool = (struct ConnectionPool*) calloc(1, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->maxFree = serverSetting(server, connectionPoolSize);
+    pool->bufferSize = connectionBufferSizeForServer(server);
+    pool->hugePages = server->connectionPoolHugePages;
+#if !EWS_HUGE_PAGES_SUPPORTED
+    if (pool->hugePages) {
+        ews_printf("Warning: connectionPoolHugePages is only supported on Linux. Using malloc...\n");
+        pool->hugePages = false;
+    }
+#endif
+    return pool;
+}
+
+#if EWS_HUGE_PAGES_SUPPORTED
+/* size bytes backed by a huge page if we can get one. MAP_HUGETLB only works when the admin has reserved huge pages, so
+ otherwise map twice as much, trim it down to an aligned piece and ask for a transparent huge page */
+static void* hugePagesMap(size_t size) {
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (MAP_FAILED != memory) {
+        return memory;
+    }
+    char* oversized = (char*) mmap(NULL, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == (void*) oversized) {
+        return NULL;
+    }
+    char* aligned = (char*) (((uintptr_t) oversized + size - 1) & ~((uintptr_t) size - 1));
+    if (aligned > oversized) {
+        munmap(oversized, aligned - oversized);
+    }
+    munmap(aligned + size, oversized + size * 2 - (aligned + size));
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+#endif
+
+/* Call with the pool lock held. A fresh connection out of the newest huge page slab, or NULL if that didn't work out.
+ mmap'd memory is zeroed just like calloc */
+static struct Connection* connectionPoolCarve(struct ConnectionPool* pool) {
+#if EWS_HUGE_PAGES_SUPPORTED
+    const size_t connectionSize = (sizeof(struct Connection) + pool->bufferSize + EWS_CACHE_LINE_SIZE - 1) & ~(size_t) (EWS_CACHE_LINE_SIZE - 1);
+    if (CONNECTION_POOL_SLAB_HEADER_SIZE + connectionSize > CONNECTION_POOL_SLAB_SIZE) {
+        return NULL;
+    }
+    if (NULL == pool->slabs || pool->slabUsed + connectionSize > CONNECTION_POOL_SLAB_SIZE) {
+        struct ConnectionPoolSlab* slab = (struct ConnectionPoolSlab*) hugePagesMap(CONNECTION_POOL_SLAB_SIZE);
+        if (NULL == slab) {
+            return NULL;
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->slabUsed = CONNECTION_POOL_SLAB_HEADER_SIZE;
+    }
+    struct Connection* connection = (struct Connection*) ((char*) pool->slabs + pool->slabUsed);
+    pool->slabUsed += connectionSize;
+    connection->fromPoolSlab = true;
+    return connection;
+#else
+    (void) pool;
+    return NULL;
+#endif
+}
+
+static void connectionPoolDestroy(struct ConnectionPool* pool) {
+    while (NULL != pool->freeList) {
+        struct Connection* connection = pool->freeList;
+        pool->freeList = connection->poolNext;
+        arenaFree(&connection->arena);
+        if (!connection->fromPoolSlab) {
+            connectionMemoryFree(connection);
+        }
+    }
+#if EWS_HUGE_PAGES_SUPPORTED
+    while (NULL != pool->slabs) {
+        struct ConnectionPoolSlab* slab = pool->slabs;
+        pool->slabs = slab->next;
+        munmap(slab, CONNECTION_POOL_SLAB_SIZE);
+    }
+#endif
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/* The accept loop that owns the pool is done. Connections still out there destroy it when the last one comes back */
+static void connectionPoolRelease(struct ConnectionPool* pool) {
+    if (NULL == pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->released = true;
+    bool destroy = 0 == pool->outstanding;
+    pthread_mutex_unlock(&pool->lock);
+    if (destroy) {
+        connectionPoolDestroy(pool);
+    }
+}
+
+/* Gets a connection that's done ready to be handed out again. Like requestReset this only clears what can have been
+ used, which saves zeroing the buffers */
+static void connectionRecycle(struct Connection* connection) {
+    requestReset(&connection->request);
+    memset(connection, 0, offsetof(struct Connection, request));
+    connection->remoteAddrLength = 0;
+    connection->remoteHost[0] = '\0';
+    connection->remotePort[0] = '\0';
+}
+
+/* Takes a recycled connection back. Returns false if the pool is full or done, in which case it's yours to free */
+static bool connectionPoolGive(struct ConnectionPool* pool, struct Connection* connection) {
+    pthread_mutex_lock(&pool->lock);
+    pool->outstanding--;
+    bool kept = connection->fromPoolSlab || (!pool->released && pool->freeCount < pool->maxFree);
+    if (kept) {
+        connection->poolNext = pool->freeList;
+        pool->freeList = connection;
+        pool->freeCount++;
+    }
+    bool destroy = pool->released && 0 == pool->outstanding;
+    pthread_mutex_unlock(&pool->lock);
+    if (destroy) {
+        connectionPoolDestroy(pool);
+    }
+    return kept;
+}
+
+static struct Connection* connectionAlloc(struct Server* server) {
+    struct ConnectionPool* pool = currentConnectionPool;
+    struct Connection* connection = NULL;
+    if (NULL != pool) {
+        pthread_mutex_lock(&pool->lock);
+        connection = pool->freeList;
+        bool hit = NULL != connection;
+        if (hit) {
+            pool->freeList = connection->poolNext;
+            pool->freeCount--;
+            connection->poolNext = NULL;
+        } else if (pool->hugePages) {
+            connection = connectionPoolCarve(pool);
+        }
+        pool->outstanding++;
+        pthread_mutex_unlock(&pool->lock);
+        if (OptionIncludeStatusPageAndCounters) {
+            if (hit) {
+                counterAdd(counters.connectionPoolHits, 1);
+            } else {
+                counterAdd(counters.connectionPoolMisses, 1);
+            }
+        }
+    }
+    size_t bufferSize = NULL != pool ? pool->bufferSize : connectionBufferSizeForServer(server);
+    if (NULL == connection) {
+        connection = connectionMemoryAlloc(bufferSize);
+    }
+    if (NULL == connection) {
+        ews_printf("Could not allocate %d bytes for a connection. %s = %d\n", (int) (sizeof(*connection) + bufferSize), strerror(errno), errno);
+        if (NULL != pool) {
+            pthread_mutex_lock(&pool->lock);
+            pool->outstanding--;
+            pthread_mutex_unlock(&pool->lock);
+        }
+        return NULL;
+    }
+    connection->pool = pool;
+    connection->server = server;
+    connection->sendRecvBuffer = (char*) connection + sizeof(*connection);
+    connection->sendRecvBufferSize = bufferSize;
+    connection->receiveBuffer = connection->sendRecvBuffer;
+    connection->receiveCapacity = connection->sendRecvBufferSize;
+    connection->request.arena = &connection->arena;
+    connection->request.pathDecoded = requestNoPathDecoded;
+    connection->request.bodyFileDescriptor = -1;
+    return connection;
+}
+
+static void connectionFree(struct Connection* connection) {
+    if (NULL != connection->bodyHandler) {
+        /* the connection went away in the middle of the body */
+        struct Response* response = connectionBodyHandlerEnd(connection);
+        if (NULL != response) {
+            responseFree(response);
+        }
+    }
+    if (NULL != connection->bodyRejectedResponse) {
+        responseFree(connection->bodyRejectedResponse);
+    }
+    requestBodyFree(&connection->request);
+    requestParamsFree(&connection->request);
+    if (NULL != connection->output.fp) {
+        fclose(connection->output.fp);
+    }
+    if (NULL != connection->output.response) {
+        responseFree(connection->output.response);
+    }
+    if (connection->receiveBuffer != connection->sendRecvBuffer) {
+        free(connection->receiveBuffer);
+    }
+    if (NULL != connection->pool) {
+        connectionRecycle(connection);
+        if (connectionPoolGive(connection->pool, connection)) {
+            return;
+        }
+    }
+    arenaFree(&connection->arena);
+    connectionMemoryFree(connection);
+}
+
+static void SIGPIPEHandler(int signal) {
+    (void) signal;
+    /* SIGPIPE happens any time we try to send() and the connection is closed. So we just ignore it and check the return code of send...*/
+    ews_printf_debug("Ignoring SIGPIPE\n");
+}
+
+void serverInit(struct Server* server) {
+    if (server->initialized) {
+        ews_printf("Warning: The server %p was already initialized. Not re-initializing...\n", server);
+        return;
+    }
+    pthread_mutex_init(&server->globalMutex, NULL);
+    pthread_mutex_init(&server->stoppedMutex, NULL);
+    pthread_cond_init(&server->stoppedCond, NULL);
+    pthread_cond_init(&server->connectionFinishedCond, NULL);
+    pthread_mutex_init(&server->connectionFinishedLock, NULL);
+    server->activeConnectionCount = 0;
+    server->shouldRun = true;
+    server->initialized = true;
+    ignoreSIGPIPE();
+}
+
+void serverStop(struct Server* server) {
+    if (!server->initialized) {
+        ews_printf("Warning: Server %p was never initialized and you tried to stop it. Ignoring...\n", server);
+        return;
+    }
+    serverMutexLock(server);
+    server->shouldRun = false;
+#if EWS_EVENT_LOOP_SUPPORTED
+    /* Just shutdown - the accept loops close the listeners once they're done. If we closed a listener here it would drop
+     out of its event loop's epoll set, and the loop wouldn't notice we're stopping (and close its idle connections)
+     until epoll_wait timed out */
+    serverShutdownListeners(server);
+#else
+    serverCloseListeners(server);
+#endif
+    serverMutexUnlock(server);
+    /* Idle keep-alive connections close as soon as their threads or event loops see server->shouldRun, and requests in
+     progress are answered with Connection: close. Whatever is left at the deadline is cut off */
+    pthread_mutex_lock(&server->connectionFinishedLock);
+    int connectionsAtStop = server->activeConnectionCount;
+    pthread_mutex_unlock(&server->connectionFinishedLock);
+    int drainSeconds = serverSettingUnlessOff(server, stopDrainSeconds);
+    int64_t deadline = monotonicMilliseconds() + (int64_t) drainSeconds * 1000;
+    bool cutOff = false;
+    int cutOffConnections = 0;
+    pthread_mutex_lock(&server->stoppedMutex);
+    while (!server->stopped) {
+        int64_t remaining = deadline - monotonicMilliseconds();
+        if (0 == drainSeconds || cutOff) {
+            pthread_cond_wait(&server->stoppedCond, &server->stoppedMutex);
+        } else if (remaining > 0) {
+            conditionWaitMilliseconds(&server->stoppedCond, &server->stoppedMutex, (int) remaining);
+        } else {
+            cutOffConnections = serverCutOffConnections(server);
+            cutOff = true;
+            if (cutOffConnections > 0) {
+                ews_printf("The %d second drain deadline passed with %d connections still open. Shutting down their sockets...\n", drainSeconds, cutOffConnections);
+            }
+        }
+    }
+    pthread_mutex_unlock(&server->stoppedMutex);
+    server->stopCutOffConnections = cutOffConnections;
+    server->stopDrainedConnections = MAX(connectionsAtStop - cutOffConnections, 0);
+    ews_printf("Stopped the server. %d connections finished on their own, %d were cut off\n", server->stopDrainedConnections, server->stopCutOffConnections);
+}
+
+/* The drain deadline passed. Shutting down the sockets of the connections that are still open wakes up whoever is
+ blocked on them (a thread in recv/send, epoll, io_uring) so they finish. Connections still waiting in a thread pool
+ queue are shut down in connectionStarted. Returns how many connections were left */
+static int serverCutOffConnections(struct Server* server) {
+    pthread_mutex_lock(&server->connectionFinishedLock);
+    server->connectionsCutOff = true;
+    for (struct Connection* connection = server->activeConnections; NULL != connection; connection = connection->activeNext) {
+        shutdown(connection->socketfd, SHUT_RDWR);
+    }
+    int activeConnectionCount = server->activeConnectionCount;
+    pthread_mutex_unlock(&server->connectionFinishedLock);
+    return activeConnectionCount;
+}
+
+void serverDeInit(struct Server* server) {
+    pthread_mutex_destroy(&server->globalMutex);
+    pthread_mutex_destroy(&server->stoppedMutex);
+    pthread_cond_destroy(&server->stoppedCond);
+}
+
+int acceptConnectionsUntilStoppedFromEverywhereIPv4(struct Server* serverOrNULL, uint16_t portInHostOrder) {
+    /* In order to keep the code really short I've just assumed
+     we want to bind to 0.0.0.0, which is all available interfaces.
+     What you actually want to do is call getaddrinfo on command line arguments
+     to let users specify the interface and port */
+    struct sockaddr_in anyInterfaceIPv4 = {0};
+    anyInterfaceIPv4.sin_addr.s_addr = htonl(INADDR_ANY); // also popular inet_addr("127.0.0.1") which is INADDR_LOOPBACK
+    anyInterfaceIPv4.sin_family = AF_INET;
+    anyInterfaceIPv4.sin_port = htons(portInHostOrder);
+    return acceptConnectionsUntilStopped(serverOrNULL, (struct sockaddr*) &anyInterfaceIPv4, sizeof(anyInterfaceIPv4));
+}
+
+int acceptConnectionsUntilStopped(struct Server* serverOrNULL, const struct sockaddr* address, socklen_t addressLength) {
+    bool usingOurOwnServer = false;
+    struct Server* server;
+    if (NULL == serverOrNULL) {
+        usingOurOwnServer = true;
+        server = (struct Server*) calloc(1, sizeof(*server));
+        serverInit(server);
+    } else {
+        server = serverOrNULL;
+    }
+    int result = acceptConnectionsUntilStoppedInternal(server, address, addressLength);
+    if (usingOurOwnServer) {
+        serverDeInit(server);
+        free(server);
+    }
+    return result;
+}
+
+static int acceptConnectionsUntilStoppedInternal(struct Server* server, const struct sockaddr* address, socklen_t addressLength) {
+    assert(NULL != server && "Why was there no valid server when we got to acceptConnectionsUntilStoppedInternal? We should have something");
+    assert(server->initialized && "The server was not initialized. Can you please call serverInit(&server) or pass NULL?");
+    callWSAStartupIfNecessary();
     /* resolve the local address we are binding to so we can print it out later */
     char addressHost[256];
     char addressPort[20];
@@ -1573,38 +4158,29 @@ static int acceptConnectionsUntilStoppedInternal(struct Server* server, const st
         strcpy(addressHost, "Unknown");
         strcpy(addressPort, "Unknown");
     }
-    server->listenerfd = socket(address->sa_family, SOCK_STREAM, IPPROTO_TCP);
-    if (server->listenerfd  <= 0) {
-        ews_printf("Could not create listener socket: %s = %d\n", strerror(errno), errno);
-        return 1;
-    }
-    /* SO_REUSEADDR tells the kernel to re-use the bind address in certain circumstances.
-     I've always found when making debug/test servers that I want this option, especially on Mac OS X */
-    int result;
-    int reuse = 1;
-    result = setsockopt(server->listenerfd, SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse));
-    if (0 != result) {
-        ews_printf("Failed to setsockopt SO_REUSEADDR = true with %s = %d. Continuing because we might still succeed...\n", strerror(errno), errno);
+    int listenerCount = server->listenerShards > 1 ? server->listenerShards : 1;
+#ifndef SO_REUSEPORT
+    if (listenerCount > 1) {
+        ews_printf("Warning: listenerShards needs SO_REUSEPORT which this platform doesn't have. Using one listener...\n");
+        listenerCount = 1;
     }
-
-    if (address->sa_family == AF_INET6) {
-        int ipv6only = 0;
-            result = setsockopt(server->listenerfd, IPPROTO_IPV6, IPV6_V6ONLY, (char*)&ipv6only, sizeof(ipv6only));
-            if (0 != result) {
-                ews_printf("Failed to setsockopt IPV6_V6ONLY = true with %s = %d. This is not supported on BSD/macOS\n", strerror(errno), errno);
+#endif
+    sockettype* listenerfds = (sockettype*) calloc(listenerCount, sizeof(*listenerfds));
+    for (int i = 0; i < listenerCount; i++) {
+        listenerfds[i] = listenerCreate(address, addressLength, listenerCount > 1, addressHost, addressPort);
+        if (listenerfds[i] < 0) {
+            for (int j = 0; j < i; j++) {
+                close(listenerfds[j]);
             }
+            free(listenerfds);
+            return 1;
+        }
     }
-    
-    result = bind(server->listenerfd, address, addressLength);
-    if (0 != result) {
-        ews_printf("Could not bind to %s:%s %s = %d\n", addressHost, addressPort, strerror(errno), errno);
-        return 1;
-    }
-    /* listen for the maximum possible amount of connections */
-    result = listen(server->listenerfd, SOMAXCONN);
-    if (0 != result) {
-        ews_printf("Could not listen for SOMAXCONN (%d) connections. %s = %d. Continuing because we might still succeed...\n", SOMAXCONN, strerror(errno), errno);
-    }
+    serverMutexLock(server);
+    server->listenerfds = listenerfds;
+    server->listenerCount = listenerCount;
+    server->listenerfd = listenerfds[0];
+    serverMutexUnlock(server);
     /* print out the addresses we're listening on. Special-case IPv4 0.0.0.0 bind-to-all-interfaces */
     bool printed = false;
     if (address->sa_family == AF_INET) {
@@ -1617,45 +4193,34 @@ static int acceptConnectionsUntilStoppedInternal(struct Server* server, const st
     if (!printed) {
         ews_printf("Listening for connections on %s:%s\n", addressHost, addressPort);
     }
-    /* allocate a connection (which sets connection->remoteAddrLength) and accept the next inbound connection */
-    struct Connection* nextConnection = connectionAlloc(server);
-    while (server->shouldRun) {
-        nextConnection->remoteAddrLength = sizeof(nextConnection->remoteAddr);
-        nextConnection->socketfd = accept(server->listenerfd , (struct sockaddr*) &nextConnection->remoteAddr, &nextConnection->remoteAddrLength);
-        if (-1 == nextConnection->socketfd) {
-            if (errno == EINTR) {
-                ews_printf("accept was interrupted, continuing if server.shouldRun is true...\n");
-                continue;
-            }
-            if (errno == EBADF) {
-                ews_printf("accept was stopped because the file descriptor is invalid (EBADF). This is probably because you closed it?\n");
-                continue;
+    if (1 == listenerCount) {
+        acceptConnectionsOnListener(server, listenerfds[0]);
+    } else {
+        ews_printf("Accepting connections on %d SO_REUSEPORT listeners\n", listenerCount);
+        struct ListenerShard* shards = (struct ListenerShard*) calloc(listenerCount, sizeof(*shards));
+        for (int i = 0; i < listenerCount; i++) {
+            shards[i].server = server;
+            shards[i].listenerfd = listenerfds[i];
+            shards[i].index = i;
+            int result = pthread_create(&shards[i].thread, NULL, &listenerShardThread, &shards[i]);
+            shards[i].started = (0 == result);
+            if (0 != result) {
+                ews_printf("Error while creating the thread for listener shard %d! pthread_create returned %d Continuing...\n", i, result);
             }
-            ews_printf("exiting because accept failed (probably interrupted) %s = %d\n", strerror(errno), errno);
-            break;
-        }
-        pthread_mutex_lock(&server->connectionFinishedLock);
-        server->activeConnectionCount++;
-        pthread_mutex_unlock(&server->connectionFinishedLock);
-        
-        pthread_t connectionThread;
-        /* we just received a new connection, spawn a thread */
-        result = pthread_create(&connectionThread, NULL, &connectionHandlerThread, nextConnection);
-        if (0 != result) {
-            ews_printf("Error while creating thread after accepting new connection! pthread_create returned %d Continuing...\n", result);
         }
-        result = pthread_detach(connectionThread);
-        if (0 != result) {
-            printf("Error while calling pthread_detach. Oh well - continuing with probably leaked memory. pthread_detached returned %d\n", result);
+        for (int i = 0; i < listenerCount; i++) {
+            if (shards[i].started) {
+                pthread_join(shards[i].thread, NULL);
+            }
         }
-        nextConnection = connectionAlloc(server);
+        free(shards);
     }
     serverMutexLock(server);
-    if (0 != server->listenerfd && errno != EBADF) {
-        close(server->listenerfd);
-    }
+    serverCloseListeners(server);
+    server->listenerfds = NULL;
+    server->listenerCount = 0;
     serverMutexUnlock(server);
-    connectionFree(nextConnection);
+    free(listenerfds);
     pthread_mutex_lock(&server->connectionFinishedLock);
     while (server->activeConnectionCount > 0) {
         ews_printf_debug("Active connection cound is %d, waiting for it go to 0...\n", server->activeConnectionCount);
@@ -1669,114 +4234,564 @@ static int acceptConnectionsUntilStoppedInternal(struct Server* server, const st
     return 0;
 }
 
-
-static int sendResponse(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
-    if (response->body.length > 0) {
-        return sendResponseBody(connection, response, bytesSent);
-    }
-    if (NULL != response->filenameToSend) {
-        return sendResponseFile(connection, response, bytesSent);
-    }
-    ews_printf("Error: the request for '%s' failed because there was neither a response body nor a filenameToSend\n", connection->request.path);
-    assert(0 && "See above ews_printf");
-    return 1;
-}
-
-static int sendResponseBody(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
-    /* First send the response HTTP headers */
-    int headerLength = snprintfResponseHeader(connection->responseHeader, sizeof(connection->responseHeader), response->code, response->status, response->contentType, response->extraHeaders, response->body.length);
-    ssize_t sendResult;
-    sendResult = send(connection->socketfd, connection->responseHeader, headerLength, 0);
-    if (sendResult != headerLength) {
-        ews_printf("Failed to respond to %s:%s because we could not send the HTTP response *header*. send returned %ld with %s = %d\n",
-               connection->remoteHost,
-               connection->remotePort,
-               (long) sendResult,
-               strerror(errno),
-               errno);
+/* Creates a socket bound to address and listening. Returns -1 if that didn't work out */
+static sockettype listenerCreate(const struct sockaddr* address, socklen_t addressLength, bool reusePort, const char* addressHost, const char* addressPort) {
+    sockettype listenerfd = socket(address->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (listenerfd  <= 0) {
+        ews_printf("Could not create listener socket: %s = %d\n", strerror(errno), errno);
         return -1;
     }
-    if (OptionPrintResponse) {
-        fwrite(connection->responseHeader, 1, headerLength, stdout);
+    /* SO_REUSEADDR tells the kernel to re-use the bind address in certain circumstances.
+     I've always found when making debug/test servers that I want this option, especially on Mac OS X */
+    int result;
+    int reuse = 1;
+    result = setsockopt(listenerfd, SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse));
+    if (0 != result) {
+        ews_printf("Failed to setsockopt SO_REUSEADDR = true with %s = %d. Continuing because we might still succeed...\n", strerror(errno), errno);
     }
-    *bytesSent = *bytesSent + sendResult;
-    /* Second, if a response body exists, send that */
-    if (response->body.length > 0) {
-        sendResult = send(connection->socketfd, response->body.contents, response->body.length, 0);
-        if (sendResult != (ssize_t) response->body.length) {
-            ews_printf("Failed to respond to %s:%s because we could not send the HTTP response *body*. send returned %" PRId64 " with %s = %d\n",
-                   connection->remoteHost,
-                   connection->remotePort,
-                   (int64_t) sendResult,
-                   strerror(errno),
-                   errno);
-            return -1;
-        }
-        if (OptionPrintResponse) {
-            fwrite(response->body.contents, 1, response->body.length, stdout);
+#ifdef SO_REUSEPORT
+    /* SO_REUSEPORT lets several sockets bind the same address and the kernel balances new connections between them */
+    if (reusePort) {
+        result = setsockopt(listenerfd, SOL_SOCKET, SO_REUSEPORT, (char*)&reuse, sizeof(reuse));
+        if (0 != result) {
+            ews_printf("Failed to setsockopt SO_REUSEPORT = true with %s = %d. The next bind will probably fail...\n", strerror(errno), errno);
         }
-        *bytesSent = *bytesSent + sendResult;
     }
-    return 0;
-}
+#else
+    (void) reusePort;
+#endif
 
-static int sendResponseFile(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
-    /* If you were writing a high-performance web server you could use 
-    sendfile, memory map the file, or any number of exciting things. But
-    here we just fread the first 100 bytes to figure out MIME type, then rewind
-    and send the file ~16KB at a time. */
-    struct Response* errorResponse = NULL;
+    if (address->sa_family == AF_INET6) {
+        int ipv6only = 0;
+            result = setsockopt(listenerfd, IPPROTO_IPV6, IPV6_V6ONLY, (char*)&ipv6only, sizeof(ipv6only));
+            if (0 != result) {
+                ews_printf("Failed to setsockopt IPV6_V6ONLY = true with %s = %d. This is not supported on BSD/macOS\n", strerror(errno), errno);
+            }
+    }
+
+    result = bind(listenerfd, address, addressLength);
+    if (0 != result) {
+        ews_printf("Could not bind to %s:%s %s = %d\n", addressHost, addressPort, strerror(errno), errno);
+        close(listenerfd);
+        return -1;
+    }
+    /* listen for the maximum possible amount of connections */
+    result = listen(listenerfd, SOMAXCONN);
+    if (0 != result) {
+        ews_printf("Could not listen for SOMAXCONN (%d) connections. %s = %d. Continuing because we might still succeed...\n", SOMAXCONN, strerror(errno), errno);
+    }
+    return listenerfd;
+}
+
+#if EWS_EVENT_LOOP_SUPPORTED
+/* Call with the server mutex held. Wakes up anyone blocked in accept, epoll_wait or io_uring on a listener but leaves it
+ open, so it stays in its event loop's epoll set until the loop sees it's been shut down */
+static void serverShutdownListeners(struct Server* server) {
+    for (int i = 0; i < server->listenerCount; i++) {
+        if (server->listenerfds[i] >= 0) {
+            shutdown(server->listenerfds[i], SHUT_RDWR);
+        }
+    }
+}
+#endif
+
+/* Call with the server mutex held. shutdown wakes up anyone blocked in accept or epoll_wait on a listener, close alone
+ doesn't on Linux. Each listener is marked -1 so we never close it twice */
+static void serverCloseListeners(struct Server* server) {
+    for (int i = 0; i < server->listenerCount; i++) {
+        if (server->listenerfds[i] >= 0) {
+            shutdown(server->listenerfds[i], SHUT_RDWR);
+            close(server->listenerfds[i]);
+            server->listenerfds[i] = -1;
+        }
+    }
+    server->listenerfd = -1;
+}
+
+/* Runs server->model on one listener until the server stops */
+static void acceptConnectionsOnListener(struct Server* server, sockettype listenerfd) {
+    struct ConnectionPool* pool = connectionPoolCreate(server);
+    struct ConnectionPool* previousPool = currentConnectionPool;
+    currentConnectionPool = pool;
+    acceptConnectionsWithModel(server, listenerfd);
+    currentConnectionPool = previousPool;
+    connectionPoolRelease(pool);
+}
+
+static void acceptConnectionsWithModel(struct Server* server, sockettype listenerfd) {
+    if (ServerModelIOUring == server->model) {
+#if EWS_IO_URING_SUPPORTED
+        if (!ioUringRun(server, listenerfd)) {
+            ews_printf("Warning: io_uring isn't available (or stopped working). Falling back to ServerModelEventLoop...\n");
+            eventLoopRun(server, listenerfd);
+        }
+#elif EWS_EVENT_LOOP_SUPPORTED
+        ews_printf("Warning: ServerModelIOUring was left out of this build. Falling back to ServerModelEventLoop...\n");
+        eventLoopRun(server, listenerfd);
+#else
+        ews_printf("Warning: ServerModelIOUring is only supported on Linux. Falling back to a thread per connection...\n");
+        acceptConnectionsThreadPerConnection(server, listenerfd);
+#endif
+    } else if (ServerModelEventLoop == server->model) {
+#if EWS_EVENT_LOOP_SUPPORTED
+        eventLoopRun(server, listenerfd);
+#else
+        ews_printf("Warning: ServerModelEventLoop is only supported on Linux. Falling back to a thread per connection...\n");
+        acceptConnectionsThreadPerConnection(server, listenerfd);
+#endif
+    } else if (ServerModelThreadPool == server->model) {
+        acceptConnectionsThreadPool(server, listenerfd);
+    } else {
+        acceptConnectionsThreadPerConnection(server, listenerfd);
+    }
+}
+
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 listenerShardThread(void* shardPointer) {
+    struct ListenerShard* shard = (struct ListenerShard*) shardPointer;
+    if (shard->server->listenerShardsPinToCPUs) {
+        threadPinToCPU(shard->index);
+    }
+    acceptConnectionsOnListener(shard->server, shard->listenerfd);
+    return (THREAD_RETURN_TYPE) NULL;
+}
+
+/* Blocks until the next client connects. Returns false once we should stop accepting connections */
+static bool connectionAccept(struct Server* server, sockettype listenerfd, sockettype* socketfd, struct sockaddr_storage* remoteAddr, socklen_t* remoteAddrLength) {
+    while (server->shouldRun) {
+        *remoteAddrLength = sizeof(*remoteAddr);
+        *socketfd = accept(listenerfd, (struct sockaddr*) remoteAddr, remoteAddrLength);
+        if (-1 != *socketfd) {
+            return true;
+        }
+        /* serverStop shuts the listeners down, which makes accept fail with EINVAL. That's a clean stop, not an error */
+        if (!server->shouldRun) {
+            return false;
+        }
+        if (errno == EINTR) {
+            ews_printf("accept was interrupted, continuing if server.shouldRun is true...\n");
+            continue;
+        }
+        if (errno == EBADF) {
+            ews_printf("accept was stopped because the file descriptor is invalid (EBADF). This is probably because you closed it?\n");
+            continue;
+        }
+        ews_printf("exiting because accept failed (probably interrupted) %s = %d\n", strerror(errno), errno);
+        return false;
+    }
+    return false;
+}
+
+/* When we're too busy to take another connection we answer with this canned response straight from the accepting
+ thread - no Connection, no thread, no parsing */
+static void connectionRejectBusy(sockettype socketfd) {
+    static const char busyResponse[] =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Type: text/html; charset=UTF-8\r\n"
+        "Content-Length: 99\r\n"
+        "Connection: close\r\n"
+        "Retry-After: 1\r\n"
+        "\r\n"
+        "<html><head><title>503 Service Unavailable</title></head><body>The server is too busy</body></html>";
+    send(socketfd, busyResponse, sizeof(busyResponse) - 1, 0);
+    /* Closing a socket with unread bytes in it sends a reset, which can make the client throw the 503 away before it
+     reads it. So finish our side and discard whatever of the request is already here, without waiting for the rest */
+    shutdown(socketfd, SHUT_WR);
+#ifdef MSG_DONTWAIT
+    char discard[1024];
+    for (int i = 0; i < 16 && recv(socketfd, discard, sizeof(discard), MSG_DONTWAIT) > 0; i++) {
+    }
+#endif
+    close(socketfd);
+    if (OptionIncludeStatusPageAndCounters) {
+        counterAdd(counters.connectionsRejected, 1);
+    }
+}
+
+/* Called by the accept loops before anything is allocated for a new connection. Counts it as active and returns true,
+ or turns it away with connectionRejectBusy if the server is at maxActiveConnections or maxInFlightRequests */
+static bool connectionAdmit(struct Server* server, sockettype socketfd) {
+    int maxActiveConnections = serverSettingUnlessOff(server, maxActiveConnections);
+    int maxInFlightRequests = serverSettingUnlessOff(server, maxInFlightRequests);
+    if (maxInFlightRequests > 0 && counterRead(server->inFlightRequestCount) >= maxInFlightRequests) {
+        ews_printf_debug("There are already %d requests in flight. Rejecting the new connection with a 503\n", maxInFlightRequests);
+        connectionRejectBusy(socketfd);
+        return false;
+    }
+    pthread_mutex_lock(&server->connectionFinishedLock);
+    bool admitted = 0 == maxActiveConnections || server->activeConnectionCount < maxActiveConnections;
+    if (admitted) {
+        server->activeConnectionCount++;
+    }
+    pthread_mutex_unlock(&server->connectionFinishedLock);
+    if (!admitted) {
+        ews_printf_debug("There are already %d active connections. Rejecting the new connection with a 503\n", maxActiveConnections);
+        connectionRejectBusy(socketfd);
+    }
+    return admitted;
+}
+
+/* Takes back a connectionAdmit when we find out we can't serve the connection after all, and answers it with the 503 */
+static void connectionUnadmit(struct Server* server, sockettype socketfd) {
+    pthread_mutex_lock(&server->connectionFinishedLock);
+    server->activeConnectionCount--;
+    pthread_cond_signal(&server->connectionFinishedCond);
+    pthread_mutex_unlock(&server->connectionFinishedLock);
+    connectionRejectBusy(socketfd);
+}
+
+/* Gets a Connection for a socket connectionAdmit let in. If there's no memory for one, the client gets the same 503 as
+ when we're busy and this returns NULL */
+static struct Connection* connectionAllocAdmitted(struct Server* server, sockettype socketfd, const struct sockaddr_storage* remoteAddr, socklen_t remoteAddrLength) {
+    struct Connection* connection = connectionAlloc(server);
+    if (NULL == connection) {
+        connectionUnadmit(server, socketfd);
+        return NULL;
+    }
+    connection->socketfd = socketfd;
+    memcpy(&connection->remoteAddr, remoteAddr, MIN(remoteAddrLength, (socklen_t) sizeof(connection->remoteAddr)));
+    connection->remoteAddrLength = remoteAddrLength;
+    return connection;
+}
+
+static void acceptConnectionsThreadPerConnection(struct Server* server, sockettype listenerfd) {
+    int result;
+    sockettype socketfd;
+    struct sockaddr_storage remoteAddr;
+    socklen_t remoteAddrLength;
+    while (connectionAccept(server, listenerfd, &socketfd, &remoteAddr, &remoteAddrLength)) {
+        if (!connectionAdmit(server, socketfd)) {
+            continue;
+        }
+        struct Connection* connection = connectionAllocAdmitted(server, socketfd, &remoteAddr, remoteAddrLength);
+        if (NULL == connection) {
+            continue;
+        }
+        pthread_t connectionThread;
+        /* we just received a new connection, spawn a thread */
+        result = pthread_create(&connectionThread, NULL, &connectionHandlerThread, connection);
+        if (0 != result) {
+            ews_printf("Error while creating thread after accepting new connection! pthread_create returned %d Continuing...\n", result);
+        }
+        result = pthread_detach(connectionThread);
+        if (0 != result) {
+            printf("Error while calling pthread_detach. Oh well - continuing with probably leaked memory. pthread_detached returned %d\n", result);
+        }
+    }
+}
+
+/* ServerModelThreadPool - accepted connections wait in this ring buffer for the next free worker */
+struct ConnectionQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    struct Connection** connections;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    bool stopping;
+};
+
+/* The queue this ServerModelThreadPool worker takes its connections from. NULL on every other thread */
+static EWS_THREAD_LOCAL struct ConnectionQueue* currentConnectionQueue;
+
+/* Are there connections queued up waiting for this thread pool worker (or one of the others) to be free? */
+static bool connectionQueueHasWaiting(void) {
+    struct ConnectionQueue* queue = currentConnectionQueue;
+    if (NULL == queue) {
+        return false;
+    }
+    pthread_mutex_lock(&queue->lock);
+    bool waiting = queue->count > 0;
+    pthread_mutex_unlock(&queue->lock);
+    return waiting;
+}
+
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 threadPoolWorker(void* queuePointer) {
+    struct ConnectionQueue* queue = (struct ConnectionQueue*) queuePointer;
+    currentConnectionQueue = queue;
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        while (0 == queue->count && !queue->stopping) {
+            pthread_cond_wait(&queue->notEmpty, &queue->lock);
+        }
+        /* when stopping we still finish the connections already queued up - they count towards activeConnectionCount */
+        if (0 == queue->count) {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        struct Connection* connection = queue->connections[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_mutex_unlock(&queue->lock);
+        connectionHandlerThread(connection);
+    }
+    return (THREAD_RETURN_TYPE) NULL;
+}
+
+static void acceptConnectionsThreadPool(struct Server* server, sockettype listenerfd) {
+    int threadCount = serverSetting(server, threadPoolSize);
+    struct ConnectionQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.capacity = serverSetting(server, threadPoolMaxQueuedConnections);
+    queue.connections = (struct Connection**) calloc(queue.capacity, sizeof(*queue.connections));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.notEmpty, NULL);
+    pthread_t* threads = (pthread_t*) calloc(threadCount, sizeof(*threads));
+    int threadsStarted = 0;
+    for (int i = 0; i < threadCount; i++) {
+        int result = pthread_create(&threads[threadsStarted], NULL, &threadPoolWorker, &queue);
+        if (0 != result) {
+            ews_printf("Error while creating thread pool worker %d of %d! pthread_create returned %d Continuing...\n", i, threadCount, result);
+            continue;
+        }
+        threadsStarted++;
+    }
+    ews_printf_debug("Started %d worker threads with room for %d queued connections\n", threadsStarted, (int) queue.capacity);
+    sockettype socketfd;
+    struct sockaddr_storage remoteAddr;
+    socklen_t remoteAddrLength;
+    while (threadsStarted > 0 && connectionAccept(server, listenerfd, &socketfd, &remoteAddr, &remoteAddrLength)) {
+        /* rejecting blocks on the client for a bit, so admit before taking queue.lock where that would hold up the workers */
+        if (!connectionAdmit(server, socketfd)) {
+            continue;
+        }
+        struct Connection* connection = connectionAllocAdmitted(server, socketfd, &remoteAddr, remoteAddrLength);
+        if (NULL == connection) {
+            continue;
+        }
+        pthread_mutex_lock(&queue.lock);
+        if (queue.count == queue.capacity) {
+            pthread_mutex_unlock(&queue.lock);
+            ews_printf_debug("The connection queue is full (%d). Rejecting the new connection with a 503\n", (int) queue.capacity);
+            connectionFree(connection);
+            connectionUnadmit(server, socketfd);
+            continue;
+        }
+        queue.connections[(queue.head + queue.count) % queue.capacity] = connection;
+        queue.count++;
+        pthread_cond_signal(&queue.notEmpty);
+        pthread_mutex_unlock(&queue.lock);
+    }
+    pthread_mutex_lock(&queue.lock);
+    queue.stopping = true;
+    pthread_cond_broadcast(&queue.notEmpty);
+    pthread_mutex_unlock(&queue.lock);
+    for (int i = 0; i < threadsStarted; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(queue.connections);
+    pthread_cond_destroy(&queue.notEmpty);
+    pthread_mutex_destroy(&queue.lock);
+}
+
+
+static int sendResponse(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
+    if (response->body.length > 0) {
+        return sendResponseBody(connection, response, bytesSent);
+    }
+    if (NULL != response->filenameToSend) {
+        return sendResponseFile(connection, response, bytesSent);
+    }
+    ews_printf("Error: the request for '%s' failed because there was neither a response body nor a filenameToSend\n", connection->request.path);
+    assert(0 && "See above ews_printf");
+    return 1;
+}
+
+/* Like send() but gathers two buffers (usually the response header and body) into a single syscall so small responses
+ go out in one packet instead of waiting on Nagle + delayed ACK. Returns what send() would: how many bytes went out
+ (maybe fewer than both lengths) or -1 with errno set */
+static ssize_t sendTwoBuffers(sockettype socketfd, const char* first, size_t firstLength, const char* second, size_t secondLength, int flags) {
+#if defined(WIN32)
+    (void) flags;
+    WSABUF buffers[2];
+    DWORD bytesSent = 0;
+    buffers[0].buf = (char*) first;
+    buffers[0].len = (ULONG) firstLength;
+    buffers[1].buf = (char*) second;
+    buffers[1].len = (ULONG) secondLength;
+    if (0 != WSASend(socketfd, buffers, 2, &bytesSent, 0, NULL, NULL)) {
+        return -1;
+    }
+    return (ssize_t) bytesSent;
+#else
+    struct iovec buffers[2];
+    buffers[0].iov_base = (void*) first;
+    buffers[0].iov_len = firstLength;
+    buffers[1].iov_base = (void*) second;
+    buffers[1].iov_len = secondLength;
+#ifdef EWS_FUZZ_TEST
+    (void) socketfd;
+    (void) flags;
+    return writev(STDOUT_FILENO, buffers, 2);
+#else
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = buffers;
+    message.msg_iovlen = 2;
+    return sendmsg(socketfd, &message, flags);
+#endif
+#endif
+}
+
+static int sendResponseBody(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
+    /* Send the response HTTP headers and body together. A slow client can take less than all of it at once so keep
+     going from where the last send stopped */
+    int headerLength = snprintfResponseHeader(connection->responseHeader, sizeof(connection->responseHeader), response->code, response->status, response->contentType, response->extraHeaders, response->body.length, connection->keepAlive);
+    size_t headerLengthToSend = MIN((size_t) headerLength, sizeof(connection->responseHeader) - 1);
+    size_t headerSent = 0;
+    size_t bodySent = 0;
+    while (headerSent < headerLengthToSend || bodySent < response->body.length) {
+        ssize_t sendResult = sendTwoBuffers(connection->socketfd,
+                                            connection->responseHeader + headerSent, headerLengthToSend - headerSent,
+                                            response->body.contents + bodySent, response->body.length - bodySent, 0);
+        if (sendResult < 0 && EINTR == errno) {
+            continue;
+        }
+        if (sendResult <= 0) {
+            if (sendResult < 0) {
+                connectionSendFailed(connection);
+            }
+            ews_printf("Failed to respond to %s:%s because we could not send the HTTP response *%s*. send returned %" PRId64 " with %s = %d\n",
+                   connection->remoteHost,
+                   connection->remotePort,
+                   headerSent < headerLengthToSend ? "header" : "body",
+                   (int64_t) sendResult,
+                   strerror(errno),
+                   errno);
+            return -1;
+        }
+        size_t headerPart = MIN((size_t) sendResult, headerLengthToSend - headerSent);
+        headerSent += headerPart;
+        bodySent += (size_t) sendResult - headerPart;
+        *bytesSent = *bytesSent + sendResult;
+    }
+    if (OptionPrintResponse) {
+        fwrite(connection->responseHeader, 1, headerLengthToSend, stdout);
+        fwrite(response->body.contents, 1, response->body.length, stdout);
+    }
+    return 0;
+}
+
+/* Opens response->filenameToSend and figures out the Content-Type + Content-Length so we can send the header. If something
+ goes wrong this returns an error response to send instead of the file. */
+static struct Response* responseFileOpen(struct Connection* connection, const struct Response* response, FILE** fpOut, const char** contentTypeOut, long* fileLengthOut) {
     FILE* fp = fopen_utf8_path(response->filenameToSend, "rb");
-    int result = 0;
-    long fileLength;
-    ssize_t sendResult;
-    int headerLength;
+    int result;
     size_t actualMIMEReadSize;
-    const char* contentType = NULL;
     const size_t MIMEReadSize = 100;
+    *fpOut = fp;
     if (NULL == fp) {
         ews_printf("Unable to satisfy request for '%s' because we could not open the file '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
-        errorResponse = responseAlloc404NotFoundHTML(connection->request.path);
-        goto exit;
+        return responseAlloc404NotFoundHTML(connection->request.path);
     }
     /* If the MIME type if specified in the response->contentType, use that. Otherwise try to guess with MIMETypeFromFile */
     if (NULL != response->contentType) {
-        contentType = response->contentType;
+        *contentTypeOut = response->contentType;
     } else {
-        assert(sizeof(connection->sendRecvBuffer) >= MIMEReadSize);
-        actualMIMEReadSize = fread(connection->sendRecvBuffer, 1, MIMEReadSize, fp);
+        /* the header isn't formatted yet so borrow its buffer - sendRecvBuffer might be holding a pipelined request */
+        assert(sizeof(connection->responseHeader) >= MIMEReadSize);
+#if EWS_SENDFILE_SUPPORTED
+        /* pread leaves the stdio buffer and the file position alone since sendfile doesn't go through them */
+        ssize_t preadResult = pread(fileno(fp), connection->responseHeader, MIMEReadSize, 0);
+        actualMIMEReadSize = preadResult > 0 ? (size_t) preadResult : 0;
+#else
+        actualMIMEReadSize = fread(connection->responseHeader, 1, MIMEReadSize, fp);
+#endif
         if (0 == actualMIMEReadSize) {
             ews_printf("Unable to satisfy request for '%s' because we could read the first bunch of bytes to determine MIME type '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
-            errorResponse = responseAlloc500InternalErrorHTML("fread for MIME type detection failed");
-            goto exit;
+            return responseAlloc500InternalErrorHTML("fread for MIME type detection failed");
         }
-        contentType = MIMETypeFromFile(response->filenameToSend, (const uint8_t*)connection->sendRecvBuffer, actualMIMEReadSize);
-        ews_printf_debug("Detected MIME type '%s' for file '%s'\n", contentType, response->filenameToSend);
+        *contentTypeOut = MIMETypeFromFile(response->filenameToSend, (const uint8_t*)connection->responseHeader, actualMIMEReadSize);
+        ews_printf_debug("Detected MIME type '%s' for file '%s'\n", *contentTypeOut, response->filenameToSend);
     }
+#if EWS_SENDFILE_SUPPORTED
+    (void) result;
+    struct stat fileStat;
+    if (0 != fstat(fileno(fp), &fileStat)) {
+        ews_printf("Unable to satisfy request for '%s' because we could not fstat the file '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
+        return responseAlloc500InternalErrorHTML("fstat to determine file length failed");
+    }
+    *fileLengthOut = (long) fileStat.st_size;
+    return NULL;
+#else
     /* get the file length, laboriously checking for errors */
     result = fseek(fp, 0, SEEK_END);
     if (0 != result) {
         ews_printf("Unable to satisfy request for '%s' because we could not fseek to the end of the file '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
-        errorResponse = responseAlloc500InternalErrorHTML("fseek to end of file failed");
-        goto exit;
+        return responseAlloc500InternalErrorHTML("fseek to end of file failed");
     }
-    fileLength = ftell(fp);
-    if (fileLength < 0) {
+    *fileLengthOut = ftell(fp);
+    if (*fileLengthOut < 0) {
         ews_printf("Unable to satisfy request for '%s' because we could not ftell on the file '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
-        errorResponse = responseAlloc500InternalErrorHTML("ftell to determine file length failed");
-        goto exit;
+        return responseAlloc500InternalErrorHTML("ftell to determine file length failed");
     }
     result = fseek(fp, 0, SEEK_SET);
     if (0 != result) {
         ews_printf("Unable to satisfy request for '%s' because we could not fseek to the beginning of the file '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
-        errorResponse = responseAlloc500InternalErrorHTML("fseek to beginning of file to start sending failed");
+        return responseAlloc500InternalErrorHTML("fseek to beginning of file to start sending failed");
+    }
+    return NULL;
+#endif
+}
+
+#if EWS_SENDFILE_SUPPORTED
+/* Sends fileLength bytes starting at *offset straight from the page cache to the socket. Returns 0 when it's all sent,
+ 1 if we should give up on the connection, or -1 if sendfile doesn't work for this file and the caller should fall back
+ to fread/send starting from *offset */
+static int sendFileWithSendfile(struct Connection* connection, const struct Response* response, int filefd, long fileLength, off_t* offset, ssize_t* bytesSent) {
+    while (*offset < (off_t) fileLength) {
+        /* sendfile can send less than we asked for, so keep asking for the rest */
+        ssize_t sendResult = sendfile(connection->socketfd, filefd, offset, (size_t) ((off_t) fileLength - *offset));
+        if (sendResult < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            if (socketErrorIsTimeout()) {
+                /* the socket's SO_SNDTIMEO ran out */
+                connectionSendFailed(connection);
+                return 1;
+            }
+            if (EINVAL == errno || ENOSYS == errno) {
+                ews_printf_debug("sendfile is not available for '%s' (%s = %d), falling back to fread/send\n", response->filenameToSend, strerror(errno), errno);
+                return -1;
+            }
+            ews_printf("Unable to satisfy request for '%s' because there was an error in sendfile. '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
+            return 1;
+        }
+        if (0 == sendResult) {
+            ews_printf("Unable to satisfy request for '%s' because '%s' got shorter while we were sending it\n", connection->request.path, response->filenameToSend);
+            return 1;
+        }
+        *bytesSent = *bytesSent + sendResult;
+    }
+    return 0;
+}
+#endif
+
+static int sendResponseFile(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
+    /* We read the first 100 bytes to figure out MIME type, send the header, then on Linux let sendfile copy the file
+    to the socket without it ever coming up to user space. Everywhere else (or if sendfile doesn't work for this file,
+    or OptionPrintResponse wants to see the bytes) we fread and send the file ~16KB at a time. */
+    FILE* fp = NULL;
+    int result = 0;
+    long fileLength = 0;
+    ssize_t sendResult;
+    int headerLength;
+    const char* contentType = NULL;
+    size_t chunkCapacity;
+    char* chunk = connectionFileChunkBuffer(connection, &chunkCapacity);
+    struct Response* errorResponse = responseFileOpen(connection, response, &fp, &contentType, &fileLength);
+    if (NULL != errorResponse) {
         goto exit;
     }
     
     /* now we have the file length + MIME TYpe and we can send the header */
-    headerLength = snprintfResponseHeader(connection->responseHeader, sizeof(connection->responseHeader), response->code, response->status, contentType, response->extraHeaders, fileLength);
+    headerLength = snprintfResponseHeader(connection->responseHeader, sizeof(connection->responseHeader), response->code, response->status, contentType, response->extraHeaders, fileLength, connection->keepAlive);
     sendResult = send(connection->socketfd, connection->responseHeader, headerLength, 0);
     if (sendResult != headerLength) {
+        if (sendResult < 0) {
+            connectionSendFailed(connection);
+        }
         ews_printf("Unable to satisfy request for '%s' because we could not send the HTTP header '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
         result = 1;
         goto exit;
@@ -1785,9 +4800,25 @@ static int sendResponseFile(struct Connection* connection, const struct Response
         fwrite(connection->responseHeader, 1, headerLength, stdout);
     }
     *bytesSent = sendResult;
+#if EWS_SENDFILE_SUPPORTED
+    if (!OptionPrintResponse) {
+        off_t offset = 0;
+        result = sendFileWithSendfile(connection, response, fileno(fp), fileLength, &offset, bytesSent);
+        if (result >= 0) {
+            goto exit;
+        }
+        /* pick up with fread where sendfile left off */
+        result = 0;
+        if (0 != fseek(fp, (long) offset, SEEK_SET)) {
+            ews_printf("Unable to satisfy request for '%s' because we could not fseek to where sendfile stopped in '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
+            result = 1;
+            goto exit;
+        }
+    }
+#endif
     /* read the whole file, just buffering into the connection buffer, and sending it out to the socket */
     while (!feof(fp)) {
-        size_t bytesRead = fread(connection->sendRecvBuffer, 1, sizeof(connection->sendRecvBuffer), fp);
+        size_t bytesRead = fread(chunk, 1, chunkCapacity, fp);
         if (0 == bytesRead) { /* peacefull end of file */
             break;
         }
@@ -1796,129 +4827,1496 @@ static int sendResponseFile(struct Connection* connection, const struct Response
             errorResponse = responseAlloc500InternalErrorHTML("Could not fread to send over socket");
             goto exit;
         }
-        /* send the data out the socket to the network */
-        sendResult = send(connection->socketfd, connection->sendRecvBuffer, bytesRead, 0);
-        if (sendResult != (ssize_t) bytesRead) {
-            ews_printf("Unable to satisfy request for '%s' because there was an error sending bytes. '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
-            result = 1;
-            goto exit;
+        /* send the data out the socket to the network. A send that ran into the socket's SO_SNDTIMEO comes back short
+         after sending some of it, so keep going from there */
+        size_t chunkSent = 0;
+        while (chunkSent < bytesRead) {
+            sendResult = send(connection->socketfd, chunk + chunkSent, bytesRead - chunkSent, 0);
+            if (sendResult < 0 && EINTR == errno) {
+                continue;
+            }
+            if (sendResult <= 0) {
+                if (sendResult < 0) {
+                    connectionSendFailed(connection);
+                }
+                ews_printf("Unable to satisfy request for '%s' because there was an error sending bytes. '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
+                result = 1;
+                goto exit;
+            }
+            chunkSent += (size_t) sendResult;
+            *bytesSent = *bytesSent + sendResult;
+        }
+        if (OptionPrintResponse) {
+            fwrite(chunk, 1, bytesRead, stdout);
+        }
+    }
+exit:
+    if (NULL != fp) {
+        fclose(fp);
+    }
+    if (NULL != errorResponse) {
+        ews_printf("Instead of satisfying the request for '%s' we encountered an error and will return %d %s\n", connection->request.path, response->code, response->status);
+        ssize_t errorBytesSent = 0;
+        result = sendResponseBody(connection, errorResponse, &errorBytesSent);
+        *bytesSent = *bytesSent + errorBytesSent;
+        responseFree(errorResponse);
+        return result;
+    }
+    return result;
+}
+
+static struct Response* createResponseForRequestInArena(const struct Request* request, struct Connection* connection);
+
+/* Whatever the handler allocates with responseAlloc* comes from the connection's arena */
+static struct Response* createResponseForRequestAutoreleased(const struct Request* request, struct Connection* connection) {
+    struct Arena* previousArena = connectionArenaEnter(connection);
+    struct Response* response = createResponseForRequestInArena(request, connection);
+    connectionArenaLeave(previousArena);
+    return response;
+}
+
+static struct Response* createResponseForRequestInArena(const struct Request* request, struct Connection* connection) {
+    if (RequestParseStateBadRequest == request->state) {
+        if (NULL != connection->bodyHandler) {
+            struct Response* handlerResponse = connectionBodyHandlerEnd(connection);
+            if (NULL != handlerResponse) {
+                responseFree(handlerResponse);
+            }
+        }
+        if (!request->bodyChunked) {
+            /* we ran out of memory for the request line */
+            return responseAlloc400BadRequestHTML("The request could not be read");
+        }
+        return responseAlloc400BadRequestHTML("The chunked request body was malformed");
+    }
+    /* Objective-C users of this library have a high probability of creating Objective-C objects.
+     Some Objective-C objects are autoreleased. Objective-C relies on reference counting for
+     object memory management. Each object has a reference count. An object can be added to an
+     autoreleasepool to be released when the pool is drained/dealloc'd. Since most users of 
+     Objective-C will probably want to create autoreleased objects (many constructors 
+     create them by default), we automatically add an autoreleasepool around every call to 
+     createResponseForRequest. If Objective-C is not in use, then autorelease is not in use */
+    if (NULL != connection->bodyRejectedResponse) {
+        struct Response* response = connection->bodyRejectedResponse;
+        connection->bodyRejectedResponse = NULL;
+        return response;
+    }
+#ifdef __OBJC__
+    @autoreleasepool {
+#endif
+        if (NULL != connection->bodyHandler) {
+            return connectionBodyHandlerEnd(connection);
+        }
+        return createResponseForRequest(request, connection);
+#ifdef __OBJC__
+    }
+#endif
+}
+
+/* Called once we have accepted a connection, before we start reading the request */
+static void connectionStarted(struct Connection* connection) {
+    getnameinfo((struct sockaddr*) &connection->remoteAddr, connection->remoteAddrLength,
+                connection->remoteHost, sizeof(connection->remoteHost),
+                connection->remotePort, sizeof(connection->remotePort), NI_NUMERICHOST | NI_NUMERICSERV);
+    ews_printf_debug("New connection from %s:%s...\n", connection->remoteHost, connection->remotePort);
+    if (OptionIncludeStatusPageAndCounters) {
+        counterAdd(counters.activeConnections, 1);
+        counterAdd(counters.totalConnections, 1);
+    }
+    struct Server* server = connection->server;
+    pthread_mutex_lock(&server->connectionFinishedLock);
+    connection->activePrevious = NULL;
+    connection->activeNext = server->activeConnections;
+    if (NULL != server->activeConnections) {
+        server->activeConnections->activePrevious = connection;
+    }
+    server->activeConnections = connection;
+    if (server->connectionsCutOff) {
+        /* it sat in the thread pool queue past serverStop's deadline */
+        shutdown(connection->socketfd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&server->connectionFinishedLock);
+}
+
+/* A request has been read and is about to be handled. It's in flight until connectionRequestFinished */
+static void connectionRequestStarted(struct Connection* connection) {
+    if (serverSettingUnlessOff(connection->server, maxInFlightRequests) > 0) {
+        connection->requestInFlight = true;
+        counterAdd(connection->server->inFlightRequestCount, 1);
+    }
+}
+
+static void connectionRequestFinished(struct Connection* connection) {
+    if (connection->requestInFlight) {
+        connection->requestInFlight = false;
+        counterAdd(connection->server->inFlightRequestCount, -1);
+    }
+}
+
+/* Closes the socket, updates the counters, lets serverStop know, and frees the connection */
+static void connectionFinished(struct Connection* connection) {
+    connectionRequestFinished(connection);
+    /* out of server->activeConnections before the socket is closed, so serverCutOffConnections never shuts down a
+     socket number that has already been handed out again */
+    pthread_mutex_lock(&connection->server->connectionFinishedLock);
+    if (NULL != connection->activePrevious) {
+        connection->activePrevious->activeNext = connection->activeNext;
+    } else {
+        connection->server->activeConnections = connection->activeNext;
+    }
+    if (NULL != connection->activeNext) {
+        connection->activeNext->activePrevious = connection->activePrevious;
+    }
+    pthread_mutex_unlock(&connection->server->connectionFinishedLock);
+    close(connection->socketfd);
+    counterAdd(counters.bytesSent, connection->status.bytesSent);
+    counterAdd(counters.bytesReceived, connection->status.bytesReceived);
+    counterAdd(counters.activeConnections, -1);
+    ews_printf_debug("Connection from %s:%s closed\n", connection->remoteHost, connection->remotePort);
+    struct Server* server = connection->server;
+    connectionFree(connection);
+    pthread_mutex_lock(&server->connectionFinishedLock);
+    server->activeConnectionCount--;
+    pthread_cond_signal(&server->connectionFinishedCond);
+    pthread_mutex_unlock(&server->connectionFinishedLock);
+}
+
+/* Called once the request is parsed and the response is ready so we know what to put in the Connection: header */
+static bool connectionShouldKeepAlive(struct Connection* connection) {
+    struct Server* server = connection->server;
+    int maxRequests = serverSetting(server, keepAliveMaxRequests);
+    if (!server->shouldRun) {
+        return false;
+    }
+    if (connection->status.requestsHandled >= maxRequests) {
+        return false;
+    }
+    /* If we didn't read the whole request we don't know where the next one starts. That includes bodies with a
+     Transfer-Encoding other than chunked, which we don't decode */
+    if (RequestParseStateDone != connection->request.state || connection->request.warnings.bodyTruncated || connection->bodyRejected) {
+        return false;
+    }
+    if (NULL != headerInRequestByID(HeaderIDTransferEncoding, &connection->request) && !connection->request.bodyChunked) {
+        return false;
+    }
+    return requestWantsKeepAlive(&connection->request);
+}
+
+/* The headers are in and the request has a body. Let server->requestBodyCheck turn it down, and answer
+ "Expect: 100-continue" if it doesn't. Returns false if the body was turned down */
+static bool connectionRequestBodyCheck(struct Connection* connection) {
+    struct Server* server = connection->server;
+    struct Request* request = &connection->request;
+    if (NULL != server && NULL != server->requestBodyCheck) {
+        struct Arena* previousArena = connectionArenaEnter(connection);
+        struct Response* response = server->requestBodyCheck(request, connection);
+        connectionArenaLeave(previousArena);
+        if (NULL != response) {
+            ews_printf_debug("%s:%s: The request body for %s was turned down with %d %s\n", connection->remoteHost, connection->remotePort, request->path, response->code, response->status);
+            connection->bodyRejectedResponse = response;
+            connection->bodyRejected = true;
+            request->state = RequestParseStateDone;
+            return false;
+        }
+    }
+    const struct Header* expect = headerInRequestByID(HeaderIDExpect, request);
+    /* HTTP/1.0 clients don't know about 100 Continue */
+    if (NULL != expect && 0 == strcmp(request->version, "HTTP/1.1") && headerValueContainsToken(expect->value.contents, expect->value.length, "100-continue")) {
+        static const char continueResponse[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        /* if this doesn't make it the client sends the body after its own timeout anyway */
+        send(connection->socketfd, continueResponse, sizeof(continueResponse) - 1, 0);
+    }
+    return true;
+}
+
+/* The headers are in and the request has a body. If one of the server's bodyHandlers wants it, start streaming to it */
+static void connectionBodyHandlerStart(struct Connection* connection) {
+    struct Server* server = connection->server;
+    if (NULL == server || 0 == server->bodyHandlerCount) {
+        return;
+    }
+    struct Request* request = &connection->request;
+    char pathWithoutQuery[sizeof(request->path)];
+    size_t pathLength = strcspn(request->path, "?");
+    memcpy(pathWithoutQuery, request->path, pathLength);
+    pathWithoutQuery[pathLength] = '\0';
+    for (int i = 0; i < server->bodyHandlerCount; i++) {
+        const struct RequestBodyHandler* handler = &server->bodyHandlers[i];
+        if (requestMatchesPathPrefix(pathWithoutQuery, handler->pathPrefix, NULL)) {
+            connection->bodyHandler = handler;
+            connection->bodyHandlerReceived = 0;
+            connection->bodyHandlerContext = handler->bodyStart(request, connection);
+            return;
+        }
+    }
+}
+
+/* Hands the body bytes in data to the body handler and returns how many of them were part of this request's body */
+static size_t connectionBodyHandlerReceive(struct Connection* connection, const char* data, size_t length) {
+    struct Request* request = &connection->request;
+    if (request->bodyChunked) {
+        /* the parser takes care of the chunk framing and stops at each piece of chunk data for us to hand over */
+        size_t used = 0;
+        while (used < length && !requestParseFinished(request)) {
+            if (RequestParseStateChunkData != request->state) {
+                used += requestParseUntil(request, data + used, length - used, RequestParseStateChunkData);
+                continue;
+            }
+            size_t span = MIN(length - used, request->bodyChunkRemaining);
+            request->bodyChunkRemaining -= span;
+            connection->bodyHandlerReceived += span;
+            if (0 == request->bodyChunkRemaining) {
+                request->state = RequestParseStateChunkDataCR;
+            }
+            if (!connection->bodyHandler->bodyChunk(connection->bodyHandlerContext, request, data + used, span)) {
+                request->warnings.bodyTruncated = true;
+                request->state = RequestParseStateDone;
+                return length;
+            }
+            used += span;
+        }
+        return used;
+    }
+    size_t span = MIN(length, request->bodyExpectedLength - connection->bodyHandlerReceived);
+    if (span > 0) {
+        connection->bodyHandlerReceived += span;
+        if (!connection->bodyHandler->bodyChunk(connection->bodyHandlerContext, request, data, span)) {
+            /* we don't know where the next request starts now, so this is the last one */
+            request->warnings.bodyTruncated = true;
+            request->state = RequestParseStateDone;
+            return length;
+        }
+    }
+    if (connection->bodyHandlerReceived == request->bodyExpectedLength) {
+        request->state = RequestParseStateDone;
+    }
+    return span;
+}
+
+/* Gets the response from the body handler and detaches it from the connection */
+static struct Response* connectionBodyHandlerEnd(struct Connection* connection) {
+    const struct RequestBodyHandler* handler = connection->bodyHandler;
+    connection->bodyHandler = NULL;
+    bool bodyComplete = RequestParseStateDone == connection->request.state && !connection->request.warnings.bodyTruncated;
+    return handler->bodyEnd(connection->bodyHandlerContext, &connection->request, connection, bodyComplete);
+}
+
+/* Feeds length bytes at receiveBuffer + receiveOffset to the parser. If the request finished before the end, the rest is
+ a pipelined request and gets moved up to receiveOffset for next time */
+static void connectionParseReceived(struct Connection* connection, size_t length) {
+    struct Request* request = &connection->request;
+#if EWS_HEADER_SLICES
+    if (NULL == request->headerSlicesEnd && connection->receiveOffset > 0) {
+        /* nothing points into the buffer yet so this request can start at the front */
+        memmove(connection->receiveBuffer, connection->receiveBuffer + connection->receiveOffset, length);
+        connection->receiveOffset = 0;
+    }
+#endif
+    bool headersWereDone = requestParseStateIsBody(request->state) || requestParseFinished(request);
+    char* received = connection->receiveBuffer + connection->receiveOffset;
+    size_t consumed = 0;
+    if (!headersWereDone) {
+        /* stop at the start of the body so we can see whether it goes to a RequestBodyHandler */
+        consumed = requestParseUntil(request, received, length, RequestParseStateBody);
+#if EWS_HEADER_SLICES
+        if (RequestParseStateBody == request->state || RequestParseStateDone == request->state) {
+            requestTerminateHeaderSlices(request);
+        }
+#endif
+    }
+    if (requestParseStateIsBody(request->state) && !headersWereDone) {
+        request->bodySpillThreshold = NULL != connection->server ? connection->server->requestBodySpillThreshold : 0;
+        if (connectionRequestBodyCheck(connection)) {
+            connectionBodyHandlerStart(connection);
+        } else {
+            /* anything after the headers is the body we don't want */
+            consumed = length;
+        }
+    }
+    if (requestParseStateIsBody(request->state)) {
+        if (NULL != connection->bodyHandler) {
+            consumed += connectionBodyHandlerReceive(connection, received + consumed, length - consumed);
+        } else {
+            consumed += requestParse(request, received + consumed, length - consumed);
+        }
+    }
+    connection->pipelinedLength = length - consumed;
+    size_t keep = 0;
+#if EWS_HEADER_SLICES
+    /* everything up to the last header byte has to stay put. The request line and body were copied out so the next recv
+     can go right over them */
+    if (NULL != request->headerSlicesEnd) {
+        keep = request->headerSlicesEnd - connection->receiveBuffer;
+        if (request->headerSlicesEnd < received + consumed) {
+            /* we've seen the ':' or '\r' after the last slice, which is where its null character goes */
+            keep++;
+        }
+    }
+    connection->receiveOffset = keep;
+#endif
+    if (connection->pipelinedLength > 0) {
+        memmove(connection->receiveBuffer + keep, received + consumed, connection->pipelinedLength);
+    }
+}
+
+/* Where the next recv goes and how much it can take. Only called once any pipelined bytes have been parsed */
+static char* connectionReceiveSpace(struct Connection* connection, size_t* space) {
+    assert(0 == connection->pipelinedLength);
+#if EWS_HEADER_SLICES
+    if (NULL == connection->request.headerSlicesEnd) {
+        connection->receiveOffset = 0;
+        if (connection->receiveBuffer != connection->sendRecvBuffer) {
+            /* the request that needed the bigger buffer is gone */
+            free(connection->receiveBuffer);
+            connection->receiveBuffer = connection->sendRecvBuffer;
+            connection->receiveCapacity = connection->sendRecvBufferSize;
+        }
+    }
+    if (connection->receiveOffset == connection->receiveCapacity) {
+        connectionReceiveGrow(connection);
+    }
+#endif
+    *space = connection->receiveCapacity - connection->receiveOffset;
+    return connection->receiveBuffer + connection->receiveOffset;
+}
+
+/* Somewhere in sendRecvBuffer to stream a file through while responding, without clobbering a pipelined request */
+static char* connectionFileChunkBuffer(struct Connection* connection, size_t* capacity) {
+#if EWS_HEADER_SLICES
+    if (connection->receiveBuffer != connection->sendRecvBuffer) {
+        *capacity = connection->sendRecvBufferSize;
+        return connection->sendRecvBuffer;
+    }
+    if (connection->receiveOffset > 0) {
+        /* we're responding so the header slices aren't needed anymore - move the pipelined request to the front */
+        memmove(connection->sendRecvBuffer, connection->sendRecvBuffer + connection->receiveOffset, connection->pipelinedLength);
+        connection->receiveOffset = 0;
+    }
+#endif
+    *capacity = connection->sendRecvBufferSize - connection->pipelinedLength;
+    return connection->sendRecvBuffer + connection->pipelinedLength;
+}
+
+#if EWS_HEADER_SLICES
+/* The header names and values are followed by the ':' and '\r' that ended them. Once all the headers are in we write
+ null characters over those so the slices work as C strings just like headersStringPool strings do */
+static void requestTerminateHeaderSlices(struct Request* request) {
+    for (size_t i = 0; i < request->headersCount; i++) {
+        request->headers[i].name.contents[request->headers[i].name.length] = '\0';
+        request->headers[i].value.contents[request->headers[i].value.length] = '\0';
+    }
+}
+
+/* A request's headers filled the whole receive buffer. Move them to a buffer twice the size, or if we're already at
+ REQUEST_HEADER_SLICES_MAX_MEMORY, drop the header in progress and skip the rest like a full headersStringPool does */
+static void connectionReceiveGrow(struct Connection* connection) {
+    struct Request* request = &connection->request;
+    char* oldBuffer = connection->receiveBuffer;
+    if (connection->receiveCapacity < REQUEST_HEADER_SLICES_MAX_MEMORY) {
+        size_t capacity = MIN(connection->receiveCapacity * 2, (size_t) REQUEST_HEADER_SLICES_MAX_MEMORY);
+        char* newBuffer = (char*) malloc(capacity);
+        memcpy(newBuffer, oldBuffer, connection->receiveOffset);
+        for (size_t i = 0; i <= request->headersCount && i < request->headersCapacity; i++) {
+            struct Header* header = &request->headers[i];
+            if (NULL != header->name.contents) {
+                header->name.contents = newBuffer + (header->name.contents - oldBuffer);
+            }
+            if (NULL != header->value.contents) {
+                header->value.contents = newBuffer + (header->value.contents - oldBuffer);
+            }
+        }
+        request->headerSlicesEnd = newBuffer + (request->headerSlicesEnd - oldBuffer);
+        if (oldBuffer != connection->sendRecvBuffer) {
+            free(oldBuffer);
+        }
+        connection->receiveBuffer = newBuffer;
+        connection->receiveCapacity = capacity;
+        return;
+    }
+    request->warnings.headersStringPoolExhausted = true;
+    if (RequestParseStateHeaderName == request->state || RequestParseStateHeaderValue == request->state) {
+        request->state = RequestParseStateEatHeaders;
+    }
+    if (request->headersCount < request->headersCapacity) {
+        memset(&request->headers[request->headersCount], 0, sizeof(request->headers[0]));
+    }
+    /* keep the finished headers, unless they fill the buffer on their own */
+    request->headerSlicesEnd = NULL;
+    connection->receiveOffset = 0;
+    while (request->headersCount > 0) {
+        const struct PoolString* lastValue = &request->headers[request->headersCount - 1].value;
+        size_t end = lastValue->contents + lastValue->length + 1 - oldBuffer;
+        if (end < connection->receiveCapacity) {
+            request->headerSlicesEnd = lastValue->contents + lastValue->length;
+            connection->receiveOffset = end;
+            break;
+        }
+        request->headersCount--;
+        memset(&request->headers[request->headersCount], 0, sizeof(request->headers[0]));
+        for (int headerID = 0; headerID < HeaderIDCount; headerID++) {
+            if (request->headerIndexByID[headerID] > request->headersCount) {
+                request->headerIndexByID[headerID] = 0;
+            }
+        }
+    }
+}
+#endif
+
+/* The thread models' sockets have a short receive timeout, so a thread waiting on a quiet client wakes up this often to
+ check server->shouldRun and the connection's timeouts. serverStop never has to wait out a whole keep-alive timeout */
+#define CONNECTION_WAIT_SLICE_MILLISECONDS 500
+
+/* Has the connection been waiting on the client for longer than timeout allows since sinceMilliseconds? */
+static bool connectionWaitExpired(const struct Connection* connection, ConnectionTimeout timeout, int64_t sinceMilliseconds) {
+    int64_t timeoutMilliseconds = connectionTimeoutMilliseconds(connection->server, timeout);
+    return timeoutMilliseconds > 0 && monotonicMilliseconds() - sinceMilliseconds >= timeoutMilliseconds;
+}
+
+/* Reads one request, responds to it, and returns true if the connection should stay open for another one */
+static bool connectionHandleRequest(struct Connection* connection) {
+    /* first read the request + request body */
+    bool madeRequestPrintf = false;
+    bool foundRequest = false;
+    ssize_t bytesRead;
+    /* the header timeout runs from the start of the request (or the connection), the idle and body ones from the last
+     bytes we got */
+    ConnectionTimeout waitingFor = connectionReceiveTimeout(connection);
+    int64_t waitingSinceMilliseconds = monotonicMilliseconds();
+    while (1) {
+        if (connection->pipelinedLength > 0) {
+            /* the previous recv already picked up (the start of) this request */
+            bytesRead = (ssize_t) connection->pipelinedLength;
+        } else {
+            size_t space;
+            char* into = connectionReceiveSpace(connection, &space);
+            bytesRead = recv(connection->socketfd, into, space, 0);
+            if (bytesRead <= 0) {
+                /* CONNECTION_WAIT_SLICE_MILLISECONDS went by. Keep waiting unless they've been quiet too long, or the server
+                 is stopping and there's no request on the way - a request that has started gets to finish */
+                if (bytesRead < 0 && socketErrorIsTimeout()) {
+                    if (!connection->server->shouldRun && ConnectionTimeoutIdle == waitingFor) {
+                        connectionTimedOut(connection, ConnectionTimeoutNone);
+                        return false;
+                    }
+                    /* a thread pool worker sitting on an idle keep-alive connection while new ones queue up behind it
+                     lets the idle one go. The client just opens another connection if it has more to say */
+                    if (ConnectionTimeoutIdle == waitingFor && connectionQueueHasWaiting()) {
+                        ews_printf_debug("Closing idle keep-alive connection from %s:%s because there are connections waiting for a worker\n", connection->remoteHost, connection->remotePort);
+                        return false;
+                    }
+                    if (!connectionWaitExpired(connection, waitingFor, waitingSinceMilliseconds)) {
+                        continue;
+                    }
+                    connectionTimedOut(connection, waitingFor);
+                    return false;
+                }
+                break;
+            }
+            if (OptionPrintWholeRequest) {
+                fwrite(into, 1, bytesRead, stdout);
+            }
+            connection->status.bytesReceived += bytesRead;
+        }
+        connectionParseReceived(connection, (size_t) bytesRead);
+        if (connection->request.state >= RequestParseStateVersion && !madeRequestPrintf) {
+            ews_printf_debug("Request from %s:%s: %s to %s HTTP version %s\n",
+                   connection->remoteHost,
+                   connection->remotePort,
+                   connection->request.method,
+                   connection->request.path,
+                   connection->request.version);
+            madeRequestPrintf = true;
+        }
+        if (requestParseFinished(&connection->request)) {
+            foundRequest = true;
+            break;
+        }
+        ConnectionTimeout nowWaitingFor = connectionReceiveTimeout(connection);
+        if (nowWaitingFor != waitingFor || ConnectionTimeoutBody == nowWaitingFor) {
+            waitingFor = nowWaitingFor;
+            waitingSinceMilliseconds = monotonicMilliseconds();
+        } else if (ConnectionTimeoutHeader == waitingFor && connectionWaitExpired(connection, waitingFor, waitingSinceMilliseconds)) {
+            /* a client trickling its headers in a byte at a time never lets the receive timeout go off */
+            connectionTimedOut(connection, waitingFor);
+            return false;
+        }
+#ifdef EWS_FUZZ_TESTING /* This enables us to fuzz test different content lengths */
+        if (connection->request.state == RequestParseStateBody) {
+            foundRequest = true;
+        }
+#endif
+    }
+    if (!foundRequest) {
+        if (connection->status.requestsHandled > 0 && 0 == connection->request.methodLength) {
+            ews_printf_debug("Keep-alive connection from %s:%s closed after %" PRId64 " requests\n", connection->remoteHost, connection->remotePort, connection->status.requestsHandled);
+        } else {
+            ews_printf("No request found from %s:%s? Closing connection. Here's the last bytes we received in the request (length %" PRIi64 "). The total bytes received on this connection: %" PRIi64 " :\n", connection->remoteHost, connection->remotePort, (int64_t) bytesRead, connection->status.bytesReceived);
+            if (bytesRead > 0) {
+                fwrite(connection->receiveBuffer + connection->receiveOffset, 1, bytesRead, stdout);
+            }
+        }
+        return false;
+    }
+    requestPrintWarnings(&connection->request, connection->remoteHost, connection->remotePort);
+    ssize_t bytesSent = 0;
+    connectionRequestStarted(connection);
+    struct Response* response = createResponseForRequestAutoreleased(&connection->request, connection);
+    if (NULL == response) {
+        ews_printf("%s:%s: You have returned a NULL response - I'm assuming you took over the request handling yourself.\n", connection->remoteHost, connection->remotePort);
+        return false;
+    }
+    connection->status.requestsHandled++;
+    connection->keepAlive = connectionShouldKeepAlive(connection);
+    int result = sendResponse(connection, response, &bytesSent);
+    if (0 == result) {
+        ews_printf_debug("%s:%s: Responded with HTTP %d %s length %" PRId64 "\n", connection->remoteHost, connection->remotePort, response->code, response->status, (int64_t)bytesSent);
+    } else {
+        /* sendResponse already printed something out, don't add another ews_printf */
+        connection->keepAlive = false;
+    }
+    responseFree(response);
+    connectionRequestFinished(connection);
+    connection->status.bytesSent += bytesSent;
+    return connection->keepAlive;
+}
+
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 connectionHandlerThread(void* connectionPointer) {
+    struct Connection* connection = (struct Connection*) connectionPointer;
+    connectionStarted(connection);
+    socketSetTimeout(connection->socketfd, SO_RCVTIMEO, CONNECTION_WAIT_SLICE_MILLISECONDS);
+    int sendTimeoutSeconds = serverSettingUnlessOff(connection->server, sendTimeoutSeconds);
+    if (sendTimeoutSeconds > 0) {
+        socketSetTimeout(connection->socketfd, SO_SNDTIMEO, sendTimeoutSeconds * 1000);
+    }
+    while (connectionHandleRequest(connection)) {
+        requestReset(&connection->request);
+    }
+    /* Alright - we're done */
+    connectionFinished(connection);
+    return (THREAD_RETURN_TYPE) NULL;
+}
+
+#if EWS_EVENT_LOOP_SUPPORTED
+/* ServerModelEventLoop - one thread watches every socket with epoll. The client sockets stay in blocking mode and we pass
+ MSG_DONTWAIT instead, so a createResponseForRequest that takes over the connection and calls send() itself still works */
+#define EVENT_LOOP_MAX_EVENTS 64
+
+/* The epoll instance plus the connections waiting on their clients */
+struct EventLoop {
+    struct Server* server;
+    sockettype listenerfd;
+    int epollfd;
+    struct ConnectionTimers timers;
+};
+
+static void connectionTimerStop(struct ConnectionTimers* timers, struct Connection* connection) {
+    ConnectionTimeout timeout = connection->timeout;
+    if (ConnectionTimeoutNone == timeout) {
+        return;
+    }
+    if (NULL != connection->timeoutPrevious) {
+        connection->timeoutPrevious->timeoutNext = connection->timeoutNext;
+    } else {
+        timers->head[timeout] = connection->timeoutNext;
+    }
+    if (NULL != connection->timeoutNext) {
+        connection->timeoutNext->timeoutPrevious = connection->timeoutPrevious;
+    } else {
+        timers->tail[timeout] = connection->timeoutPrevious;
+    }
+    connection->timeoutNext = NULL;
+    connection->timeoutPrevious = NULL;
+    connection->timeout = ConnectionTimeoutNone;
+}
+
+/* Starts (or restarts) the clock on the connection waiting for timeout. The header timeout is for the whole request
+ line and headers, so it keeps running when more of them come in */
+static void connectionTimerStart(struct ConnectionTimers* timers, struct Connection* connection, ConnectionTimeout timeout) {
+    if (ConnectionTimeoutHeader == timeout && ConnectionTimeoutHeader == connection->timeout) {
+        return;
+    }
+    connectionTimerStop(timers, connection);
+    if (0 == connectionTimeoutMilliseconds(connection->server, timeout)) {
+        return;
+    }
+    connection->timeout = timeout;
+    connection->timeoutSinceMilliseconds = monotonicMilliseconds();
+    connection->timeoutNext = NULL;
+    connection->timeoutPrevious = timers->tail[timeout];
+    if (NULL != timers->tail[timeout]) {
+        timers->tail[timeout]->timeoutNext = connection;
+    } else {
+        timers->head[timeout] = connection;
+    }
+    timers->tail[timeout] = connection;
+}
+
+/* Removes and returns the next connection that has waited too long, or NULL if there isn't one. *timeout says which
+ one it was. When the server is stopping idle keep-alive connections go right away, with ConnectionTimeoutNone */
+static struct Connection* connectionTimersExpire(struct ConnectionTimers* timers, const struct Server* server, ConnectionTimeout* timeout) {
+    int64_t now = monotonicMilliseconds();
+    for (int i = ConnectionTimeoutNone + 1; i < ConnectionTimeoutCount; i++) {
+        struct Connection* connection = timers->head[i];
+        if (NULL == connection) {
+            continue;
+        }
+        bool stopping = ConnectionTimeoutIdle == i && !server->shouldRun;
+        if (stopping || now - connection->timeoutSinceMilliseconds >= connectionTimeoutMilliseconds(server, (ConnectionTimeout) i)) {
+            connectionTimerStop(timers, connection);
+            *timeout = stopping ? ConnectionTimeoutNone : (ConnectionTimeout) i;
+            return connection;
+        }
+    }
+    return NULL;
+}
+
+static void eventLoopConnectionFinished(struct EventLoop* loop, struct Connection* connection) {
+    connectionTimerStop(&loop->timers, connection);
+    connectionFinished(connection);
+}
+
+/* Closes connections that have waited on their clients for too long, and idle keep-alive connections if the server
+ is stopping */
+static void eventLoopTimersExpire(struct EventLoop* loop) {
+    struct Connection* connection;
+    ConnectionTimeout timeout;
+    while (NULL != (connection = connectionTimersExpire(&loop->timers, loop->server, &timeout))) {
+        connectionTimedOut(connection, timeout);
+        connectionFinished(connection);
+    }
+}
+
+typedef enum {
+    ConnectionOutputDone,
+    ConnectionOutputWouldBlock,
+    ConnectionOutputFailed
+} ConnectionOutputResult;
+
+/* Sends as much of the rest of the header and the rest of second[*secondSent..secondLength) as the socket will take
+ right now, both in the same syscall */
+static ConnectionOutputResult connectionOutputSend(struct Connection* connection, const char* second, size_t secondLength, size_t* secondSent) {
+    struct ConnectionOutput* output = &connection->output;
+    while (output->headerSent < output->headerLength || *secondSent < secondLength) {
+        const char* header = connection->responseHeader + output->headerSent;
+        size_t headerLength = output->headerLength - output->headerSent;
+        ssize_t sendResult = sendTwoBuffers(connection->socketfd, header, headerLength, second + *secondSent, secondLength - *secondSent, MSG_DONTWAIT);
+        if (sendResult < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                return ConnectionOutputWouldBlock;
+            }
+            ews_printf("Failed to respond to %s:%s. send returned %ld with %s = %d\n", connection->remoteHost, connection->remotePort, (long) sendResult, strerror(errno), errno);
+            return ConnectionOutputFailed;
+        }
+        size_t headerPart = MIN((size_t) sendResult, headerLength);
+        if (OptionPrintResponse) {
+            fwrite(header, 1, headerPart, stdout);
+            fwrite(second + *secondSent, 1, sendResult - headerPart, stdout);
+        }
+        output->headerSent += headerPart;
+        *secondSent += sendResult - headerPart;
+        connection->status.bytesSent += sendResult;
+    }
+    return ConnectionOutputDone;
+}
+
+/* Takes ownership of response. Formats the header and opens the file (if there is one) so connectionOutputContinue
+ can write everything out */
+static void connectionOutputStart(struct Connection* connection, struct Response* response) {
+    struct ConnectionOutput* output = &connection->output;
+    const char* contentType = response->contentType;
+    size_t contentLength = response->body.length;
+    if (0 == response->body.length && NULL != response->filenameToSend) {
+        long fileLength = 0;
+        struct Response* errorResponse = responseFileOpen(connection, response, &output->fp, &contentType, &fileLength);
+        if (NULL != errorResponse) {
+            ews_printf("Instead of satisfying the request for '%s' we encountered an error and will return %d %s\n", connection->request.path, errorResponse->code, errorResponse->status);
+            if (NULL != output->fp) {
+                fclose(output->fp);
+                output->fp = NULL;
+            }
+            responseFree(response);
+            response = errorResponse;
+            contentType = response->contentType;
+            contentLength = response->body.length;
+        } else {
+            contentLength = (size_t) fileLength;
+        }
+    }
+    output->response = response;
+    int headerLength = snprintfResponseHeader(connection->responseHeader, sizeof(connection->responseHeader), response->code, response->status, contentType, response->extraHeaders, contentLength, connection->keepAlive);
+    output->headerLength = MIN((size_t) headerLength, sizeof(connection->responseHeader) - 1);
+}
+
+static ConnectionOutputResult connectionOutputContinue(struct Connection* connection) {
+    struct ConnectionOutput* output = &connection->output;
+    ConnectionOutputResult result;
+    if (NULL == output->fp) {
+        return connectionOutputSend(connection, output->response->body.contents, output->response->body.length, &output->bodySent);
+    }
+    /* stream the file through sendRecvBuffer (after any pipelined request), the first chunk going out with the header.
+     A chunk that the socket only partially took stays in the buffer until next time */
+    size_t chunkCapacity;
+    char* chunk = connectionFileChunkBuffer(connection, &chunkCapacity);
+    while (1) {
+        if (output->chunkSent == output->chunkLength) {
+            output->chunkLength = fread(chunk, 1, chunkCapacity, output->fp);
+            output->chunkSent = 0;
+            if (0 == output->chunkLength) {
+                if (ferror(output->fp)) {
+                    ews_printf("Unable to finish the request for '%s' because there was an error freading '%s' %s = %d\n", connection->request.path, output->response->filenameToSend, strerror(errno), errno);
+                    return ConnectionOutputFailed;
+                }
+                /* an empty file still needs its header */
+                return connectionOutputSend(connection, NULL, 0, &output->chunkSent);
+            }
+        }
+        result = connectionOutputSend(connection, chunk, output->chunkLength, &output->chunkSent);
+        if (ConnectionOutputDone != result) {
+            return result;
+        }
+    }
+}
+
+static bool eventLoopWatch(struct EventLoop* loop, struct Connection* connection, uint32_t events) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = connection;
+    if (0 == epoll_ctl(loop->epollfd, EPOLL_CTL_MOD, connection->socketfd, &event)) {
+        return true;
+    }
+    ews_printf("epoll_ctl(EPOLL_CTL_MOD) failed for %s:%s %s = %d. Closing the connection\n", connection->remoteHost, connection->remotePort, strerror(errno), errno);
+    return false;
+}
+
+/* The response went out on a keep-alive connection - throw away the old request and wait for the next one */
+static bool eventLoopConnectionReuse(struct EventLoop* loop, struct Connection* connection) {
+    struct ConnectionOutput* output = &connection->output;
+    if (NULL != output->fp) {
+        fclose(output->fp);
+    }
+    responseFree(output->response);
+    memset(output, 0, sizeof(*output));
+    requestReset(&connection->request);
+    if (!eventLoopWatch(loop, connection, EPOLLIN)) {
+        return false;
+    }
+    connectionTimerStart(&loop->timers, connection, ConnectionTimeoutIdle);
+    return true;
+}
+
+/* Returns true if the whole response went out and the connection is ready for its next request. Otherwise the
+ connection is either waiting for EPOLLOUT or it has been closed and freed */
+static bool eventLoopWrite(struct EventLoop* loop, struct Connection* connection) {
+    ConnectionOutputResult result = connectionOutputContinue(connection);
+    if (ConnectionOutputWouldBlock == result) {
+        /* come back when the socket has drained. The client gets sendTimeoutSeconds from now to take some more */
+        if (eventLoopWatch(loop, connection, EPOLLOUT)) {
+            connectionTimerStart(&loop->timers, connection, ConnectionTimeoutSend);
+            return false;
+        }
+    } else if (ConnectionOutputDone == result) {
+        ews_printf_debug("%s:%s: Responded with HTTP %d %s length %" PRId64 "\n", connection->remoteHost, connection->remotePort, connection->output.response->code, connection->output.response->status, connection->status.bytesSent);
+        connectionTimerStop(&loop->timers, connection);
+        connectionRequestFinished(connection);
+        if (connection->keepAlive && eventLoopConnectionReuse(loop, connection)) {
+            return true;
+        }
+    }
+    eventLoopConnectionFinished(loop, connection);
+    return false;
+}
+
+/* Same return value as eventLoopWrite */
+static bool eventLoopRespond(struct EventLoop* loop, struct Connection* connection) {
+    requestPrintWarnings(&connection->request, connection->remoteHost, connection->remotePort);
+    connectionRequestStarted(connection);
+    struct Response* response = createResponseForRequestAutoreleased(&connection->request, connection);
+    if (NULL == response) {
+        ews_printf("%s:%s: You have returned a NULL response - I'm assuming you took over the request handling yourself.\n", connection->remoteHost, connection->remotePort);
+        eventLoopConnectionFinished(loop, connection);
+        return false;
+    }
+    connection->status.requestsHandled++;
+    connection->keepAlive = connectionShouldKeepAlive(connection);
+    connectionOutputStart(connection, response);
+    return eventLoopWrite(loop, connection);
+}
+
+/* Reads whatever has arrived and feeds it to the parser. Once a request is complete we respond, and if the client
+ pipelined more requests behind it we answer those right away without going back to epoll */
+static void eventLoopRead(struct EventLoop* loop, struct Connection* connection) {
+    while (1) {
+        size_t length = connection->pipelinedLength;
+        if (0 == length) {
+            size_t space;
+            char* into = connectionReceiveSpace(connection, &space);
+            ssize_t bytesRead = recv(connection->socketfd, into, space, MSG_DONTWAIT);
+            if (bytesRead < 0 && EINTR == errno) {
+                continue;
+            }
+            if (bytesRead < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+                return;
+            }
+            if (bytesRead <= 0) {
+                if (connection->status.requestsHandled > 0 && 0 == connection->request.methodLength) {
+                    ews_printf_debug("Keep-alive connection from %s:%s closed after %" PRId64 " requests\n", connection->remoteHost, connection->remotePort, connection->status.requestsHandled);
+                } else {
+                    ews_printf("No request found from %s:%s? Closing connection. The total bytes received on this connection: %" PRIi64 "\n", connection->remoteHost, connection->remotePort, connection->status.bytesReceived);
+                }
+                eventLoopConnectionFinished(loop, connection);
+                return;
+            }
+            if (OptionPrintWholeRequest) {
+                fwrite(into, 1, bytesRead, stdout);
+            }
+            connection->status.bytesReceived += bytesRead;
+            length = (size_t) bytesRead;
+        }
+        connectionParseReceived(connection, length);
+        if (!requestParseFinished(&connection->request)) {
+            connectionTimerStart(&loop->timers, connection, connectionReceiveTimeout(connection));
+            continue;
+        }
+        connectionTimerStop(&loop->timers, connection);
+        if (!eventLoopRespond(loop, connection)) {
+            return;
+        }
+        if (0 == connection->pipelinedLength) {
+            /* nothing else buffered - wait for EPOLLIN */
+            return;
+        }
+    }
+}
+
+static void eventLoopAccept(struct EventLoop* loop) {
+    struct Server* server = loop->server;
+    while (server->shouldRun) {
+        struct sockaddr_storage remoteAddr;
+        socklen_t remoteAddrLength = sizeof(remoteAddr);
+        sockettype socketfd = accept(loop->listenerfd, (struct sockaddr*) &remoteAddr, &remoteAddrLength);
+        if (-1 == socketfd) {
+            if (EINTR == errno) {
+                continue;
+            }
+            if (EAGAIN != errno && EWOULDBLOCK != errno) {
+                ews_printf("accept failed in the event loop %s = %d. Continuing if server.shouldRun is true...\n", strerror(errno), errno);
+            }
+            return;
+        }
+        if (!connectionAdmit(server, socketfd)) {
+            continue;
+        }
+        struct Connection* connection = connectionAllocAdmitted(server, socketfd, &remoteAddr, remoteAddrLength);
+        if (NULL == connection) {
+            continue;
+        }
+        connectionStarted(connection);
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = connection;
+        if (0 != epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, socketfd, &event)) {
+            ews_printf("epoll_ctl(EPOLL_CTL_ADD) failed for %s:%s %s = %d. Closing the connection\n", connection->remoteHost, connection->remotePort, strerror(errno), errno);
+            connectionFinished(connection);
+            continue;
+        }
+        connectionTimerStart(&loop->timers, connection, ConnectionTimeoutHeader);
+    }
+}
+
+static void eventLoopRun(struct Server* server, sockettype listenerfd) {
+    struct EventLoop loop;
+    memset(&loop, 0, sizeof(loop));
+    loop.server = server;
+    loop.listenerfd = listenerfd;
+    loop.epollfd = epoll_create1(0);
+    if (-1 == loop.epollfd) {
+        ews_printf("epoll_create1 failed with %s = %d. Falling back to a thread per connection...\n", strerror(errno), errno);
+        acceptConnectionsThreadPerConnection(server, listenerfd);
+        return;
+    }
+    /* the listener is non-blocking so we can accept until EAGAIN every time it's readable */
+    int listenerFlags = fcntl(listenerfd, F_GETFL, 0);
+    fcntl(listenerfd, F_SETFL, listenerFlags | O_NONBLOCK);
+    struct epoll_event listenerEvent;
+    memset(&listenerEvent, 0, sizeof(listenerEvent));
+    listenerEvent.events = EPOLLIN;
+    listenerEvent.data.ptr = NULL; // connections have a non-NULL ptr
+    if (0 != epoll_ctl(loop.epollfd, EPOLL_CTL_ADD, listenerfd, &listenerEvent)) {
+        ews_printf("epoll_ctl could not watch the listener socket %s = %d. Not accepting any connections\n", strerror(errno), errno);
+        close(loop.epollfd);
+        return;
+    }
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    bool listening = true;
+    while (1) {
+        if (listening && !server->shouldRun) {
+            /* serverStop probably closed the listener already, which drops it from the epoll set */
+            epoll_ctl(loop.epollfd, EPOLL_CTL_DEL, listenerfd, &listenerEvent);
+            listening = false;
+        }
+        eventLoopTimersExpire(&loop);
+        if (!listening) {
+            /* keep serving the connections we already have just like the threads would */
+            pthread_mutex_lock(&server->connectionFinishedLock);
+            int activeConnectionCount = server->activeConnectionCount;
+            pthread_mutex_unlock(&server->connectionFinishedLock);
+            if (0 == activeConnectionCount) {
+                break;
+            }
+        }
+        /* wake up every once in a while to check server->shouldRun */
+        int eventCount = epoll_wait(loop.epollfd, events, EVENT_LOOP_MAX_EVENTS, 1000);
+        if (-1 == eventCount) {
+            if (EINTR == errno) {
+                continue;
+            }
+            ews_printf("exiting the event loop because epoll_wait failed %s = %d\n", strerror(errno), errno);
+            break;
+        }
+        for (int i = 0; i < eventCount; i++) {
+            struct Connection* connection = (struct Connection*) events[i].data.ptr;
+            if (NULL == connection) {
+                if (listening) {
+                    eventLoopAccept(&loop);
+                }
+            } else if (NULL != connection->output.response) {
+                if (eventLoopWrite(&loop, connection) && connection->pipelinedLength > 0) {
+                    eventLoopRead(&loop, connection);
+                }
+            } else {
+                eventLoopRead(&loop, connection);
+            }
+        }
+    }
+    close(loop.epollfd);
+}
+#endif // EWS_EVENT_LOOP_SUPPORTED
+
+#if EWS_IO_URING_SUPPORTED
+/* ServerModelIOUring - works like the event loop, but instead of asking epoll which sockets are ready and then making a
+ syscall for every accept/recv/send/fread, we queue those operations up in io_uring's submission ring and hand the whole
+ batch to the kernel with one io_uring_enter, which also waits for whatever finished. We talk to the kernel with syscall()
+ and the ring layout from <linux/io_uring.h> so there's no liburing dependency. Needs Linux 5.6 (IORING_REGISTER_PROBE) */
+#define IO_URING_ENTRIES 256
+/* user_data for the operations that don't belong to a connection. Connection pointers are never this small */
+#define IO_URING_ACCEPT_TAG 1
+#define IO_URING_TIMEOUT_TAG 2
+#define IO_URING_CANCEL_TAG 3
+
+struct IOUring {
+    struct Server* server;
+    sockettype listenerfd;
+    int ringfd;
+    /* the submission queue: the kernel consumes from sqHead, we produce at sqTail */
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    /* the completion queue: the kernel produces at cqTail, we consume from cqHead */
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned toSubmit;
+    /* ioUringEnter, unless a test wants io_uring_enter to fail */
+    int (*enter)(int ringfd, unsigned toSubmit, unsigned minComplete, unsigned flags);
+    /* the pending accept writes the client address here */
+    struct sockaddr_storage acceptAddr;
+    socklen_t acceptAddrLength;
+    bool accepting;
+    bool acceptCancelled;
+    /* the once-a-second IORING_OP_TIMEOUT is queued */
+    bool timing;
+    /* connections waiting on their clients */
+    struct ConnectionTimers timers;
+    /* every connection this ring has an operation in flight for, so we can close them if io_uring_enter stops working */
+    struct Connection* connections;
+};
+
+static int ioUringSetup(unsigned entries, struct io_uring_params* params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int ringfd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, ringfd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int ioUringRegister(int ringfd, unsigned opcode, void* arg, unsigned argCount) {
+    return (int) syscall(__NR_io_uring_register, ringfd, opcode, arg, argCount);
+}
+
+static void ioUringDestroy(struct IOUring* ring) {
+    if (NULL != ring->sqes && MAP_FAILED != (void*) ring->sqes) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (NULL != ring->cqRing && MAP_FAILED != ring->cqRing && ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (NULL != ring->sqRing && MAP_FAILED != ring->sqRing) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->ringfd >= 0) {
+        close(ring->ringfd);
+    }
+}
+
+/* Sets up the rings and checks the kernel knows every operation we use. Returns false (with a reason printed) if we
+ should fall back to epoll */
+static bool ioUringInit(struct IOUring* ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->ringfd = ioUringSetup(IO_URING_ENTRIES, &params);
+    if (ring->ringfd < 0) {
+        ews_printf("io_uring_setup failed with %s = %d\n", strerror(errno), errno);
+        return false;
+    }
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sqRingSize = MAX(ring->sqRingSize, ring->cqRingSize);
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == ring->sqRing) {
+        ews_printf("mmap of the io_uring submission queue failed with %s = %d\n", strerror(errno), errno);
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == ring->cqRing) {
+            ews_printf("mmap of the io_uring completion queue failed with %s = %d\n", strerror(errno), errno);
+            return false;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQES);
+    if (MAP_FAILED == (void*) ring->sqes) {
+        ews_printf("mmap of the io_uring submission entries failed with %s = %d\n", strerror(errno), errno);
+        return false;
+    }
+    char* sq = (char*) ring->sqRing;
+    char* cq = (char*) ring->cqRing;
+    ring->sqHead = (unsigned*) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sqEntries = *(unsigned*) (sq + params.sq_off.ring_entries);
+    ring->sqArray = (unsigned*) (sq + params.sq_off.array);
+    ring->cqHead = (unsigned*) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    ring->enter = ioUringEnter;
+    /* old kernels set up the ring just fine and then fail each operation they don't know, so ask up front */
+    const uint8_t requiredOperations[] = { IORING_OP_ACCEPT, IORING_OP_RECVMSG, IORING_OP_SENDMSG, IORING_OP_READV, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL };
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*) calloc(1, probeSize);
+    bool supported = 0 == ioUringRegister(ring->ringfd, IORING_REGISTER_PROBE, probe, 256);
+    if (!supported) {
+        ews_printf("io_uring can't tell us which operations it supports (IORING_REGISTER_PROBE failed with %s = %d)\n", strerror(errno), errno);
+    }
+    for (size_t i = 0; supported && i < sizeof(requiredOperations) / sizeof(requiredOperations[0]); i++) {
+        uint8_t operation = requiredOperations[i];
+        if (operation > probe->last_op || !(probe->ops[operation].flags & IO_URING_OP_SUPPORTED)) {
+            ews_printf("This kernel's io_uring doesn't support operation %d\n", (int) operation);
+            supported = false;
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+/* Hands everything queued so far to the kernel. If minComplete > 0 this also waits for that many completions. Returns
+ -1 if io_uring_enter failed for good */
+static int ioUringSubmit(struct IOUring* ring, unsigned minComplete) {
+    while (1) {
+        int result = ring->enter(ring->ringfd, ring->toSubmit, minComplete, minComplete > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (result >= 0) {
+            ring->toSubmit -= MIN((unsigned) result, ring->toSubmit);
+            return 0;
+        }
+        if (EINTR == errno) {
+            if (minComplete > 0) {
+                /* good enough - the caller will look at the completion queue and come back around */
+                return 0;
+            }
+            continue;
+        }
+        if (EAGAIN == errno || EBUSY == errno) {
+            /* the kernel wants us to reap completions before it takes more */
+            return 0;
+        }
+        ews_printf("io_uring_enter failed with %s = %d\n", strerror(errno), errno);
+        return -1;
+    }
+}
+
+/* Returns NULL if the submission queue is full and the kernel won't take any of it right now. That happens while it has
+ completions we haven't reaped (EBUSY), and we're usually in the middle of reaping them, so waiting here never ends */
+static struct io_uring_sqe* ioUringNextSQE(struct IOUring* ring) {
+    unsigned tail = *ring->sqTail;
+    if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+        /* the submission queue is full, so flush it out to the kernel */
+        if (0 != ioUringSubmit(ring, 0) || tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+            return NULL;
+        }
+    }
+    unsigned index = tail & ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+    return sqe;
+}
+
+static void ioUringQueueAccept(struct IOUring* ring) {
+    struct io_uring_sqe* sqe = ioUringNextSQE(ring);
+    if (NULL == sqe) {
+        ring->accepting = false;
+        return;
+    }
+    ring->acceptAddrLength = sizeof(ring->acceptAddr);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->listenerfd;
+    sqe->addr = (uint64_t) (uintptr_t) &ring->acceptAddr;
+    sqe->addr2 = (uint64_t) (uintptr_t) &ring->acceptAddrLength;
+    sqe->user_data = IO_URING_ACCEPT_TAG;
+    ring->accepting = true;
+}
+
+/* Wakes io_uring_enter up every second so we notice server->shouldRun and expire idle connections */
+static void ioUringQueueTimeout(struct IOUring* ring) {
+    static struct __kernel_timespec oneSecond = { 1, 0 };
+    struct io_uring_sqe* sqe = ioUringNextSQE(ring);
+    if (NULL == sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) (uintptr_t) &oneSecond;
+    sqe->len = 1;
+    sqe->user_data = IO_URING_TIMEOUT_TAG;
+    ring->timing = true;
+}
+
+static void ioUringQueueCancelAccept(struct IOUring* ring) {
+    struct io_uring_sqe* sqe = ioUringNextSQE(ring);
+    if (NULL == sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = IO_URING_ACCEPT_TAG;
+    sqe->user_data = IO_URING_CANCEL_TAG;
+    ring->acceptCancelled = true;
+}
+
+/* Queues a connection's recvmsg/sendmsg/readv. Returns false if there was no room, in which case the caller closes it */
+static bool ioUringQueueConnection(struct IOUring* ring, struct Connection* connection, IOUringOperationType type, uint8_t opcode, int fd, int bufferCount, uint64_t offset) {
+    struct IOUringOperation* operation = &connection->ioUringOperation;
+    struct io_uring_sqe* sqe = ioUringNextSQE(ring);
+    if (NULL == sqe) {
+        return false;
+    }
+    operation->type = type;
+    memset(&operation->message, 0, sizeof(operation->message));
+    operation->message.msg_iov = operation->buffers;
+    operation->message.msg_iovlen = bufferCount;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    if (IORING_OP_READV == opcode) {
+        sqe->addr = (uint64_t) (uintptr_t) operation->buffers;
+        sqe->len = bufferCount;
+        sqe->off = offset;
+    } else {
+        sqe->addr = (uint64_t) (uintptr_t) &operation->message;
+        sqe->len = 1;
+        sqe->msg_flags = (IORING_OP_SENDMSG == opcode) ? MSG_NOSIGNAL : 0;
+    }
+    sqe->user_data = (uint64_t) (uintptr_t) connection;
+    return true;
+}
+
+static bool ioUringQueueRecv(struct IOUring* ring, struct Connection* connection) {
+    size_t space;
+    connection->ioUringOperation.buffers[0].iov_base = connectionReceiveSpace(connection, &space);
+    connection->ioUringOperation.buffers[0].iov_len = space;
+    return ioUringQueueConnection(ring, connection, IOUringOperationRecv, IORING_OP_RECVMSG, connection->socketfd, 1, 0);
+}
+
+static void ioUringConnectionAdd(struct IOUring* ring, struct Connection* connection) {
+    connection->ioUringOperation.ringPrevious = NULL;
+    connection->ioUringOperation.ringNext = ring->connections;
+    if (NULL != ring->connections) {
+        ring->connections->ioUringOperation.ringPrevious = connection;
+    }
+    ring->connections = connection;
+}
+
+static void ioUringConnectionFinished(struct IOUring* ring, struct Connection* connection) {
+    struct IOUringOperation* operation = &connection->ioUringOperation;
+    if (NULL != operation->ringPrevious) {
+        operation->ringPrevious->ioUringOperation.ringNext = operation->ringNext;
+    } else {
+        ring->connections = operation->ringNext;
+    }
+    if (NULL != operation->ringNext) {
+        operation->ringNext->ioUringOperation.ringPrevious = operation->ringPrevious;
+    }
+    connectionTimerStop(&ring->timers, connection);
+    connectionFinished(connection);
+}
+
+static void ioUringRespond(struct IOUring* ring, struct Connection* connection);
+
+/* Queues whatever the response needs next: the next chunk of the file, or the rest of the header along with the rest of
+ the body/chunk. Once everything is out we move on to the next request */
+static void ioUringSendNext(struct IOUring* ring, struct Connection* connection) {
+    struct ConnectionOutput* output = &connection->output;
+    struct IOUringOperation* operation = &connection->ioUringOperation;
+    size_t chunkCapacity;
+    char* chunk = connectionFileChunkBuffer(connection, &chunkCapacity);
+    if (NULL != output->fp && !output->fileDone && output->chunkSent == output->chunkLength) {
+        operation->buffers[0].iov_base = chunk;
+        operation->buffers[0].iov_len = chunkCapacity;
+        if (!ioUringQueueConnection(ring, connection, IOUringOperationRead, IORING_OP_READV, fileno(output->fp), 1, (uint64_t) output->fileOffset)) {
+            ioUringConnectionFinished(ring, connection);
         }
-        if (OptionPrintResponse) {
-            fwrite(connection->sendRecvBuffer, 1, bytesRead, stdout);
+        return;
+    }
+    const char* second = output->response->body.contents + output->bodySent;
+    size_t secondLength = output->response->body.length - output->bodySent;
+    if (NULL != output->fp) {
+        second = chunk + output->chunkSent;
+        secondLength = output->chunkLength - output->chunkSent;
+    }
+    if (output->headerSent < output->headerLength || secondLength > 0) {
+        operation->buffers[0].iov_base = connection->responseHeader + output->headerSent;
+        operation->buffers[0].iov_len = output->headerLength - output->headerSent;
+        operation->buffers[1].iov_base = (void*) second;
+        operation->buffers[1].iov_len = secondLength;
+        if (!ioUringQueueConnection(ring, connection, IOUringOperationSend, IORING_OP_SENDMSG, connection->socketfd, 2, 0)) {
+            ioUringConnectionFinished(ring, connection);
+            return;
         }
+        connectionTimerStart(&ring->timers, connection, ConnectionTimeoutSend);
+        return;
+    }
+    ews_printf_debug("%s:%s: Responded with HTTP %d %s length %" PRId64 "\n", connection->remoteHost, connection->remotePort, output->response->code, output->response->status, connection->status.bytesSent);
+    connectionRequestFinished(connection);
+    if (!connection->keepAlive) {
+        ioUringConnectionFinished(ring, connection);
+        return;
+    }
+    if (NULL != output->fp) {
+        fclose(output->fp);
+    }
+    responseFree(output->response);
+    memset(output, 0, sizeof(*output));
+    requestReset(&connection->request);
+    ioUringRespond(ring, connection);
+}
 
-        *bytesSent = *bytesSent + sendResult;
+/* Parses whatever is in the receive buffer (pipelined bytes or what the last recv got) and responds if a request is done.
+ Otherwise we go back to waiting for more bytes */
+static void ioUringRespond(struct IOUring* ring, struct Connection* connection) {
+    if (!requestParseFinished(&connection->request) && connection->pipelinedLength > 0) {
+        connectionParseReceived(connection, connection->pipelinedLength);
     }
-exit:
-    if (NULL != fp) {
-        fclose(fp);
+    if (!requestParseFinished(&connection->request)) {
+        connectionTimerStart(&ring->timers, connection, connectionReceiveTimeout(connection));
+        if (!ioUringQueueRecv(ring, connection)) {
+            ioUringConnectionFinished(ring, connection);
+        }
+        return;
     }
-    if (NULL != errorResponse) {
-        ews_printf("Instead of satisfying the request for '%s' we encountered an error and will return %d %s\n", connection->request.path, response->code, response->status);
-        ssize_t errorBytesSent = 0;
-        result = sendResponseBody(connection, errorResponse, &errorBytesSent);
-        *bytesSent = *bytesSent + errorBytesSent;
-        return result;
+    connectionTimerStop(&ring->timers, connection);
+    requestPrintWarnings(&connection->request, connection->remoteHost, connection->remotePort);
+    connectionRequestStarted(connection);
+    struct Response* response = createResponseForRequestAutoreleased(&connection->request, connection);
+    if (NULL == response) {
+        ews_printf("%s:%s: You have returned a NULL response - I'm assuming you took over the request handling yourself.\n", connection->remoteHost, connection->remotePort);
+        ioUringConnectionFinished(ring, connection);
+        return;
     }
-    return result;
+    connection->status.requestsHandled++;
+    connection->keepAlive = connectionShouldKeepAlive(connection);
+    connectionOutputStart(connection, response);
+    ioUringSendNext(ring, connection);
 }
 
-static struct Response* createResponseForRequestAutoreleased(const struct Request* request, struct Connection* connection) {
-    /* Objective-C users of this library have a high probability of creating Objective-C objects.
-     Some Objective-C objects are autoreleased. Objective-C relies on reference counting for
-     object memory management. Each object has a reference count. An object can be added to an
-     autoreleasepool to be released when the pool is drained/dealloc'd. Since most users of 
-     Objective-C will probably want to create autoreleased objects (many constructors 
-     create them by default), we automatically add an autoreleasepool around every call to 
-     createResponseForRequest. If Objective-C is not in use, then autorelease is not in use */
-#ifdef __OBJC__
-    @autoreleasepool {
-#endif
-        return createResponseForRequest(request, connection);
-#ifdef __OBJC__
+static void ioUringCompleted(struct IOUring* ring, struct Connection* connection, int result) {
+    struct ConnectionOutput* output = &connection->output;
+    switch (connection->ioUringOperation.type) {
+        case IOUringOperationRecv:
+            if (result <= 0) {
+                if (connection->status.requestsHandled > 0 && 0 == connection->request.methodLength) {
+                    ews_printf_debug("Keep-alive connection from %s:%s closed after %" PRId64 " requests\n", connection->remoteHost, connection->remotePort, connection->status.requestsHandled);
+                } else {
+                    ews_printf("No request found from %s:%s? Closing connection. The total bytes received on this connection: %" PRIi64 "\n", connection->remoteHost, connection->remotePort, connection->status.bytesReceived);
+                }
+                ioUringConnectionFinished(ring, connection);
+                return;
+            }
+            if (OptionPrintWholeRequest) {
+                fwrite(connection->ioUringOperation.buffers[0].iov_base, 1, result, stdout);
+            }
+            connection->status.bytesReceived += result;
+            connectionParseReceived(connection, (size_t) result);
+            ioUringRespond(ring, connection);
+            return;
+        case IOUringOperationSend: {
+            if (result < 0) {
+                ews_printf("Failed to respond to %s:%s. sendmsg failed with %s = %d\n", connection->remoteHost, connection->remotePort, strerror(-result), -result);
+                ioUringConnectionFinished(ring, connection);
+                return;
+            }
+            size_t headerPart = MIN((size_t) result, output->headerLength - output->headerSent);
+            size_t* secondSent = (NULL != output->fp) ? &output->chunkSent : &output->bodySent;
+            if (OptionPrintResponse) {
+                fwrite(connection->ioUringOperation.buffers[0].iov_base, 1, headerPart, stdout);
+                fwrite(connection->ioUringOperation.buffers[1].iov_base, 1, result - headerPart, stdout);
+            }
+            output->headerSent += headerPart;
+            *secondSent += result - headerPart;
+            connection->status.bytesSent += result;
+            ioUringSendNext(ring, connection);
+            return;
+        }
+        case IOUringOperationRead:
+            if (result < 0) {
+                ews_printf("Unable to finish the request for '%s' because there was an error reading '%s' %s = %d\n", connection->request.path, output->response->filenameToSend, strerror(-result), -result);
+                ioUringConnectionFinished(ring, connection);
+                return;
+            }
+            output->chunkLength = (size_t) result;
+            output->chunkSent = 0;
+            output->fileOffset += result;
+            output->fileDone = (0 == result);
+            ioUringSendNext(ring, connection);
+            return;
     }
-#endif
 }
 
-static THREAD_RETURN_TYPE STDCALL_ON_WIN32 connectionHandlerThread(void* connectionPointer) {
-    struct Connection* connection = (struct Connection*) connectionPointer;
-    getnameinfo((struct sockaddr*) &connection->remoteAddr, connection->remoteAddrLength,
-                connection->remoteHost, sizeof(connection->remoteHost),
-                connection->remotePort, sizeof(connection->remotePort), NI_NUMERICHOST | NI_NUMERICSERV);
-    ews_printf_debug("New connection from %s:%s...\n", connection->remoteHost, connection->remotePort);
-    if (OptionIncludeStatusPageAndCounters) {
-        pthread_mutex_lock(&counters.lock);
-        counters.activeConnections++;
-        counters.totalConnections++;
-        pthread_mutex_unlock(&counters.lock);
+static void ioUringAccepted(struct IOUring* ring, int result) {
+    struct Server* server = ring->server;
+    ring->accepting = false;
+    if (result < 0) {
+        if (server->shouldRun && -EINTR != result && -ECANCELED != result) {
+            ews_printf("accept failed in the io_uring loop %s = %d. Continuing if server.shouldRun is true...\n", strerror(-result), -result);
+        }
+    } else if (connectionAdmit(server, result)) {
+        struct Connection* connection = connectionAllocAdmitted(server, result, &ring->acceptAddr, ring->acceptAddrLength);
+        if (NULL != connection) {
+            connectionStarted(connection);
+            if (!ioUringQueueRecv(ring, connection)) {
+                connectionFinished(connection);
+            } else {
+                ioUringConnectionAdd(ring, connection);
+                connectionTimerStart(&ring->timers, connection, ConnectionTimeoutHeader);
+            }
+        }
     }
-    /* first read the request + request body */
-    bool madeRequestPrintf = false;
-    bool foundRequest = false;
-    ssize_t bytesRead;
-    while ((bytesRead = recv(connection->socketfd, connection->sendRecvBuffer, SEND_RECV_BUFFER_SIZE, 0)) > 0) {
-        if (OptionPrintWholeRequest) {
-            fwrite(connection->sendRecvBuffer, 1, bytesRead, stdout);
+    if (server->shouldRun && !ring->acceptCancelled) {
+        ioUringQueueAccept(ring);
+    }
+}
+
+/* io_uring_enter stopped working, so nothing we have in flight is ever going to complete. Shutting the sockets down
+ first means the kernel has nothing left to write into the connections' buffers by the time we free them */
+static void ioUringAbandonConnections(struct IOUring* ring) {
+    for (struct Connection* connection = ring->connections; NULL != connection; connection = connection->ioUringOperation.ringNext) {
+        shutdown(connection->socketfd, SHUT_RDWR);
+    }
+    while (NULL != ring->connections) {
+        ioUringConnectionFinished(ring, ring->connections);
+    }
+}
+
+/* Runs until the server stops and its connections are done. Returns false if io_uring_enter failed for good, after
+ closing every connection the ring had */
+static bool ioUringLoop(struct IOUring* ring) {
+    struct Server* server = ring->server;
+    while (1) {
+        /* these are queued again whenever they complete, but if the submission queue was full right then, it's now */
+        if (server->shouldRun && !ring->accepting && !ring->acceptCancelled) {
+            ioUringQueueAccept(ring);
         }
-        connection->status.bytesReceived += bytesRead;
-        requestParse(&connection->request, connection->sendRecvBuffer, bytesRead);
-        if (connection->request.state >= RequestParseStateVersion && !madeRequestPrintf) {
-            ews_printf_debug("Request from %s:%s: %s to %s HTTP version %s\n",
-                   connection->remoteHost,
-                   connection->remotePort,
-                   connection->request.method,
-                   connection->request.path,
-                   connection->request.version);
-            madeRequestPrintf = true;
+        if (!ring->timing) {
+            ioUringQueueTimeout(ring);
         }
-        if (connection->request.state == RequestParseStateDone) {
-            foundRequest = true;
-            break;
+        if (!server->shouldRun && ring->accepting && !ring->acceptCancelled) {
+            /* serverStop closed the listener but io_uring holds its own reference, so cancel the accept ourselves */
+            ioUringQueueCancelAccept(ring);
         }
-#ifdef EWS_FUZZ_TESTING /* This enables us to fuzz test different content lengths */
-        if (connection->request.state == RequestParseStateBody) {
-            foundRequest = true;
+        struct Connection* expired;
+        ConnectionTimeout timeout;
+        while (NULL != (expired = connectionTimersExpire(&ring->timers, server, &timeout))) {
+            /* the recv or send in flight will fail or complete with 0 and close it */
+            connectionTimedOut(expired, timeout);
+            shutdown(expired->socketfd, SHUT_RDWR);
         }
-#endif
-    }
-    requestPrintWarnings(&connection->request, connection->remoteHost, connection->remotePort);
-    ssize_t bytesSent = 0;
-    if (foundRequest) {
-        struct Response* response = createResponseForRequestAutoreleased(&connection->request, connection);
-        if (NULL != response) {
-            int result = sendResponse(connection, response, &bytesSent);
-            if (0 == result) {
-                ews_printf_debug("%s:%s: Responded with HTTP %d %s length %" PRId64 "\n", connection->remoteHost, connection->remotePort, response->code, response->status, (int64_t)bytesSent);
-            } else {
-                /* sendResponse already printed something out, don't add another ews_printf */
+        if (!ring->accepting && !server->shouldRun) {
+            pthread_mutex_lock(&server->connectionFinishedLock);
+            int activeConnectionCount = server->activeConnectionCount;
+            pthread_mutex_unlock(&server->connectionFinishedLock);
+            if (0 == activeConnectionCount) {
+                return true;
             }
-            responseFree(response);
-            connection->status.bytesSent = bytesSent;
-        } else {
-            ews_printf("%s:%s: You have returned a NULL response - I'm assuming you took over the request handling yourself.\n", connection->remoteHost, connection->remotePort);
         }
-    } else {
-        ews_printf("No request found from %s:%s? Closing connection. Here's the last bytes we received in the request (length %" PRIi64 "). The total bytes received on this connection: %" PRIi64 " :\n", connection->remoteHost, connection->remotePort, (int64_t) bytesRead, connection->status.bytesReceived);
-        if (bytesRead > 0) {
-            fwrite(connection->sendRecvBuffer, 1, bytesRead, stdout);
+        if (0 != ioUringSubmit(ring, 1)) {
+            ioUringAbandonConnections(ring);
+            return false;
+        }
+        unsigned head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & ring->cqMask];
+            uint64_t userData = cqe->user_data;
+            int result = cqe->res;
+            head++;
+            __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+            if (IO_URING_ACCEPT_TAG == userData) {
+                ioUringAccepted(ring, result);
+            } else if (IO_URING_TIMEOUT_TAG == userData) {
+                ring->timing = false;
+                ioUringQueueTimeout(ring);
+            } else if (IO_URING_CANCEL_TAG != userData) {
+                ioUringCompleted(ring, (struct Connection*) (uintptr_t) userData, result);
+            }
+            head = *ring->cqHead;
         }
     }
-    /* Alright - we're done */
-    close(connection->socketfd);
-    pthread_mutex_lock(&counters.lock);
-    counters.bytesSent += (ssize_t) connection->status.bytesSent;
-    counters.bytesReceived += (ssize_t) connection->status.bytesReceived;
-    counters.activeConnections--;
-    pthread_mutex_unlock(&counters.lock);
-    ews_printf_debug("Connection from %s:%s closed\n", connection->remoteHost, connection->remotePort);
-    pthread_mutex_lock(&connection->server->connectionFinishedLock);
-    connection->server->activeConnectionCount--;
-    pthread_cond_signal(&connection->server->connectionFinishedCond);
-    pthread_mutex_unlock(&connection->server->connectionFinishedLock);
-    connectionFree(connection);
-    return (THREAD_RETURN_TYPE) NULL;
 }
 
+/* Returns false if io_uring isn't usable here (or stopped working), so the caller can fall back to epoll */
+static bool ioUringRun(struct Server* server, sockettype listenerfd) {
+    struct IOUring ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.server = server;
+    ring.listenerfd = listenerfd;
+    if (!ioUringInit(&ring)) {
+        ioUringDestroy(&ring);
+        return false;
+    }
+    bool finished = ioUringLoop(&ring);
+    ioUringDestroy(&ring);
+    return finished;
+}
+#endif // EWS_IO_URING_SUPPORTED
+
 int serverMutexLock(struct Server* server) {
     return pthread_mutex_lock(&server->globalMutex);
 }
@@ -1995,7 +6393,7 @@ static bool strEndsWith(const char* big, const char* endsWith) {
     return true;
 }
 
-static int snprintfResponseHeader(char* destination, size_t destinationCapacity, int code, const char* status, const char* contentType,  const char* extraHeaders, size_t contentLength) {
+static int snprintfResponseHeader(char* destination, size_t destinationCapacity, int code, const char* status, const char* contentType,  const char* extraHeaders, size_t contentLength, bool keepAlive) {
     if (NULL == extraHeaders) {
         extraHeaders = "";
     }
@@ -2005,19 +6403,20 @@ static int snprintfResponseHeader(char* destination, size_t destinationCapacity,
         "Content-Type: %s\r\n"
         "Content-Length: %" PRIu64 "\r\n"
         "Server: Embeddable Web Server/" EMBEDDABLE_WEB_SERVER_VERSION_STRING "\r\n"
+        "Connection: %s\r\n"
         "%s"
         "\r\n",
         code,
         status,
         contentType,
         (uint64_t)contentLength,
+        keepAlive ? "keep-alive" : "close",
         extraHeaders);
 }
 
 /* Quick unit tests */
 
 static void testHeapString() {
-    pthread_mutex_init(&counters.lock, NULL);
     struct HeapString easy;
     heapStringInit(&easy);
     heapStringSetToCString(&easy, "Part1");
@@ -2081,6 +6480,12 @@ static void teststrdupHTMLEscape() {
 	assert(0 == strcmpAndFreeFirstArg(strdupEscapeForHTML(">a"), "&gt;a"));
 	assert(0 == strcmpAndFreeFirstArg(strdupEscapeForHTML(">a<"), "&gt;a&lt;"));
 	assert(0 == strcmpAndFreeFirstArg(strdupEscapeForHTML("><"), "&gt;&lt;"));
+	/* long enough for the 16 and 32 byte scans, with escapes on both sides of their edges */
+	assert(0 == strcmpAndFreeFirstArg(strdupEscapeForHTML("0123456789abcde<0123456789abcdef0123456789abcde\"&'x"),
+	                                  "0123456789abcde&lt;0123456789abcdef0123456789abcde&quot;&amp;&#039;x"));
+	assert(0 == strcmpAndFreeFirstArg(strdupEscapeForURL("AZaz09-./0123456789abcdef0123456789abcd@[`{ \xff~"),
+	                                  "AZaz09-./0123456789abcdef0123456789abcd%40%5b%60%7b%20%ff%7e"));
+	assert(NULL == strdupEscapeForURL(""));
 }
 
 static void teststrdupEscape() {
@@ -2091,6 +6496,33 @@ static void teststrdupEscape() {
     assert(0 == strcmpAndFreeFirstArg( strdupDecodeGETorPOSTParam("param=", "param=%0a0value%0a0", NULL), "\n0value\n0"));
     assert(0 == strcmpAndFreeFirstArg( strdupDecodeGETorPOSTParam("param=", "param=val%20ue", NULL), "val ue"));
     assert(0 == strcmpAndFreeFirstArg( strdupDecodeGETorPOSTParam("param=", "param=value%0a&next", NULL), "value\n"));
+    assert(0 == strcmpAndFreeFirstArg( strdupDecodeGETorPOSTParam("name=", "username=bob&name=alice", NULL), "alice"));
+    assert(NULL == strdupDecodeGETorPOSTParam("name=", "/path?username=bob", NULL));
+}
+
+static void testRequestParams() {
+    struct Request* request = (struct Request*) calloc(1, sizeof(*request));
+    strcpy(request->path, "/form?username=bob&name=al%20ice&flag&&empty=&a+b=c%26d&name=second&nul=x%00y");
+    heapStringSetToCString(&request->body, "name=posted&x=1");
+    size_t length = 99;
+    assert(0 == strcmp(requestGETParam(request, "name", &length), "al ice") && 6 == length);
+    assert(0 == strcmp(requestGETParam(request, "username", NULL), "bob"));
+    assert(0 == strcmp(requestGETParam(request, "flag", &length), "") && 0 == length);
+    assert(0 == strcmp(requestGETParam(request, "empty", NULL), ""));
+    assert(0 == strcmp(requestGETParam(request, "a b", NULL), "c&d"));
+    assert(0 == memcmp(requestGETParam(request, "nul", &length), "x\0y", 3) && 3 == length);
+    assert(NULL == requestGETParam(request, "user", NULL) && NULL == requestGETParam(request, "", NULL));
+    assert(7 == requestGETParams(request)->count);
+    assert(0 == strcmp(requestPOSTParam(request, "name", NULL), "posted"));
+    assert(NULL == requestPOSTParam(request, "username", NULL));
+    assert(0 == strcmpAndFreeFirstArg(strdupDecodeGETParam("name=", request, NULL), "al ice"));
+    assert(0 == strcmpAndFreeFirstArg(strdupDecodePOSTParam("x=", request, NULL), "1"));
+    assert(0 == strcmpAndFreeFirstArg(strdupDecodePOSTParam("missing=", request, "default"), "default"));
+    requestReset(request);
+    assert(NULL == request->GETParams && NULL == request->POSTParams);
+    assert(NULL == requestPOSTParam(request, "name", NULL) && 0 == requestGETParams(request)->count);
+    requestReset(request);
+    free(request);
 }
 
 static void testPathEscapesRoot() {
@@ -2137,7 +6569,7 @@ static void testPathMatching() {
 static void assertURLDecodeEquals(const char *input, const char *expectedOutput, URLDecodeType type) {
     char *actualOutput = (char*)malloc(strlen(expectedOutput) + 1);
     size_t actualOutputLength;
-    bool success = URLDecode(input, actualOutput, strlen(expectedOutput) + 1, &actualOutputLength, type);
+    bool success = URLDecode(input, strlen(input), actualOutput, strlen(expectedOutput) + 1, &actualOutputLength, type);
     assert(success);
     assert(strcmp(actualOutput, expectedOutput) == 0);
     assert(actualOutputLength == strlen(expectedOutput));
@@ -2154,15 +6586,971 @@ static void testURLDecode() {
     assertURLDecodeEquals("abc%40", "abc@", URLDecodeTypeParameter);
     assertURLDecodeEquals("abc%40&abc", "abc@", URLDecodeTypeParameter);
     assertURLDecodeEquals("&abc%40&abc", "", URLDecodeTypeParameter);
+    assertURLDecodeEquals("0123456789abcdef0123456789abcd%4a%4A+x%+1&y", "0123456789abcdef0123456789abcdJJ x\001&y", URLDecodeTypeWholeURL);
+}
+
+static bool requestStringWantsKeepAlive(struct Request* request, const char* requestString) {
+    requestReset(request);
+    requestParse(request, requestString, strlen(requestString));
+    assert(RequestParseStateDone == request->state);
+    return requestWantsKeepAlive(request);
+}
+
+/* Header slices aren't null-terminated until the connection has all the headers, so the tests compare with lengths */
+static bool poolStringEquals(const struct PoolString* string, const char* expected) {
+    return string->length == strlen(expected) && 0 == memcmp(string->contents, expected, string->length);
+}
+
+static void testKeepAlive() {
+    assert(headerValueContainsToken("close", 5, "close"));
+    assert(headerValueContainsToken("Keep-Alive, Upgrade", 19, "keep-alive"));
+    assert(headerValueContainsToken("Upgrade ,  CLOSE ", 17, "close"));
+    assert(!headerValueContainsToken("closed", 6, "close"));
+    assert(!headerValueContainsToken("", 0, "close"));
+    assert(!headerValueContainsToken("close\r\nConnection: keep-alive", 5, "keep-alive"));
+    struct Request* request = (struct Request*) calloc(1, sizeof(*request));
+    assert(requestStringWantsKeepAlive(request, "GET / HTTP/1.1\r\nHost: a\r\n\r\n"));
+    assert(!requestStringWantsKeepAlive(request, "GET / HTTP/1.1\r\nConnection: close\r\n\r\n"));
+    assert(!requestStringWantsKeepAlive(request, "GET / HTTP/1.0\r\n\r\n"));
+    assert(requestStringWantsKeepAlive(request, "GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"));
+    /* requestReset has to leave nothing behind from the longer request before it */
+    requestStringWantsKeepAlive(request, "POST /a/much/longer/path HTTP/1.1\r\nContent-Length: 3\r\nX-Something-Long: 12345678\r\n\r\nabc");
+    requestStringWantsKeepAlive(request, "GET /b HTTP/1.1\r\nX: 1\r\n\r\n");
+    assert(0 == strcmp(request->method, "GET") && 0 == strcmp(request->path, "/b") && 0 == strcmp(request->pathDecoded, "/b"));
+    assert(1 == request->headersCount && poolStringEquals(&request->headers[0].value, "1"));
+    assert(0 == request->body.length && NULL == request->body.contents);
+    requestReset(request);
+    free(request);
+}
+
+static void testPipelining() {
+    const char* twoRequests = "POST /a HTTP/1.1\r\nContent-Length: 2\r\n\r\nhiGET /b HTTP/1.1\r\n\r\n";
+    const size_t firstLength = strlen("POST /a HTTP/1.1\r\nContent-Length: 2\r\n\r\nhi");
+    struct Request* request = (struct Request*) calloc(1, sizeof(*request));
+    size_t consumed = requestParse(request, twoRequests, strlen(twoRequests));
+    assert(consumed == firstLength && RequestParseStateDone == request->state);
+    assert(0 == strcmp(request->body.contents, "hi") && !request->warnings.bodyTruncated);
+    assert(0 == requestParse(request, twoRequests + consumed, strlen(twoRequests) - consumed));
+    requestReset(request);
+    consumed = requestParse(request, twoRequests + firstLength, strlen(twoRequests) - firstLength);
+    assert(consumed == strlen(twoRequests) - firstLength && RequestParseStateDone == request->state);
+    assert(0 == strcmp(request->path, "/b"));
+    requestReset(request);
+    free(request);
+}
+
+static void testRequestParse() {
+    /* long enough that the vectorized scans cross several 16/32 byte blocks and their scalar tails */
+    const char* requestString = "POST /a%20long/path/that/keeps/going?query=string HTTP/1.1\r\n"
+        "Host: example.com\r\nCookie:   session=0123456789abcdef0123456789abcdef0123456789abcdef; other=value\r\n"
+        "Content-Length: 4\r\n\r\nbody";
+    struct Request* whole = (struct Request*) calloc(1, sizeof(*whole));
+    struct Request* bytewise = (struct Request*) calloc(1, sizeof(*bytewise));
+    assert(strlen(requestString) == requestParse(whole, requestString, strlen(requestString)));
+    for (size_t i = 0; i < strlen(requestString); i++) {
+        assert(1 == requestParse(bytewise, requestString + i, 1));
+    }
+    struct Request* requests[] = { whole, bytewise };
+    for (size_t i = 0; i < 2; i++) {
+        struct Request* request = requests[i];
+        assert(RequestParseStateDone == request->state);
+        assert(0 == strcmp(request->method, "POST") && 0 == strcmp(request->version, "HTTP/1.1"));
+        assert(0 == strcmp(request->pathDecoded, "/a long/path/that/keeps/going?query=string"));
+        assert(3 == request->headersCount);
+        assert(poolStringEquals(&request->headers[1].name, "Cookie"));
+        assert(poolStringEquals(&request->headers[1].value, "session=0123456789abcdef0123456789abcdef0123456789abcdef; other=value"));
+        assert(poolStringEquals(&request->headers[2].value, "4") && 0 == strcmp(request->body.contents, "body"));
+        requestReset(request);
+    }
+    /* Content-Length: 0 is done at the blank line and doesn't eat the next request's first byte */
+    const char* emptyBody = "POST / HTTP/1.1\r\nContent-Length: 0\r\n\r\nGET";
+    assert(strlen(emptyBody) - 3 == requestParse(whole, emptyBody, strlen(emptyBody)));
+    assert(RequestParseStateDone == whole->state && NULL == whole->body.contents);
+    requestReset(whole);
+    free(whole);
+    free(bytewise);
+}
+
+/* Simulates recv by copying requestString into the connection a few KB at a time until the request is done */
+static size_t testReceiveRequest(struct Connection* connection, const char* requestString, size_t length) {
+    size_t received = 0;
+    if (connection->pipelinedLength > 0) {
+        connectionParseReceived(connection, connection->pipelinedLength);
+    }
+    while (RequestParseStateDone != connection->request.state && received < length) {
+        size_t space;
+        char* into = connectionReceiveSpace(connection, &space);
+        size_t chunkLength = MIN(MIN(space, (size_t) 5000), length - received);
+        memcpy(into, requestString + received, chunkLength);
+        received += chunkLength;
+        connectionParseReceived(connection, chunkLength);
+    }
+    return received;
+}
+
+static void testHeaderIDs() {
+    for (int headerID = HeaderIDUnknown + 1; headerID < HeaderIDCount; headerID++) {
+        const char* name = headerIDNames[headerID];
+        assert(headerID == (int) headerIDFromName(name, strlen(name)));
+        char upper[32];
+        size_t i;
+        for (i = 0; name[i] != '\0'; i++) {
+            upper[i] = (name[i] >= 'a' && name[i] <= 'z') ? (char) (name[i] - 'a' + 'A') : name[i];
+        }
+        upper[i] = '\0';
+        assert(headerID == (int) headerIDFromName(upper, strlen(upper)));
+    }
+    assert(HeaderIDUnknown == headerIDFromName("Hosts", 5));
+    assert(HeaderIDUnknown == headerIDFromName("X-Content-Length", 16));
+    assert(HeaderIDUnknown == headerIDFromName("Content_Length", 14));
+    struct Request* request = (struct Request*) calloc(1, sizeof(*request));
+    const char* requestString = "GET / HTTP/1.1\r\nhost: a\r\nX-Thing: b\r\nCONNECTION: close\r\nHost: second\r\nAccept: */*\r\n\r\n";
+    requestParse(request, requestString, strlen(requestString));
+    assert(RequestParseStateDone == request->state);
+    assert(poolStringEquals(&headerInRequestByID(HeaderIDHost, request)->value, "a"));
+    assert(headerInRequest("Host", request) == headerInRequestByID(HeaderIDHost, request));
+    assert(headerInRequest("connection", request) == headerInRequestByID(HeaderIDConnection, request));
+    assert(poolStringEquals(&headerInRequest("x-thing", request)->value, "b"));
+    assert(NULL == headerInRequestByID(HeaderIDCookie, request) && NULL == headerInRequest("Cookie", request));
+    assert(NULL == headerInRequestByID(HeaderIDUnknown, request) && NULL == headerInRequestByID(HeaderIDCount, request));
+    requestReset(request);
+    assert(NULL == headerInRequestByID(HeaderIDHost, request));
+    free(request);
+}
+
+static void testReceiveBuffer() {
+    /* a 40KB cookie is bigger than sendRecvBuffer and headersStringPool, and a pipelined request comes right after it */
+    const char* start = "GET /a HTTP/1.1\r\nHost: a\r\nCookie: ";
+    const char* end = "\r\nX: 1\r\n\r\nGET /b HTTP/1.1\r\nY: 2\r\n\r\n";
+    const size_t cookieLength = 40 * 1024;
+    size_t length = strlen(start) + cookieLength + strlen(end);
+    char* requestString = (char*) malloc(length);
+    memcpy(requestString, start, strlen(start));
+    memset(requestString + strlen(start), 'c', cookieLength);
+    memcpy(requestString + strlen(start) + cookieLength, end, strlen(end));
+    struct Connection* connection = connectionAlloc(NULL);
+    size_t received = testReceiveRequest(connection, requestString, length);
+    assert(RequestParseStateDone == connection->request.state && 0 == strcmp(connection->request.path, "/a"));
+    const struct Header* cookie = headerInRequest("Cookie", &connection->request);
+#if EWS_HEADER_SLICES
+    assert(NULL != cookie && cookieLength == cookie->value.length && cookieLength == strlen(cookie->value.contents));
+    assert(0 == strcmp(headerInRequest("X", &connection->request)->value.contents, "1"));
+    assert(connection->receiveBuffer != connection->sendRecvBuffer);
+#else
+    assert(connection->request.warnings.headersStringPoolExhausted && (NULL == cookie || cookie->value.length < cookieLength));
+#endif
+    requestReset(&connection->request);
+    received += testReceiveRequest(connection, requestString + received, length - received);
+    assert(received == length && RequestParseStateDone == connection->request.state);
+    assert(0 == strcmp(connection->request.path, "/b") && poolStringEquals(&headerInRequest("Y", &connection->request)->value, "2"));
+    requestReset(&connection->request);
+    connectionFree(connection);
+    free(requestString);
+}
+
+struct TestBodyHandlerState {
+    size_t received;
+    bool allBytesMatched;
+    bool sawHeaders;
+    bool ended;
+    bool bodyComplete;
+    bool stopEarly;
+};
+
+static void* testBodyStart(const struct Request* request, struct Connection* connection) {
+    struct TestBodyHandlerState* state = (struct TestBodyHandlerState*) connection->server->tag;
+    bool stopEarly = state->stopEarly;
+    memset(state, 0, sizeof(*state));
+    state->stopEarly = stopEarly;
+    state->allBytesMatched = true;
+    state->sawHeaders = NULL != headerInRequestByID(HeaderIDHost, request) && 0 == strcmp(headerInRequestByID(HeaderIDHost, request)->value.contents, "a");
+    return state;
+}
+
+static bool testBodyChunk(void* context, const struct Request* request, const char* data, size_t length) {
+    struct TestBodyHandlerState* state = (struct TestBodyHandlerState*) context;
+    for (size_t i = 0; i < length; i++) {
+        state->allBytesMatched = state->allBytesMatched && data[i] == 'u';
+    }
+    state->received += length;
+    assert(NULL == request->body.contents);
+    return !state->stopEarly;
+}
+
+static struct Response* testBodyEnd(void* context, const struct Request* request, struct Connection* connection, bool bodyComplete) {
+    (void) request;
+    (void) connection;
+    struct TestBodyHandlerState* state = (struct TestBodyHandlerState*) context;
+    state->ended = true;
+    state->bodyComplete = bodyComplete;
+    return responseAllocWithFormat(200, "OK", "text/plain", "%d", (int) state->received);
+}
+
+static void testBodyHandler() {
+    const char* start = "POST /upload?x=1 HTTP/1.1\r\nHost: a\r\nContent-Length: 50000\r\n\r\n";
+    const char* next = "POST /other HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc";
+    size_t length = strlen(start) + 50000 + strlen(next);
+    char* requestString = (char*) malloc(length);
+    memcpy(requestString, start, strlen(start));
+    memset(requestString + strlen(start), 'u', 50000);
+    memcpy(requestString + strlen(start) + 50000, next, strlen(next));
+    struct TestBodyHandlerState state;
+    memset(&state, 0, sizeof(state));
+    struct RequestBodyHandler handler = { "/upload", &testBodyStart, &testBodyChunk, &testBodyEnd };
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    server.tag = &state;
+    server.bodyHandlers = &handler;
+    server.bodyHandlerCount = 1;
+    struct Connection* connection = connectionAlloc(&server);
+    size_t received = testReceiveRequest(connection, requestString, length);
+    assert(RequestParseStateDone == connection->request.state && NULL == connection->request.body.contents);
+    assert(50000 == state.received && state.allBytesMatched && state.sawHeaders && !state.ended);
+    struct Response* response = createResponseForRequestAutoreleased(&connection->request, connection);
+    assert(state.ended && state.bodyComplete && 0 == strcmp(response->body.contents, "50000"));
+    responseFree(response);
+    /* the next request isn't for the handler so its body is collected like always */
+    requestReset(&connection->request);
+    received += testReceiveRequest(connection, requestString + received, length - received);
+    assert(received == length && RequestParseStateDone == connection->request.state && NULL == connection->bodyHandler);
+    assert(0 == strcmp(connection->request.body.contents, "abc"));
+    requestReset(&connection->request);
+    /* the handler can stop the body early */
+    state.stopEarly = true;
+    testReceiveRequest(connection, requestString, strlen(start) + 10);
+    assert(RequestParseStateDone == connection->request.state && connection->request.warnings.bodyTruncated && 10 == state.received);
+    response = createResponseForRequestAutoreleased(&connection->request, connection);
+    assert(state.ended && !state.bodyComplete);
+    responseFree(response);
+    requestReset(&connection->request);
+    connectionFree(connection);
+    /* and hears about it when the connection goes away halfway through */
+    state.stopEarly = false;
+    connection = connectionAlloc(&server);
+    testReceiveRequest(connection, requestString, strlen(start) + 20000);
+    assert(RequestParseStateBody == connection->request.state && 20000 == state.received && !state.ended);
+    connectionFree(connection);
+    assert(state.ended && !state.bodyComplete);
+    free(requestString);
+}
+
+static void testChunkedBody() {
+    const char* requestString = "POST /c HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\nContent-Length: 99\r\n\r\n"
+        "5;name=value\r\nhello\r\n1A\r\nabcdefghijklmnopqrstuvwxyz\r\n0\r\nX-Trailer: t\r\n\r\n";
+    const char* next = "GET /next HTTP/1.1\r\n\r\n";
+    struct Request* whole = (struct Request*) calloc(1, sizeof(*whole));
+    struct Request* bytewise = (struct Request*) calloc(1, sizeof(*bytewise));
+    char* twoRequests = (char*) malloc(strlen(requestString) + strlen(next) + 1);
+    strcpy(twoRequests, requestString);
+    strcat(twoRequests, next);
+    assert(strlen(requestString) == requestParse(whole, twoRequests, strlen(twoRequests)));
+    for (size_t i = 0; i < strlen(requestString); i++) {
+        assert(1 == requestParse(bytewise, requestString + i, 1));
+    }
+    struct Request* requests[] = { whole, bytewise };
+    for (size_t i = 0; i < 2; i++) {
+        assert(RequestParseStateDone == requests[i]->state && requests[i]->bodyChunked && !requests[i]->warnings.bodyTruncated);
+        assert(31 == requests[i]->body.length && 0 == strcmp(requests[i]->body.contents, "helloabcdefghijklmnopqrstuvwxyz"));
+        requestReset(requests[i]);
+    }
+    /* broken framing can't be recovered from */
+    const char* badRequests[] = { "zz\r\n", "5\r\nhelloX", "5\nhello", "fffffffffffffffffffffffff\r\n", "\r\n" };
+    for (size_t i = 0; i < sizeof(badRequests) / sizeof(badRequests[0]); i++) {
+        const char* start = "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n";
+        requestParse(whole, start, strlen(start));
+        requestParse(whole, badRequests[i], strlen(badRequests[i]));
+        assert(RequestParseStateBadRequest == whole->state);
+        requestReset(whole);
+    }
+    /* chunks past REQUEST_MAX_BODY_LENGTH end the request instead of being read (and dropped) forever. Pretend most of
+     the limit has already gone by rather than sending 128MB */
+    const char* start = "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n";
+    assert(strlen(start) == requestParse(whole, start, strlen(start)));
+    whole->bodyReceivedLength = REQUEST_MAX_BODY_LENGTH - 3;
+    const char* overLimit = "a\r\n0123456789\r\n0\r\n\r\n";
+    assert(strlen("a\r\n012") == requestParse(whole, overLimit, strlen(overLimit)));
+    assert(RequestParseStateDone == whole->state && whole->warnings.bodyTruncated && 0 == strcmp(whole->body.contents, "hello012"));
+    requestReset(whole);
+    /* the body handler gets just the chunk data */
+    struct TestBodyHandlerState state;
+    memset(&state, 0, sizeof(state));
+    struct RequestBodyHandler handler = { "/upload", &testBodyStart, &testBodyChunk, &testBodyEnd };
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    server.tag = &state;
+    server.bodyHandlers = &handler;
+    server.bodyHandlerCount = 1;
+    struct Connection* connection = connectionAlloc(&server);
+    struct HeapString upload;
+    heapStringInit(&upload);
+    heapStringAppendString(&upload, "POST /upload HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n");
+    for (size_t chunk = 1; chunk <= 40; chunk++) {
+        heapStringAppendFormat(&upload, "%zx\r\n", chunk * 100);
+        for (size_t i = 0; i < chunk * 100; i++) {
+            heapStringAppendChar(&upload, 'u');
+        }
+        heapStringAppendString(&upload, "\r\n");
+    }
+    heapStringAppendString(&upload, "0\r\n\r\n");
+    heapStringAppendString(&upload, next);
+    size_t received = testReceiveRequest(connection, upload.contents, upload.length);
+    assert(RequestParseStateDone == connection->request.state && NULL == connection->request.body.contents);
+    assert(82000 == state.received && state.allBytesMatched && state.sawHeaders);
+    struct Response* response = createResponseForRequestAutoreleased(&connection->request, connection);
+    assert(state.ended && state.bodyComplete && 0 == strcmp(response->body.contents, "82000"));
+    responseFree(response);
+    requestReset(&connection->request);
+    received += testReceiveRequest(connection, upload.contents + received, upload.length - received);
+    assert(received == upload.length && RequestParseStateDone == connection->request.state && 0 == strcmp(connection->request.path, "/next"));
+    requestReset(&connection->request);
+    connectionFree(connection);
+    heapStringFreeContents(&upload);
+    free(twoRequests);
+    free(whole);
+    free(bytewise);
+}
+
+static struct Response* testRequestBodyCheck(const struct Request* request, struct Connection* connection) {
+    (void) connection;
+    if (request->bodyExpectedLength > 1000) {
+        return responseAllocHTMLWithStatus(413, "Payload Too Large", "too big");
+    }
+    return NULL;
+}
+
+static void testExpectContinue() {
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    server.shouldRun = true;
+    server.requestBodyCheck = &testRequestBodyCheck;
+    struct Connection* connection = connectionAlloc(&server);
+    char received[64] = { 0 };
+#ifndef WIN32
+    /* the 100 Continue goes out over the connection's socket */
+    int sockets[2];
+    assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+    connection->socketfd = sockets[0];
+#endif
+    const char* headers = "POST /up HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 5\r\n\r\n";
+    testReceiveRequest(connection, headers, strlen(headers));
+    assert(RequestParseStateBody == connection->request.state && !connection->bodyRejected);
+#ifndef WIN32
+    assert(25 == recv(sockets[1], received, sizeof(received), MSG_DONTWAIT) && 0 == strcmp(received, "HTTP/1.1 100 Continue\r\n\r\n"));
+#endif
+    testReceiveRequest(connection, "hello", 5);
+    assert(RequestParseStateDone == connection->request.state && 0 == strcmp(connection->request.body.contents, "hello"));
+    requestReset(&connection->request);
+    /* too big - turned down before the body and without a 100 Continue */
+    headers = "POST /up HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 5000\r\n\r\nxyz";
+    testReceiveRequest(connection, headers, strlen(headers));
+    assert(RequestParseStateDone == connection->request.state && connection->bodyRejected && 0 == connection->pipelinedLength);
+    assert(NULL == connection->request.body.contents);
+    struct Response* response = createResponseForRequestAutoreleased(&connection->request, connection);
+    assert(413 == response->code && NULL == connection->bodyRejectedResponse);
+    assert(!connectionShouldKeepAlive(connection));
+    responseFree(response);
+#ifndef WIN32
+    assert(-1 == recv(sockets[1], received, sizeof(received), MSG_DONTWAIT));
+    close(sockets[0]);
+    close(sockets[1]);
+#endif
+    requestReset(&connection->request);
+    connectionFree(connection);
+}
+
+static void testBodySpill() {
+#if EWS_BODY_SPILL_SUPPORTED
+    struct Request* request = (struct Request*) calloc(1, sizeof(*request));
+    /* Content-Length over the threshold goes straight to the file */
+    const char* requestString = "POST /form HTTP/1.1\r\nContent-Length: 300\r\n\r\n";
+    char body[301];
+    memset(body, 'b', 300);
+    memcpy(body, "name=spilled&x=", 15);
+    body[300] = '\0';
+    request->bodySpillThreshold = 100;
+    requestParse(request, requestString, strlen(requestString));
+    for (size_t i = 0; i < 300; i += 7) {
+        requestParse(request, body + i, MIN((size_t) 7, 300 - i));
+    }
+    assert(RequestParseStateDone == request->state && request->bodySpilled && NULL == request->body.contents);
+    size_t length = 0;
+    assert(0 == strcmp(requestBody(request, &length), body) && 300 == length);
+    assert(0 == strcmp(requestPOSTParam(request, "name", NULL), "spilled"));
+    int fd = request->bodyFileDescriptor;
+    requestReset(request);
+    assert(!request->bodySpilled && -1 == request->bodyFileDescriptor && -1 == fcntl(fd, F_GETFD));
+    /* a chunked body moves to the file once it gets too big */
+    requestString = "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n";
+    requestParse(request, requestString, strlen(requestString));
+    request->bodySpillThreshold = 100;
+    requestString = "32\r\naaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\r\n";
+    requestParse(request, requestString, strlen(requestString));
+    assert(!request->bodySpilled && 50 == request->body.length);
+    requestString = "64\r\nbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb\r\n0\r\n\r\n";
+    requestParse(request, requestString, strlen(requestString));
+    assert(RequestParseStateDone == request->state && request->bodySpilled && 150 == request->bodyFileLength);
+    const char* spilled = requestBody(request, &length);
+    assert(150 == length && 150 == strlen(spilled) && 'a' == spilled[49] && 'b' == spilled[50]);
+    requestReset(request);
+    /* small bodies stay in memory */
+    requestString = "POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\nsmall";
+    requestParse(request, requestString, strlen(requestString));
+    request->bodySpillThreshold = 100;
+    assert(!request->bodySpilled && requestBody(request, NULL) == request->body.contents);
+    requestReset(request);
+    free(request);
+#endif
+}
+
+/* Writes down everything the parser says so the same body fed in different sized pieces can be compared */
+static bool testMultipartPartStart(void* tag, const struct MultipartPart* part) {
+    heapStringAppendFormat((struct HeapString*) tag, "[%s|%s|%s]", NULL != part->name ? part->name : "-",
+                           NULL != part->filename ? part->filename : "-", NULL != part->contentType ? part->contentType : "-");
+    return true;
+}
+
+static bool testMultipartPartData(void* tag, const struct MultipartPart* part, const char* data, size_t length) {
+    (void) part;
+    for (size_t i = 0; i < length; i++) {
+        heapStringAppendChar((struct HeapString*) tag, data[i]);
+    }
+    return true;
+}
+
+static bool testMultipartPartEnd(void* tag, const struct MultipartPart* part) {
+    (void) part;
+    heapStringAppendString((struct HeapString*) tag, "[end]");
+    return true;
+}
+
+static void testMultipart() {
+    struct Request* request = (struct Request*) calloc(1, sizeof(*request));
+    const char* requestString = "POST /upload HTTP/1.1\r\nContent-Type: multipart/form-data; boundary=\"XyZ;b\"\r\nContent-Length: 0\r\n\r\n";
+    requestParse(request, requestString, strlen(requestString));
+    /* a preamble, a boundary-looking line inside the file data, a CR at the end of a field and an epilogue */
+    const char* body =
+        "ignore me\r\n"
+        "--XyZ;b\r\n"
+        "Content-Disposition: form-data; name=\"title\"\r\n"
+        "\r\n"
+        "Hello, world\r"
+        "\r\n--XyZ;b  \r\n"
+        "content-disposition: form-data; name=\"file\"; filename=\"a \\\"b\\\".txt\"\r\n"
+        "Content-Type: text/plain\r\n"
+        "\r\n"
+        "line 1\r\n--XyZ;\r\n--XyZ-b\r\n\r\n"
+        "\r\n--XyZ;b\r\n"
+        "Content-Disposition: form-data; filename=x; name=empty\r\n"
+        "\r\n"
+        "\r\n--XyZ;b--\r\n"
+        "epilogue\r\n--XyZ;b\r\n";
+    const char* expected = "[title|-|-]Hello, world\r[end][file|a \"b\".txt|text/plain]line 1\r\n--XyZ;\r\n--XyZ-b\r\n\r\n[end][empty|x|-][end]";
+    struct MultipartCallbacks callbacks = { &testMultipartPartStart, &testMultipartPartData, &testMultipartPartEnd };
+    const size_t pieceSizes[] = { strlen(body), 1, 2, 3, 7, 16 };
+    for (size_t i = 0; i < sizeof(pieceSizes) / sizeof(pieceSizes[0]); i++) {
+        struct HeapString events;
+        heapStringInit(&events);
+        struct MultipartParser* parser = multipartParserAlloc(request, &callbacks, &events);
+        assert(NULL != parser);
+        for (size_t offset = 0; offset < strlen(body); offset += pieceSizes[i]) {
+            assert(multipartParserFeed(parser, body + offset, MIN(pieceSizes[i], strlen(body) - offset)));
+        }
+        assert(multipartParserFinished(parser));
+        assert(0 == strcmp(events.contents, expected));
+        multipartParserFree(parser);
+        heapStringFreeContents(&events);
+    }
+    /* the fields that aren't files are the POST params */
+    requestBodyAppend(request, body, strlen(body));
+    size_t length = 0;
+    assert(0 == strcmp(requestPOSTParam(request, "title", &length), "Hello, world\r") && 13 == length);
+    assert(NULL == requestPOSTParam(request, "file", NULL) && 1 == requestPOSTParams(request)->count);
+    /* garbage after a boundary */
+    struct MultipartParser* parser = multipartParserAlloc(request, NULL, NULL);
+    requestString = "--XyZ;b\r\n\r\ndata\r\n--XyZ;bx";
+    assert(!multipartParserFeed(parser, requestString, strlen(requestString)));
+    multipartParserFree(parser);
+    requestReset(request);
+    requestString = "POST / HTTP/1.1\r\nContent-Type: application/x-www-form-urlencoded\r\n\r\n";
+    requestParse(request, requestString, strlen(requestString));
+    assert(NULL == multipartParserAlloc(request, &callbacks, NULL));
+    requestReset(request);
+    free(request);
+}
+
+static void testArena() {
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    struct Connection* connection = connectionAlloc(&server);
+    strcpy(connection->request.path, "/a?x=1&y=2");
+    int64_t blocksBefore = counters.arenaBlockAllocations;
+    for (int round = 0; round < 3; round++) {
+        assert(0 == strcmp(requestGETParam(&connection->request, "y", NULL), "2"));
+        assert(arenaOwns(&connection->arena, connection->request.GETParams));
+        struct Arena* previousArena = connectionArenaEnter(connection);
+        struct Response* response = responseAllocHTMLWithFormat("<b>%d</b>", round);
+        connectionArenaLeave(previousArena);
+        assert(&connection->arena == response->arena && arenaOwns(&connection->arena, response));
+        assert(arenaOwns(&connection->arena, response->status) && arenaOwns(&connection->arena, response->body.contents));
+        /* the body grows in place since it's the last thing allocated */
+        char* body = response->body.contents;
+        for (int i = 0; i < 50; i++) {
+            heapStringAppendString(&response->body, "0123456789");
+        }
+        assert(body == response->body.contents && 508 == response->body.length && 512 == response->body.capacity);
+        assert(NULL != connectionArenaAlloc(connection, 10000));
+        /* your own malloc'd strings are still freed */
+        response->extraHeaders = strdup("X-Round: 1\r\n");
+        response->contentType = strdup("text/plain");
+        responseFree(response);
+        requestReset(&connection->request);
+        strcpy(connection->request.path, "/a?x=1&y=2");
+        connection->request.pathLength = strlen(connection->request.path);
+    }
+    /* the first round needed a second block, after that the one block it keeps is big enough */
+    assert(3 == counters.arenaBlockAllocations - blocksBefore && NULL == connection->arena.blocks->next);
+    /* bodies too big for the arena move to malloc */
+    struct Arena* previousArena = connectionArenaEnter(connection);
+    struct Response* response = responseAlloc(200, "OK", "text/plain", 0);
+    connectionArenaLeave(previousArena);
+    for (int i = 0; i < CONNECTION_ARENA_MAX_STRING / 8; i++) {
+        heapStringAppendString(&response->body, "01234567");
+    }
+    assert(NULL == response->body.arena && !arenaOwns(&connection->arena, response->body.contents));
+    assert(CONNECTION_ARENA_MAX_STRING == response->body.length && '7' == response->body.contents[response->body.length - 1]);
+    /* outside of a handler it's malloc like always */
+    struct Response* mallocResponse = responseAllocHTML("x");
+    assert(NULL == mallocResponse->arena && NULL == mallocResponse->body.arena);
+    responseFree(mallocResponse);
+    responseFree(response);
+    /* so do small request bodies, Content-Length or chunked, and growing them doesn't zero anything but they stay terminated */
+    const char* posts[] = { "POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello", "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\n\r\n" };
+    for (size_t i = 0; i < sizeof(posts) / sizeof(posts[0]); i++) {
+        requestReset(&connection->request);
+        requestParse(&connection->request, posts[i], strlen(posts[i]));
+        assert(RequestParseStateDone == connection->request.state && arenaOwns(&connection->arena, connection->request.body.contents));
+        assert(5 == connection->request.body.length && 0 == strcmp(connection->request.body.contents, "hello"));
+    }
+    requestReset(&connection->request);
+    int64_t allocationsBefore = counters.heapStringAllocations + counters.heapStringReallocations;
+    struct HeapString grown;
+    heapStringInit(&grown);
+    for (int i = 0; i < 1000; i++) {
+        heapStringAppendChar(&grown, 'x');
+        assert(strlen(grown.contents) == grown.length);
+    }
+    assert(counters.heapStringAllocations + counters.heapStringReallocations - allocationsBefore == 3);
+    heapStringFreeContents(&grown);
+    /* when malloc can't give the arena a block we get NULL and what's already in the arena is left alone */
+    char* kept = arenaStrdup(&connection->arena, "kept");
+    assert(NULL == arenaAlloc(&connection->arena, SIZE_MAX / 4 * 3));
+    assert(NULL == arenaRealloc(&connection->arena, kept, 5, SIZE_MAX / 4 * 3) && 0 == strcmp(kept, "kept"));
+    assert(NULL != arenaAlloc(&connection->arena, 16));
+    connectionFree(connection);
+}
+
+static void testRequestStorage() {
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    struct Connection* connection = connectionAlloc(&server);
+    struct Request* request = &connection->request;
+    assert(0 == strcmp(request->pathDecoded, ""));
+    /* a short GET only takes the initial sizes out of the arena */
+    const char* shortGET = "GET /a%20b HTTP/1.1\r\nHost: a\r\nAccept: */*\r\n\r\n";
+    requestParse(request, shortGET, strlen(shortGET));
+    assert(RequestParseStateDone == request->state && 0 == strcmp(request->pathDecoded, "/a b"));
+    assert(REQUEST_HEADERS_INITIAL_COUNT == request->headersCapacity && arenaOwns(&connection->arena, request->headers));
+#if !EWS_HEADER_SLICES
+    assert(REQUEST_HEADERS_INITIAL_MEMORY == request->headersStringPoolCapacity && arenaOwns(&connection->arena, request->headersStringPool));
+#endif
+    requestReset(request);
+    assert(NULL == request->headers && 0 == request->headersCapacity && 0 == strcmp(request->pathDecoded, ""));
+    /* lots of long headers make the array and the pool grow (and move), and the headers follow their strings */
+    struct HeapString manyHeaders;
+    heapStringInit(&manyHeaders);
+    heapStringAppendString(&manyHeaders, "GET / HTTP/1.1\r\n");
+    for (int i = 0; i < 40; i++) {
+        heapStringAppendFormat(&manyHeaders, "X-Header-%d: %0100d\r\n", i, i);
+    }
+    heapStringAppendString(&manyHeaders, "\r\n");
+    requestParse(request, manyHeaders.contents, manyHeaders.length);
+    assert(RequestParseStateDone == request->state && 40 == request->headersCount && !request->warnings.headersStringPoolExhausted);
+    assert(request->headersCapacity >= 40 && request->headersCapacity <= REQUEST_MAX_HEADERS);
+    for (int i = 0; i < 40; i++) {
+        char expected[128];
+        snprintf(expected, sizeof(expected), "X-Header-%d", i);
+        assert(poolStringEquals(&request->headers[i].name, expected));
+        snprintf(expected, sizeof(expected), "%0100d", i);
+        assert(poolStringEquals(&request->headers[i].value, expected));
+    }
+    heapStringFreeContents(&manyHeaders);
+    requestReset(request);
+    /* when the arena can't get another block the headers are dropped like with an exhausted pool, and a request line
+     we can't decode the path of is a 400 */
+    const char* requestLine = "GET /a HTTP/1.1\r\n";
+    requestParse(request, requestLine, strlen(requestLine));
+    connection->arena.blocks->used = connection->arena.blocks->capacity;
+    connection->arena.nextBlockSize = SIZE_MAX / 4 * 3;
+    const char* headers = "Host: a\r\n\r\n";
+    requestParse(request, headers, strlen(headers));
+    assert(RequestParseStateDone == request->state && 0 == request->headersCount && request->warnings.headersStringPoolExhausted);
+    assert(0 == strcmp(request->pathDecoded, "/a"));
+    requestReset(request);
+    connection->arena.blocks->used = connection->arena.blocks->capacity;
+    requestParse(request, shortGET, strlen(shortGET));
+    assert(RequestParseStateBadRequest == request->state && 0 == strcmp(request->pathDecoded, ""));
+    requestReset(request);
+    connectionFree(connection);
+    /* a zeroed request has no pathDecoded until the parser gets to it, and serving files from it is just a 400 */
+    struct Request* zeroed = (struct Request*) calloc(1, sizeof(*zeroed));
+    struct Response* response = responseAllocServeFileFromRequestPath("/", zeroed->path, zeroed->pathDecoded, ".");
+    assert(400 == response->code);
+    responseFree(response);
+    assert(0 == requestParse(zeroed, "", 0) && 0 == strcmp(zeroed->pathDecoded, ""));
+    requestReset(zeroed);
+    free(zeroed);
+}
+
+static void testConnectionPool() {
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    server.connectionPoolSize = 1;
+    for (int hugePages = 0; hugePages < 2; hugePages++) {
+        server.connectionPoolHugePages = hugePages;
+        struct ConnectionPool* pool = connectionPoolCreate(&server);
+        currentConnectionPool = pool;
+        int64_t hitsBefore = counters.connectionPoolHits;
+        int64_t missesBefore = counters.connectionPoolMisses;
+        struct Connection* first = connectionAlloc(&server);
+        struct Connection* second = connectionAlloc(&server);
+        assert(first->pool == pool && 2 == counters.connectionPoolMisses - missesBefore);
+        const char* requestString = "POST /a?x=1 HTTP/1.1\r\nHost: a\r\nContent-Length: 5\r\n\r\nhello";
+        requestParse(&first->request, requestString, strlen(requestString));
+        assert(RequestParseStateDone == first->request.state && NULL != requestGETParam(&first->request, "x", NULL));
+        first->keepAlive = true;
+        first->status.bytesSent = 100;
+        first->timeoutSinceMilliseconds = 5;
+        connectionFree(first);
+        /* this one is over the cap so it's freed, unless it came out of a huge page */
+        second->keepAlive = true;
+        connectionFree(second);
+        struct Connection* recycled = connectionAlloc(&server);
+        assert(recycled == (hugePages ? second : first) && 1 == counters.connectionPoolHits - hitsBefore);
+        assert(!recycled->keepAlive && 0 == recycled->status.bytesSent && 0 == recycled->timeoutSinceMilliseconds && NULL == recycled->poolNext);
+        assert(recycled->receiveBuffer == recycled->sendRecvBuffer && recycled->sendRecvBufferSize == recycled->receiveCapacity);
+        assert(recycled->request.arena == &recycled->arena && NULL == recycled->request.GETParams && NULL == recycled->request.body.contents);
+        assert(RequestParseStateMethod == recycled->request.state && 0 == recycled->request.pathLength && '\0' == recycled->request.path[0]);
+        assert(0 == recycled->request.headersCount && 0 == recycled->request.headerIndexByID[HeaderIDContentLength]);
+        requestString = "GET /b HTTP/1.1\r\n\r\n";
+        requestParse(&recycled->request, requestString, strlen(requestString));
+        assert(RequestParseStateDone == recycled->request.state && 0 == strcmp(recycled->request.path, "/b"));
+#if EWS_HUGE_PAGES_SUPPORTED
+        assert(hugePages == (NULL != pool->slabs) && hugePages == recycled->fromPoolSlab);
+#endif
+        /* the accept loop is done but a connection is still out. The pool goes when it comes back */
+        currentConnectionPool = NULL;
+        connectionPoolRelease(pool);
+        connectionFree(recycled);
+    }
+    server.connectionPoolSize = -1;
+    assert(NULL == connectionPoolCreate(&server));
+}
+
+static void testServerProfiles() {
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    assert(KEEP_ALIVE_DEFAULT_TIMEOUT_SECONDS == serverSetting(&server, keepAliveTimeoutSeconds));
+    assert(THREAD_POOL_DEFAULT_SIZE == serverSetting(&server, threadPoolSize));
+    server.profile = ServerProfileSmallEmbedded;
+    struct Connection* connection = connectionAlloc(&server);
+    assert(4 * 1024 == connection->sendRecvBufferSize && connection->sendRecvBuffer == (char*) connection + sizeof(*connection));
+    assert(connection->receiveBuffer == connection->sendRecvBuffer && 0 == (uintptr_t) connection % EWS_CACHE_LINE_SIZE);
+    assert(0 == offsetof(struct Connection, request) % EWS_CACHE_LINE_SIZE);
+    const char* requestString = "GET /short HTTP/1.1\r\nHost: a\r\n\r\n";
+    requestParse(&connection->request, requestString, strlen(requestString));
+    assert(RequestParseStateDone == connection->request.state && 0 == strcmp(connection->request.path, "/short"));
+    connectionFree(connection);
+    server.profile = ServerProfileProxyFacing;
+    server.keepAliveTimeoutSeconds = 7;
+    assert(7 == serverSetting(&server, keepAliveTimeoutSeconds) && 64 == serverSetting(&server, threadPoolSize));
+    server.connectionBufferSize = 1000;
+    connection = connectionAlloc(&server);
+    assert(1000 == connection->sendRecvBufferSize && 1000 == connection->receiveCapacity);
+    connectionFree(connection);
+}
+
+static void testConnectionTimeouts() {
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    server.shouldRun = true;
+    server.bodyTimeoutSeconds = -1;
+    assert(1000 * HEADER_TIMEOUT_DEFAULT_SECONDS == connectionTimeoutMilliseconds(&server, ConnectionTimeoutHeader));
+    assert(0 == connectionTimeoutMilliseconds(&server, ConnectionTimeoutBody));
+    struct Connection* first = connectionAlloc(&server);
+    struct Connection* second = connectionAlloc(&server);
+    assert(ConnectionTimeoutHeader == connectionReceiveTimeout(first));
+    const char* requestString = "POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\nhe";
+    requestParse(&first->request, requestString, strlen(requestString));
+    assert(ConnectionTimeoutBody == connectionReceiveTimeout(first));
+    requestReset(&first->request);
+    first->status.requestsHandled = 1;
+    assert(ConnectionTimeoutIdle == connectionReceiveTimeout(first));
+    requestString = "GET / HT";
+    requestParse(&first->request, requestString, strlen(requestString));
+    assert(ConnectionTimeoutHeader == connectionReceiveTimeout(first));
+#if EWS_EVENT_LOOP_SUPPORTED
+    struct ConnectionTimers timers;
+    memset(&timers, 0, sizeof(timers));
+    ConnectionTimeout timeout;
+    connectionTimerStart(&timers, first, ConnectionTimeoutHeader);
+    connectionTimerStart(&timers, second, ConnectionTimeoutBody);
+    /* the body timeout is turned off so second isn't on any list */
+    assert(ConnectionTimeoutNone == second->timeout && NULL == timers.head[ConnectionTimeoutBody]);
+    connectionTimerStart(&timers, second, ConnectionTimeoutIdle);
+    assert(NULL == connectionTimersExpire(&timers, &server, &timeout));
+    /* more of the headers don't restart the header timeout */
+    first->timeoutSinceMilliseconds -= 1000 * HEADER_TIMEOUT_DEFAULT_SECONDS;
+    connectionTimerStart(&timers, first, ConnectionTimeoutHeader);
+    assert(first == connectionTimersExpire(&timers, &server, &timeout) && ConnectionTimeoutHeader == timeout);
+    assert(ConnectionTimeoutNone == first->timeout && NULL == timers.head[ConnectionTimeoutHeader] && NULL == timers.tail[ConnectionTimeoutHeader]);
+    /* progress restarts the send timeout */
+    connectionTimerStart(&timers, first, ConnectionTimeoutSend);
+    first->timeoutSinceMilliseconds -= 1000 * SEND_TIMEOUT_DEFAULT_SECONDS;
+    connectionTimerStart(&timers, first, ConnectionTimeoutSend);
+    assert(NULL == connectionTimersExpire(&timers, &server, &timeout));
+    /* idle connections go as soon as the server stops, the others still get their time */
+    server.shouldRun = false;
+    assert(second == connectionTimersExpire(&timers, &server, &timeout) && ConnectionTimeoutNone == timeout);
+    assert(NULL == connectionTimersExpire(&timers, &server, &timeout));
+    connectionTimerStop(&timers, first);
+    assert(ConnectionTimeoutNone == first->timeout && NULL == timers.head[ConnectionTimeoutSend] && NULL == timers.tail[ConnectionTimeoutSend]);
+#endif
+    connectionFree(first);
+    connectionFree(second);
+}
+
+static void testAdmissionControl() {
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    serverInit(&server);
+    server.maxActiveConnections = 1;
+    server.maxInFlightRequests = 1;
+    int64_t rejectedBefore = counters.connectionsRejected;
+#ifndef WIN32
+    int sockets[2];
+    assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+    assert(connectionAdmit(&server, sockets[0]) && 1 == server.activeConnectionCount);
+    struct Connection* connection = connectionAlloc(&server);
+    connectionRequestStarted(connection);
+    assert(connection->requestInFlight && 1 == server.inFlightRequestCount);
+    /* over the connection limit: the 503 goes out and the socket is closed */
+    assert(!connectionAdmit(&server, sockets[0]));
+    char received[256] = { 0 };
+    assert(recv(sockets[1], received, sizeof(received) - 1, 0) > 0 && NULL != strstr(received, "HTTP/1.1 503") && NULL != strstr(received, "Retry-After: 1\r\n"));
+    assert(0 == recv(sockets[1], received, sizeof(received), 0));
+    close(sockets[1]);
+    /* under the connection limit but over the in-flight one */
+    server.maxActiveConnections = -1;
+    assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+    assert(!connectionAdmit(&server, sockets[0]) && 1 == server.activeConnectionCount);
+    close(sockets[1]);
+    /* a connection we let in but then can't queue gets its admission taken back and the same 503 */
+    server.maxInFlightRequests = -1;
+    assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+    assert(connectionAdmit(&server, sockets[0]) && 2 == server.activeConnectionCount);
+    connectionUnadmit(&server, sockets[0]);
+    assert(1 == server.activeConnectionCount);
+    assert(recv(sockets[1], received, sizeof(received) - 1, 0) > 0 && NULL != strstr(received, "HTTP/1.1 503"));
+    close(sockets[1]);
+    assert(3 == counters.connectionsRejected - rejectedBefore);
+    connectionRequestFinished(connection);
+    connectionRequestFinished(connection);
+    assert(!connection->requestInFlight && 0 == server.inFlightRequestCount);
+    connectionFree(connection);
+#endif
+    /* the small embedded profile has a connection limit of its own */
+    server.maxActiveConnections = 0;
+    server.maxInFlightRequests = 0;
+    server.profile = ServerProfileSmallEmbedded;
+    assert(32 == serverSettingUnlessOff(&server, maxActiveConnections) && 0 == serverSettingUnlessOff(&server, maxInFlightRequests));
+    serverDeInit(&server);
+}
+
+static void testThreadPoolIdleKeepAlive() {
+#ifndef WIN32
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    serverInit(&server);
+    server.keepAliveTimeoutSeconds = 60;
+    struct Connection* queued[3];
+    struct ConnectionQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.connections = queued;
+    queue.capacity = 3;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.notEmpty, NULL);
+    pthread_t workers[2];
+    for (int i = 0; i < 2; i++) {
+        assert(0 == pthread_create(&workers[i], NULL, &threadPoolWorker, &queue));
+    }
+    /* the first two clients leave both workers waiting on idle keep-alive connections. The third is only answered if one
+     of them lets its idle connection go instead of waiting out the keep-alive timeout */
+    const char* requestString = "GET / HTTP/1.1\r\nHost: a\r\n\r\n";
+    char received[256];
+    int clients[3];
+    for (int i = 0; i < 3; i++) {
+        int sockets[2];
+        assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+        clients[i] = sockets[1];
+        socketSetTimeout(clients[i], SO_RCVTIMEO, 5000);
+        assert(connectionAdmit(&server, sockets[0]));
+        struct Connection* connection = connectionAlloc(&server);
+        connection->socketfd = sockets[0];
+        pthread_mutex_lock(&queue.lock);
+        queue.connections[(queue.head + queue.count) % queue.capacity] = connection;
+        queue.count++;
+        pthread_cond_signal(&queue.notEmpty);
+        pthread_mutex_unlock(&queue.lock);
+        assert(send(clients[i], requestString, strlen(requestString), 0) > 0);
+        assert(recv(clients[i], received, sizeof(received), 0) > 0);
+    }
+    pthread_mutex_lock(&queue.lock);
+    queue.stopping = true;
+    pthread_cond_broadcast(&queue.notEmpty);
+    pthread_mutex_unlock(&queue.lock);
+    server.shouldRun = false;
+    for (int i = 0; i < 2; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    for (int i = 0; i < 3; i++) {
+        close(clients[i]);
+    }
+    assert(0 == server.activeConnectionCount);
+    pthread_cond_destroy(&queue.notEmpty);
+    pthread_mutex_destroy(&queue.lock);
+    serverDeInit(&server);
+#endif
+}
+
+#if EWS_IO_URING_SUPPORTED
+static int testIOUringEnterBusy(int ringfd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    (void) ringfd; (void) toSubmit; (void) minComplete; (void) flags;
+    errno = EBUSY;
+    return -1;
+}
+
+static int testIOUringEnterFails(int ringfd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    (void) ringfd; (void) toSubmit; (void) minComplete; (void) flags;
+    errno = EINVAL;
+    return -1;
+}
+#endif
+
+static void testIOUringEnterFailure() {
+#if EWS_IO_URING_SUPPORTED
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    serverInit(&server);
+    struct IOUring ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.server = &server;
+    ring.listenerfd = -1;
+    if (!ioUringInit(&ring)) {
+        /* no io_uring on this kernel, so there's nothing to test */
+        ioUringDestroy(&ring);
+        serverDeInit(&server);
+        return;
+    }
+    /* a full submission queue the kernel won't take any of right now gives NULL instead of spinning */
+    ring.enter = testIOUringEnterBusy;
+    for (unsigned i = 0; i < ring.sqEntries; i++) {
+        assert(NULL != ioUringNextSQE(&ring));
+    }
+    assert(NULL == ioUringNextSQE(&ring));
+    /* the kernel never saw those, so just take them back */
+    *ring.sqTail = *ring.sqHead;
+    ring.toSubmit = 0;
+    /* when io_uring_enter fails for good, the connections waiting on it are closed instead of leaked */
+    ring.enter = testIOUringEnterFails;
+    int sockets[2][2];
+    for (int i = 0; i < 2; i++) {
+        assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sockets[i]));
+        assert(connectionAdmit(&server, sockets[i][0]));
+        struct Connection* connection = connectionAlloc(&server);
+        connection->socketfd = sockets[i][0];
+        connectionStarted(connection);
+        assert(ioUringQueueRecv(&ring, connection));
+        ioUringConnectionAdd(&ring, connection);
+    }
+    assert(!ioUringLoop(&ring));
+    assert(NULL == ring.connections && NULL == server.activeConnections && 0 == server.activeConnectionCount);
+    for (int i = 0; i < 2; i++) {
+        char received;
+        assert(0 == recv(sockets[i][1], &received, 1, 0));
+        close(sockets[i][1]);
+    }
+    ioUringDestroy(&ring);
+    serverDeInit(&server);
+#endif
+}
+
+static void testDrainCutOff() {
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    serverInit(&server);
+    assert(STOP_DRAIN_DEFAULT_SECONDS == serverSettingUnlessOff(&server, stopDrainSeconds));
+#ifndef WIN32
+    int sockets[2][2];
+    struct Connection* connections[2];
+    for (int i = 0; i < 2; i++) {
+        assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sockets[i]));
+        assert(connectionAdmit(&server, sockets[i][0]));
+        connections[i] = connectionAlloc(&server);
+        connections[i]->socketfd = sockets[i][0];
+        connectionStarted(connections[i]);
+    }
+    assert(connections[1] == server.activeConnections && connections[0] == connections[1]->activeNext);
+    /* the first one finishes on its own, the second is still open at the deadline */
+    connectionFinished(connections[0]);
+    assert(connections[1] == server.activeConnections && NULL == connections[1]->activeNext && NULL == connections[1]->activePrevious);
+    assert(1 == serverCutOffConnections(&server));
+    char received[16];
+    assert(0 == recv(sockets[1][1], received, sizeof(received), 0));
+    connectionFinished(connections[1]);
+    assert(NULL == server.activeConnections && 0 == server.activeConnectionCount);
+    close(sockets[0][1]);
+    close(sockets[1][1]);
+#endif
+    serverDeInit(&server);
 }
 
 void EWSUnitTestsRun() {
     testHeapString();
     teststrdupHTMLEscape();
     teststrdupEscape();
+    testRequestParams();
     testPathEscapesRoot();
     testPathMatching();
     testURLDecode();
+    testKeepAlive();
+    testPipelining();
+    testRequestParse();
+    testHeaderIDs();
+    testReceiveBuffer();
+    testBodyHandler();
+    testChunkedBody();
+    testExpectContinue();
+    testBodySpill();
+    testMultipart();
+    testArena();
+    testRequestStorage();
+    testConnectionPool();
+    testServerProfiles();
+    testConnectionTimeouts();
+    testAdmissionControl();
+    testThreadPoolIdleKeepAlive();
+    testIOUringEnterFailure();
+    testDrainCutOff();
     /* reset counters from tests */
     memset(&counters, 0, sizeof(counters));
 }
@@ -2275,6 +7663,15 @@ static int pthread_detach(pthread_t threadHandle) {
     return 0;
 }
 
+static int pthread_join(pthread_t threadHandle, void** result) {
+    WaitForSingleObject(threadHandle, INFINITE);
+    CloseHandle(threadHandle);
+    if (NULL != result) {
+        *result = NULL;
+    }
+    return 0;
+}
+
 static int pthread_create(HANDLE* threadHandle, const void* attributes, LPTHREAD_START_ROUTINE threadRoutine, void* params) {
     *threadHandle = CreateThread(NULL, 0, threadRoutine, params, 0, NULL);
     if (INVALID_HANDLE_VALUE == *threadHandle) {
@@ -2301,6 +7698,11 @@ static int pthread_cond_signal(pthread_cond_t* cond) {
     return 0;
 }
 
+static int pthread_cond_broadcast(pthread_cond_t* cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
+
 static int pthread_cond_destroy(pthread_cond_t* cond) {
     return 0;
 }
@@ -2351,6 +7753,44 @@ static FILE* fopen_utf8_path(const char* utf8Path, const char* mode) {
     return fp;
 }
 
+/* option is SO_RCVTIMEO or SO_SNDTIMEO */
+static void socketSetTimeout(sockettype socketfd, int option, int milliseconds) {
+    DWORD timeout = (DWORD) milliseconds;
+    if (0 != setsockopt(socketfd, SOL_SOCKET, option, (const char*) &timeout, sizeof(timeout))) {
+        ews_printf_debug("setsockopt(%s) failed with WSAGetLastError() = %d\n", SO_RCVTIMEO == option ? "SO_RCVTIMEO" : "SO_SNDTIMEO", WSAGetLastError());
+    }
+}
+
+static int64_t monotonicMilliseconds() {
+    return (int64_t) GetTickCount64();
+}
+
+/* pthread_cond_wait that gives up after milliseconds */
+static void conditionWaitMilliseconds(pthread_cond_t* cond, pthread_mutex_t* mutex, int milliseconds) {
+#ifndef WIN_PTHREADS_H
+    SleepConditionVariableCS(cond, mutex, (DWORD) milliseconds);
+#else
+    struct timespec until;
+    timespec_get(&until, TIME_UTC);
+    until.tv_sec += milliseconds / 1000;
+    until.tv_nsec += (long) (milliseconds % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(cond, mutex, &until);
+#endif
+}
+
+static bool socketErrorIsTimeout() {
+    return WSAETIMEDOUT == WSAGetLastError();
+}
+
+static void threadPinToCPU(int cpuIndex) {
+    (void) cpuIndex;
+    ews_printf("Warning: listenerShardsPinToCPUs is not supported on Windows. Ignoring...\n");
+}
+
 #if UNDEFINE_CRT_SECURE_NO_WARNINGS
 #undef _CRT_SECURE_NO_WARNINGS
 #endif
@@ -2361,6 +7801,55 @@ static void callWSAStartupIfNecessary() {
 
 }
 
+/* option is SO_RCVTIMEO or SO_SNDTIMEO */
+static void socketSetTimeout(sockettype socketfd, int option, int milliseconds) {
+    struct timeval timeout;
+    timeout.tv_sec = milliseconds / 1000;
+    timeout.tv_usec = (milliseconds % 1000) * 1000;
+    if (0 != setsockopt(socketfd, SOL_SOCKET, option, &timeout, sizeof(timeout))) {
+        ews_printf_debug("setsockopt(%s) failed with %s = %d\n", SO_RCVTIMEO == option ? "SO_RCVTIMEO" : "SO_SNDTIMEO", strerror(errno), errno);
+    }
+}
+
+static int64_t monotonicMilliseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* pthread_cond_wait that gives up after milliseconds. pthread_cond_timedwait wants a CLOCK_REALTIME time */
+static void conditionWaitMilliseconds(pthread_cond_t* cond, pthread_mutex_t* mutex, int milliseconds) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += milliseconds / 1000;
+    until.tv_nsec += (long) (milliseconds % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(cond, mutex, &until);
+}
+
+static bool socketErrorIsTimeout() {
+    return EAGAIN == errno || EWOULDBLOCK == errno;
+}
+
+static void threadPinToCPU(int cpuIndex) {
+#if defined(__linux__) && defined(CPU_SET) /* cpu_set_t needs _GNU_SOURCE */
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpuIndex % (cpuCount > 0 ? cpuCount : 1), &cpus);
+    /* 0 = the calling thread */
+    if (0 != sched_setaffinity(0, sizeof(cpus), &cpus)) {
+        ews_printf("Warning: could not pin listener shard %d to a CPU. sched_setaffinity failed with %s = %d\n", cpuIndex, strerror(errno), errno);
+    }
+#else
+    (void) cpuIndex;
+    ews_printf("Warning: listenerShardsPinToCPUs needs Linux and _GNU_SOURCE. Ignoring...\n");
+#endif
+}
+
 static void ignoreSIGPIPE() {
     void* previousSIGPIPEHandler = (void*) signal(SIGPIPE, &SIGPIPEHandler);
     if (NULL != previousSIGPIPEHandler && previousSIGPIPEHandler != &SIGPIPEHandler) {